@@ -0,0 +1,27 @@
+#ifndef _VECTORIZE_VEC_H
+#define _VECTORIZE_VEC_H 1
+
+#include "lua.h"
+
+// static so that every module including this header gets its own copy,
+// since the symbols of vec itself are usually not visible to other modules
+static const char vector_mt_name[] = "vector";
+
+typedef enum VectorStorage {
+  VEC_STORAGE_OWNED = 0, // values is malloc'd by this vector and resizable
+  VEC_STORAGE_VIEW,      // values belongs to another object
+  VEC_STORAGE_SHARED,    // values is in a buffer shared with other lua_States
+  VEC_STORAGE_READONLY,  // like VEC_STORAGE_SHARED, but must not be written
+} VectorStorage;
+
+typedef struct Vector {
+  lua_Number *values;
+  lua_Integer len;
+  lua_Integer capacity;
+  VectorStorage storage;
+} Vector;
+
+int vec_new(lua_State *L);
+int vec_from(lua_State *L);
+
+#endif /* ifndef _VECTORIZE_VEC_H */
@@ -0,0 +1,125 @@
+#ifndef _VECTORIZE_VEC_EXT_H
+#define _VECTORIZE_VEC_EXT_H 1
+
+#include "lauxlib.h"
+#include "lua.h"
+
+#include "vector.h"
+
+/*
+ * Extension interface for native modules which want to add their own
+ * element-wise kernels and reductions to the vec library.
+ *
+ * Kernels only see spans of numbers. The library takes care of argument
+ * checking, allocating results, registering both the name and name_
+ * (in-place) variants, and splitting long vectors into chunks of at most
+ * VEC_EXT_CHUNK_SIZE elements per kernel call.
+ *
+ * Usage, from the luaopen_* function of another module:
+ *
+ *   const VecExtAPI *api = vec_ext_api(L);
+ *   api->register_map(L, "softsign", &softsign_kernel, NULL);
+ *
+ * after which `v:softsign()` and `v:softsign_([out])` are available.
+ */
+
+// 2: added VEC_STORAGE_SHARED and VEC_STORAGE_READONLY
+#define VEC_EXT_ABI_VERSION 2
+#define VEC_EXT_CHUNK_SIZE 4096
+#define VEC_EXT_MAX_ARGS 8
+
+/*
+ * out[i] = f(x[i]) for 0 <= i < n. out may be the same array as x.
+ * args holds the nargs numbers passed after the vector in the Lua call, so
+ * `v:f(a, b)` calls the kernel with args = {a, b}.
+ */
+typedef void (*vec_map_kernel)(
+  const lua_Number *x,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud);
+
+/*
+ * out[i] = f(x[i], y[i]) for 0 <= i < n. out may be the same array as x or
+ * y.
+ */
+typedef void (*vec_zip_kernel)(
+  const lua_Number *x,
+  const lua_Number *y,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud);
+
+/*
+ * Fold a span into the accumulator and return the new accumulator. The first
+ * call receives the initial value given at registration.
+ */
+typedef lua_Number (*vec_reduce_kernel)(
+  const lua_Number *x,
+  lua_Integer n,
+  lua_Number acc,
+  const lua_Number *args,
+  int nargs,
+  void *ud);
+
+typedef struct VecExtAPI {
+  int abi_version;
+
+  void (*register_map)(
+    lua_State *L, const char *name, vec_map_kernel kernel, void *ud);
+  void (*register_zip)(
+    lua_State *L, const char *name, vec_zip_kernel kernel, void *ud);
+  void (*register_reduce)(
+    lua_State *L,
+    const char *name,
+    vec_reduce_kernel kernel,
+    lua_Number init,
+    void *ud);
+
+  /*
+   * For modules writing their own lua_CFunctions over vectors. Those must
+   * respect Vector.storage: never write to the values of a
+   * VEC_STORAGE_READONLY vector, and only resize VEC_STORAGE_OWNED ones.
+   * Registered kernels need no such care, as the library checks their output.
+   */
+  Vector *(*check_vector)(lua_State *L, int idx);
+  Vector *(*push_vector)(lua_State *L, lua_Integer len);
+} VecExtAPI;
+
+#define VEC_EXT_API_KEY "vector_ext_api"
+
+/*
+ * Load the vec library if needed and return its extension interface.
+ * Raises a Lua error if the library is missing or has an incompatible ABI.
+ */
+static inline const VecExtAPI *vec_ext_api(lua_State *L) {
+  const VecExtAPI *api;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, VEC_EXT_API_KEY);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "vec");
+    lua_call(L, 1, 0);
+    lua_getfield(L, LUA_REGISTRYINDEX, VEC_EXT_API_KEY);
+  }
+  api = (const VecExtAPI *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+
+  if (api == NULL) {
+    luaL_error(L, "vec library does not provide an extension interface");
+  } else if (api->abi_version != VEC_EXT_ABI_VERSION) {
+    luaL_error(
+      L,
+      "vec extension ABI mismatch: library has version %d, expected %d",
+      api->abi_version,
+      VEC_EXT_ABI_VERSION);
+  }
+  return api;
+}
+
+#endif /* ifndef _VECTORIZE_VEC_EXT_H */
@@ -0,0 +1,47 @@
+#include "lauxlib.h"
+#include "lua.h"
+
+#include "ext_test.h"
+#include "vector.h"
+
+// Native extension used by tests/vec/ext_spec.lua to exercise the public
+// extension interface. Build it with
+//   luarocks make tests/ext/vectorize-ext-test-scm-0.rockspec
+
+static int chunk_calls = 0;
+
+static int ext_test_calls(lua_State *L) {
+  lua_pushinteger(L, chunk_calls);
+  chunk_calls = 0;
+  return 1;
+}
+
+static int ext_test_double(lua_State *L) {
+  const VecExtAPI *api = vec_ext_api(L);
+  Vector *x = api->check_vector(L, 1);
+  Vector *new = api->push_vector(L, x->len);
+  for (lua_Integer i = 0; i < x->len; i++) {
+    new->values[i] = 2 * x->values[i];
+  }
+  return 1;
+}
+
+extern int luaopen_vec_ext_test(lua_State *L) {
+  const VecExtAPI *api = vec_ext_api(L);
+  api->register_map(L, "ext_affine", &ext_test_affine, NULL);
+  api->register_map(L, "ext_chunk_len", &ext_test_chunk_len, &chunk_calls);
+  api->register_map(L, "ext_nargs", &ext_test_nargs, NULL);
+  api->register_zip(L, "ext_hypot", &ext_test_hypot, NULL);
+  api->register_reduce(L, "ext_sumsq", &ext_test_sumsq, 0, NULL);
+
+  lua_newtable(L);
+  lua_pushcfunction(L, &ext_test_calls);
+  lua_setfield(L, -2, "calls");
+  lua_pushcfunction(L, &ext_test_double);
+  lua_setfield(L, -2, "double");
+  lua_pushinteger(L, VEC_EXT_CHUNK_SIZE);
+  lua_setfield(L, -2, "chunk_size");
+  lua_pushinteger(L, VEC_EXT_MAX_ARGS);
+  lua_setfield(L, -2, "max_args");
+  return 1;
+}
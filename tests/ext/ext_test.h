@@ -0,0 +1,53 @@
+#ifndef _VECTORIZE_EXT_TEST_H
+#define _VECTORIZE_EXT_TEST_H 1
+
+#include "vector_ext.h"
+
+/*
+ * Kernels of the test extension. They live in their own translation unit,
+ * which also includes vector_ext.h, so the spec catches headers that can't
+ * be linked into a module built from several files.
+ */
+
+void ext_test_affine(
+  const lua_Number *x,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud);
+
+void ext_test_chunk_len(
+  const lua_Number *x,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud);
+
+void ext_test_nargs(
+  const lua_Number *x,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud);
+
+void ext_test_hypot(
+  const lua_Number *x,
+  const lua_Number *y,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud);
+
+lua_Number ext_test_sumsq(
+  const lua_Number *x,
+  lua_Integer n,
+  lua_Number acc,
+  const lua_Number *args,
+  int nargs,
+  void *ud);
+
+#endif /* ifndef _VECTORIZE_EXT_TEST_H */
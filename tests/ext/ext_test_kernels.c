@@ -0,0 +1,72 @@
+#include <math.h>
+
+#include "ext_test.h"
+
+void ext_test_affine(
+  const lua_Number *x,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud) {
+  lua_Number a = nargs > 0 ? args[0] : 1, b = nargs > 1 ? args[1] : 0;
+  for (lua_Integer i = 0; i < n; i++) {
+    out[i] = a * x[i] + b;
+  }
+}
+
+void ext_test_chunk_len(
+  const lua_Number *x,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud) {
+  // counts the calls in the integer pointed to by ud
+  (*(int *)ud)++;
+  for (lua_Integer i = 0; i < n; i++) {
+    out[i] = (lua_Number)n;
+  }
+}
+
+void ext_test_nargs(
+  const lua_Number *x,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud) {
+  lua_Number total = 0;
+  for (int j = 0; j < nargs; j++) {
+    total += args[j];
+  }
+  for (lua_Integer i = 0; i < n; i++) {
+    out[i] = nargs + total / 1000;
+  }
+}
+
+void ext_test_hypot(
+  const lua_Number *x,
+  const lua_Number *y,
+  lua_Number *out,
+  lua_Integer n,
+  const lua_Number *args,
+  int nargs,
+  void *ud) {
+  for (lua_Integer i = 0; i < n; i++) {
+    out[i] = sqrt(x[i] * x[i] + y[i] * y[i]);
+  }
+}
+
+lua_Number ext_test_sumsq(
+  const lua_Number *x,
+  lua_Integer n,
+  lua_Number acc,
+  const lua_Number *args,
+  int nargs,
+  void *ud) {
+  for (lua_Integer i = 0; i < n; i++) {
+    acc += x[i] * x[i];
+  }
+  return acc;
+}
@@ -0,0 +1,152 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local test_comparison
+
+describe(
+  "comparison",
+  function()
+    describe(
+      "vec.lt",
+      function()
+        test_comparison(
+          vec.lt,
+          function(a, b)
+            return a < b
+          end
+        )
+      end
+    )
+    describe(
+      "vec.le",
+      function()
+        test_comparison(
+          vec.le,
+          function(a, b)
+            return a <= b
+          end
+        )
+      end
+    )
+    describe(
+      "vec.gt",
+      function()
+        test_comparison(
+          vec.gt,
+          function(a, b)
+            return a > b
+          end
+        )
+      end
+    )
+    describe(
+      "vec.ge",
+      function()
+        test_comparison(
+          vec.ge,
+          function(a, b)
+            return a >= b
+          end
+        )
+      end
+    )
+    describe(
+      "vec.eq",
+      function()
+        test_comparison(
+          vec.eq,
+          function(a, b)
+            return a == b
+          end
+        )
+      end
+    )
+    describe(
+      "vec.ne",
+      function()
+        test_comparison(
+          vec.ne,
+          function(a, b)
+            return a ~= b
+          end
+        )
+      end
+    )
+  end
+)
+
+describe(
+  "predicate",
+  function()
+    it(
+      "isnan and isfinite",
+      function()
+        local v = vec {1, 0 / 0, math.huge, -math.huge}
+        local nan = v:isnan()
+        local finite = v:isfinite()
+        assert.are.equal(0, nan[1])
+        assert.are.equal(1, nan[2])
+        assert.are.equal(0, nan[3])
+        assert.are.equal(1, finite[1])
+        assert.are.equal(0, finite[2])
+        assert.are.equal(0, finite[3])
+        assert.are.equal(0, finite[4])
+      end
+    )
+    it(
+      "any, all and count_nonzero",
+      function()
+        local v = vec(1000)
+        assert.are.equal(false, v:any())
+        assert.are.equal(false, v:all())
+        assert.are.equal(0, v:count_nonzero())
+
+        v[700] = 1
+        assert.are.equal(true, v:any())
+        assert.are.equal(1, v:count_nonzero())
+
+        assert.are.equal(true, vec.ones(1000):all())
+      end
+    )
+  end
+)
+
+function test_comparison(vec_op, scalar_op)
+  local function as_number(b)
+    return b and 1 or 0
+  end
+
+  it(
+    "can be used element-wise",
+    function()
+      local u = vec {3, 2, 1}
+      local v = vec {1, 2, 3}
+      local w = vec_op(u, v)
+      for i = 1, #w do
+        assert.are.equal(as_number(scalar_op(u[i], v[i])), w[i])
+      end
+    end
+  )
+  it(
+    "can broadcast scalars",
+    function()
+      local u = vec {1, 2, 3}
+      local r = vec_op(u, 2)
+      local l = vec_op(2, u)
+      for i = 1, #u do
+        assert.are.equal(as_number(scalar_op(u[i], 2)), r[i])
+        assert.are.equal(as_number(scalar_op(2, u[i])), l[i])
+      end
+    end
+  )
+  it(
+    "errors when used in vectors of different shapes",
+    function()
+      assert.has_error(
+        function()
+          vec_op(vec(2), vec(3))
+        end
+      )
+    end
+  )
+end
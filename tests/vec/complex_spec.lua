@@ -0,0 +1,84 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function assert_complex(re, im, c, i)
+  local cre, cim = c:at(i)
+  assert.near(re, cre, 1e-12)
+  assert.near(im, cim, 1e-12)
+end
+
+describe(
+  "complex vector",
+  function()
+    it(
+      "should be created from real and imaginary parts",
+      function()
+        local c = vec.complex(vec {1, 2}, vec {3, 4})
+        assert.are.equal(2, #c)
+        assert_complex(1, 3, c, 1)
+        assert_complex(2, 4, c, 2)
+        assert_complex(0, 0, vec.complex(3), 3)
+      end
+    )
+    it(
+      "should expose its parts as vectors without copying",
+      function()
+        local c = vec.complex(vec {1, 2}, vec {3, 4})
+        local re = c:real()
+        local im = c:imag()
+        re:scale_(2)
+        im[1] = -1
+        assert_complex(2, -1, c, 1)
+        assert_complex(4, 4, c, 2)
+      end
+    )
+    it(
+      "views should keep the complex vector alive",
+      function()
+        local im = vec.complex(vec {1}, vec {5}):imag()
+        collectgarbage()
+        collectgarbage()
+        assert.are.equal(5, im[1])
+        assert.has.errors(
+          function()
+            im:push(1)
+          end
+        )
+      end
+    )
+    it(
+      "should support complex arithmetic",
+      function()
+        local a = vec.complex(vec {1, 0}, vec {2, 1})
+        local b = vec.complex(vec {3, 0}, vec {-1, 1})
+        assert_complex(4, 1, a + b, 1)
+        assert_complex(-2, 3, a - b, 1)
+        assert_complex(5, 5, a * b, 1)
+        assert_complex(-1, 0, a * b, 2)
+        assert_complex(0.1, 0.7, a / b, 1)
+        assert_complex(2, 4, a * 2, 1)
+        assert_complex(-1, -2, -a, 1)
+
+        a:mul_(b)
+        assert_complex(5, 5, a, 1)
+      end
+    )
+    it(
+      "should compute conj, abs, arg and exp",
+      function()
+        local c = vec.complex(vec {3, 0}, vec {4, math.pi})
+        assert_complex(3, -4, c:conj(), 1)
+        assert.are.equal(5, c:abs()[1])
+        assert.near((math.atan2 or math.atan)(4, 3), c:arg()[1], 1e-12)
+        assert_complex(-1, 0, c:exp(), 2)
+      end
+    )
+    it(
+      "polar should build phasors",
+      function()
+        local c = vec.polar(vec {2}, vec {math.pi / 2})
+        assert_complex(0, 2, c, 1)
+      end
+    )
+  end
+)
@@ -0,0 +1,120 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function assert_elements(expected, v)
+  assert.are.equal(#expected, #v)
+  for i = 1, #expected do
+    assert.are.equal(expected[i], v[i])
+  end
+end
+
+describe(
+  "cumulative",
+  function()
+    it(
+      "cumsum",
+      function()
+        assert_elements({1, 3, 6, 10}, vec {1, 2, 3, 4}:cumsum())
+      end
+    )
+    it(
+      "cumprod",
+      function()
+        assert_elements({1, 2, 6, 24}, vec {1, 2, 3, 4}:cumprod())
+      end
+    )
+    it(
+      "cummax and cummin",
+      function()
+        local v = vec {2, 1, 3, 0, 5}
+        assert_elements({2, 2, 3, 3, 5}, v:cummax())
+        assert_elements({2, 1, 1, 0, 0}, v:cummin())
+      end
+    )
+    it(
+      "can be done in place",
+      function()
+        local v = vec {1, 1, 1}
+        assert.are.equal(v, v:cumsum_())
+        assert_elements({1, 2, 3}, v)
+      end
+    )
+    it(
+      "cumtrapz ends at the same value as trapz",
+      function()
+        local x = vec.linspace(0, math.pi, 101)
+        local y = x:sin()
+        local c = y:cumtrapz(x)
+        assert.are.equal(0, c[1])
+        assert.near(y:trapz(x), c[#c], 1e-12)
+      end
+    )
+  end
+)
+
+describe(
+  "diff",
+  function()
+    it(
+      "should compute first differences by default",
+      function()
+        assert_elements({1, 2, 3}, vec {1, 2, 4, 7}:diff())
+      end
+    )
+    it(
+      "should compute higher order differences",
+      function()
+        local v = vec {1, 2, 4, 7, 11}
+        assert_elements({1, 1, 1}, v:diff(2))
+        local out = vec(2)
+        assert.are.equal(out, v:diff_(3, out))
+        assert_elements({0, 0}, out)
+      end
+    )
+    it(
+      "should shrink the vector when done in place",
+      function()
+        local v = vec {1, 4, 9, 16}
+        v:diff_()
+        assert_elements({3, 5, 7}, v)
+      end
+    )
+  end
+)
+
+describe(
+  "moving_average",
+  function()
+    it(
+      "should average over a sliding window",
+      function()
+        local v = vec {1, 2, 3, 4, 5}
+        assert_elements({2, 3, 4}, v:moving_average(3))
+        assert_elements({1, 2, 3, 4, 5}, v:moving_average(1))
+      end
+    )
+    it(
+      "should shrink the vector when done in place",
+      function()
+        local v = vec {2, 4, 6, 8}
+        v:moving_average_(2)
+        assert_elements({3, 5, 7}, v)
+      end
+    )
+    it(
+      "should error on invalid windows",
+      function()
+        assert.has.errors(
+          function()
+            vec(3):moving_average(4)
+          end
+        )
+        assert.has.errors(
+          function()
+            vec(3):moving_average(0)
+          end
+        )
+      end
+    )
+  end
+)
@@ -0,0 +1,107 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+-- built from tests/ext, see the rockspec there
+local ext = require "vec_ext_test"
+local unpack = table.unpack or unpack
+
+local function assert_elements(expected, v)
+  assert.are.equal(#expected, #v)
+  for i = 1, #expected do
+    assert.are.equal(expected[i], v[i])
+  end
+end
+
+describe(
+  "extension interface",
+  function()
+    it(
+      "should register map kernels with their in-place variants",
+      function()
+        local v = vec {1, 2, 3}
+        assert_elements({3, 5, 7}, v:ext_affine(2, 1))
+        assert_elements({3, 5, 7}, vec.ext_affine(v, 2, 1))
+        assert_elements({1, 2, 3}, v)
+
+        local out = vec.new(3)
+        assert.are.equal(out, v:ext_affine_(10, 0, out))
+        assert_elements({10, 20, 30}, out)
+        assert.are.equal(v, v:ext_affine_(-1))
+        assert_elements({-1, -2, -3}, v)
+        assert.has_error(
+          function()
+            v:ext_affine_(1, 0, vec.new(2))
+          end
+        )
+      end
+    )
+    it(
+      "should register zip and reduce kernels",
+      function()
+        local x, y = vec {3, 5, 8}, vec {4, 12, 15}
+        assert_elements({5, 13, 17}, x:ext_hypot(y))
+        x:ext_hypot_(y)
+        assert_elements({5, 13, 17}, x)
+        assert.has_error(
+          function()
+            x:ext_hypot(vec {1, 2})
+          end
+        )
+
+        assert.are.equal(14, vec {1, 2, 3}:ext_sumsq())
+        assert.is_nil(vec.ext_sumsq_)
+      end
+    )
+    it(
+      "should call kernels on chunks of long vectors",
+      function()
+        local size = ext.chunk_size
+        ext.calls()
+        local v = vec.new(2 * size + 10):ext_chunk_len()
+        assert.are.equal(3, ext.calls())
+        assert.are.equal(size, v[1])
+        assert.are.equal(size, v[2 * size])
+        assert.are.equal(10, v[2 * size + 1])
+
+        vec.new(size):ext_chunk_len()
+        assert.are.equal(1, ext.calls())
+        vec.seq():ext_chunk_len()
+        assert.are.equal(0, ext.calls())
+
+        local big = vec.ones(3 * size + 1)
+        assert.are.equal(3 * size + 1, big:ext_sumsq())
+      end
+    )
+    it(
+      "should pass at most the maximum number of arguments",
+      function()
+        local v = vec.new(2)
+        local args = {}
+        for i = 1, ext.max_args do
+          args[i] = i
+        end
+        local total = ext.max_args * (ext.max_args + 1) / 2
+        local expected = ext.max_args + total / 1000
+        assert.are.equal(expected, v:ext_nargs(unpack(args))[1])
+        assert.are.equal(0, v:ext_nargs()[1])
+
+        args[#args + 1] = 0
+        assert.has_error(
+          function()
+            v:ext_nargs(unpack(args))
+          end
+        )
+      end
+    )
+    it(
+      "should let modules check and create vectors",
+      function()
+        assert_elements({2, 4}, ext.double(vec {1, 2}))
+        assert.has_error(
+          function()
+            ext.double({1, 2})
+          end
+        )
+      end
+    )
+  end
+)
@@ -0,0 +1,159 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function assert_near(expected, v, tol)
+  assert.are.equal(#expected, #v)
+  for i = 1, #expected do
+    assert.near(expected[i], v[i], tol)
+  end
+end
+
+local function slice(v, first, last)
+  local t = {}
+  for i = first, last do
+    t[#t + 1] = v[i]
+  end
+  return vec(t)
+end
+
+local function signal(n)
+  local x = vec.new(n)
+  for i = 1, n do
+    x[i] = math.sin(0.3 * i) + 0.5 * math.cos(1.7 * i) + (i % 7) / 7
+  end
+  return x
+end
+
+describe(
+  "filter",
+  function()
+    it(
+      "should convolve with fir coefficients",
+      function()
+        local x = vec {1, 2, 3, 4, 5}
+        local y, zf = vec.lfilter(vec {1, -2, 0.5}, vec {2}, x)
+        -- y[n] = (x[n] - 2 x[n-1] + 0.5 x[n-2]) / 2
+        assert_near({0.5, 0, -0.25, -0.5, -0.75}, y, 1e-15)
+        assert_near({-4, 1.25}, zf, 1e-15)
+      end
+    )
+    it(
+      "should run the iir recurrence",
+      function()
+        local x = signal(50)
+        local y = vec.lfilter(vec {0.2, 0.1}, vec {1, -0.9, 0.2}, x)
+        local prev1, prev2, xprev = 0, 0, 0
+        for i = 1, #x do
+          local expected = 0.2 * x[i] + 0.1 * xprev + 0.9 * prev1 - 0.2 * prev2
+          assert.near(expected, y[i], 1e-12)
+          prev2, prev1, xprev = prev1, expected, x[i]
+        end
+      end
+    )
+    it(
+      "should carry state across chunks",
+      function()
+        local b, a = vec {0.1, 0.3, 0.3, 0.1}, vec {1, -0.6, 0.4, -0.1}
+        local x = signal(100)
+        local whole = vec.lfilter(b, a, x)
+
+        local y1, z = vec.lfilter(b, a, slice(x, 1, 37))
+        local y2 = vec.lfilter(b, a, slice(x, 38, 100), z)
+        assert_near(slice(whole, 1, 37), y1, 1e-13)
+        assert_near(slice(whole, 38, 100), y2, 1e-13)
+
+        -- the into variant updates the state vector in place
+        local state = vec.new(3)
+        for first = 1, 100, 25 do
+          local piece = slice(x, first, first + 24)
+          assert.are.equal(piece, vec.lfilter_(b, a, piece, state))
+          assert_near(slice(whole, first, first + 24), piece, 1e-13)
+        end
+
+        local into = vec.new(100)
+        local r, rz = vec.lfilter_(b, a, x, nil, into)
+        assert.are.equal(into, r)
+        assert.is_nil(rz)
+        assert_near(whole, into, 0)
+      end
+    )
+    it(
+      "should cascade second order sections",
+      function()
+        local s1 = {0.2, 0.4, 0.2, 1, -0.5, 0.3}
+        local s2 = {2, -1, 0.5, 2, 0.4, 0.2}
+        local x = signal(1000)
+        local first =
+          vec.lfilter(vec {s1[1], s1[2], s1[3]}, vec {s1[4], s1[5], s1[6]}, x)
+        local expected =
+          vec.lfilter(vec {s2[1], s2[2], s2[3]}, vec {s2[4], s2[5], s2[6]}, first)
+        local sos = vec {s1[1], s1[2], s1[3], s1[4], s1[5], s1[6],
+                         s2[1], s2[2], s2[3], s2[4], s2[5], s2[6]}
+        local y, zf = vec.sosfilt(sos, x)
+        assert_near(expected, y, 1e-12)
+        assert.are.equal(4, #zf)
+
+        local y1, z = vec.sosfilt(sos, slice(x, 1, 300))
+        local rest = slice(x, 301, 1000)
+        vec.sosfilt_(sos, rest, z)
+        assert_near(slice(y, 1, 300), y1, 1e-12)
+        assert_near(slice(y, 301, 1000), rest, 1e-12)
+      end
+    )
+    it(
+      "should filter forwards and backwards without a phase shift",
+      function()
+        local b, a = vec {0.0675, 0.135, 0.0675}, vec {1, -1.143, 0.413}
+        -- a constant passes through unchanged thanks to the initial state
+        local c = vec.ones(40):scale(3)
+        assert_near(c, vec.filtfilt(b, a, c), 1e-9)
+
+        -- a symmetric pulse stays symmetric and centered
+        local x = vec.new(101)
+        for i = 41, 61 do
+          x[i] = 1 - math.abs(i - 51) / 10
+        end
+        local y = vec.filtfilt(b, a, x)
+        for i = 1, 50 do
+          assert.near(y[i], y[102 - i], 1e-9)
+        end
+        assert.is_true(y[51] > y[50] and y[51] > y[52])
+
+        local sos = vec {0.0675, 0.135, 0.0675, 1, -1.143, 0.413}
+        assert_near(y, vec.sosfiltfilt(sos, x), 1e-12)
+        assert_near(vec.filtfilt(b, a, x, 0), vec.sosfiltfilt(sos, x, 0), 1e-12)
+      end
+    )
+    it(
+      "should reject invalid arguments",
+      function()
+        local x = vec.new(10)
+        assert.has_error(
+          function()
+            vec.lfilter(vec {1}, vec {0, 1}, x)
+          end
+        )
+        assert.has_error(
+          function()
+            vec.lfilter(vec {1, 1}, vec {1}, x, vec.new(2))
+          end
+        )
+        assert.has_error(
+          function()
+            vec.sosfilt(vec {1, 0, 0, 1, 0}, x)
+          end
+        )
+        assert.has_error(
+          function()
+            vec.filtfilt(vec {1, 1}, vec {1}, vec.new(6))
+          end
+        )
+        assert.has_error(
+          function()
+            vec.lfilter_(vec {1}, vec {1}, x, nil, vec.new(9))
+          end
+        )
+      end
+    )
+  end
+)
@@ -0,0 +1,241 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function assert_vec_near(expected, actual, tol)
+  assert.are.equal(#expected, #actual)
+  for i = 1, #expected do
+    assert.near(expected[i], actual[i], tol)
+  end
+end
+
+describe(
+  "recorded graphs",
+  function()
+    it(
+      "should replay in-place operations without running them while recording",
+      function()
+        local x = vec {1, 2, 3}
+        local y = vec {10, 20, 30}
+        local g = vec.record(
+          function()
+            x:add_(y)
+            x:scale_(0.5)
+            vec.sub_(1, x)
+          end
+        )
+        assert.are.equal(3, #g)
+        assert.are.equal(1, x[1])
+
+        g:run()
+        assert_vec_near({-4.5, -10, -15.5}, x, 0)
+        g:run(2)
+        assert_vec_near({-3.125, -7, -10.875}, x, 1e-12)
+      end
+    )
+    it(
+      "should match running the same calls directly",
+      function()
+        for _, fuse in ipairs {true, false} do
+          local n = 1500
+          local a1, b1 = vec.linspace(0, 1, n), vec.linspace(1, 2, n)
+          local a2, b2 = a1:dup(), b1:dup()
+          local tmp1, tmp2 = vec(n), vec(n)
+
+          local function step(a, b, tmp)
+            a:dup_(tmp)
+            tmp:sin_()
+            tmp:psy_(0.25, b)
+            b:mul_(0.99)
+            vec.div_(tmp, 2, a)
+            a:pow_(2)
+            b:neg_()
+            tmp:reset()
+          end
+
+          local g = vec.record(
+            function()
+              step(a1, b1, tmp1)
+            end,
+            fuse
+          )
+          g:run(5)
+          for _ = 1, 5 do
+            step(a2, b2, tmp2)
+          end
+          assert_vec_near(a2, a1, 0)
+          assert_vec_near(b2, b1, 0)
+          assert_vec_near(tmp2, tmp1, 0)
+        end
+      end
+    )
+    it(
+      "should replay an rk4 step on a small system",
+      function()
+        -- y' = -y, integrated with fixed buffers
+        local h = 0.01
+        local y = vec {1, 2}
+        local k = {vec(2), vec(2), vec(2), vec(2)}
+        local tmp, acc = vec(2), vec(2)
+        local g = vec.record(
+          function()
+            y:neg_(k[1])
+            y:psy_(h / 2, k[1], tmp)
+            tmp:neg_(k[2])
+            y:psy_(h / 2, k[2], tmp)
+            tmp:neg_(k[3])
+            y:psy_(h, k[3], tmp)
+            tmp:neg_(k[4])
+            k[1]:add_(k[4], acc)
+            acc:psy_(2, k[2])
+            acc:psy_(2, k[3])
+            y:psy_(h / 6, acc)
+          end
+        )
+        g:run(100)
+        assert.near(math.exp(-1), y[1], 1e-9)
+        assert.near(2 * math.exp(-1), y[2], 1e-9)
+      end
+    )
+    it(
+      "should restore the library after recording",
+      function()
+        local add_ = vec.add_
+        local recorder
+        assert.has.errors(
+          function()
+            vec.record(
+              function()
+                recorder = vec.add_
+                error("boom")
+              end
+            )
+          end
+        )
+        assert.are.equal(add_, vec.add_)
+        assert.has.errors(
+          function()
+            recorder(vec {1}, vec {2})
+          end
+        )
+
+        local v = vec {1}
+        v:add_(1)
+        assert.are.equal(2, v[1])
+      end
+    )
+    it(
+      "should reject nested recordings and read-only outputs",
+      function()
+        assert.has.errors(
+          function()
+            vec.record(
+              function()
+                vec.record(function() end)
+              end
+            )
+          end
+        )
+        assert.has.errors(
+          function()
+            vec.record(
+              function()
+                vec.adopt(vec.share(vec {1}, true)):neg_()
+              end
+            )
+          end
+        )
+      end
+    )
+    it(
+      "should reject in-place calls it cannot replay",
+      function()
+        local v = vec {1, 2, 3}
+        local cumsum_, normalize_ = vec.cumsum_, vec.normalize_
+        for _, f in ipairs {
+          function()
+            v:cumsum_()
+          end,
+          function()
+            vec.normalize_(v)
+          end,
+          function()
+            v:hadamard_(v)
+          end,
+          function()
+            v:lfilter_({1}, {1})
+          end,
+          function()
+            v[1] = 10
+          end
+        } do
+          assert.has.errors(
+            function()
+              vec.record(f)
+            end
+          )
+        end
+        assert.are.same({1, 2, 3}, {v[1], v[2], v[3]})
+
+        -- everything is back in place afterwards
+        assert.are.equal(cumsum_, vec.cumsum_)
+        assert.are.equal(normalize_, vec.normalize_)
+        v:cumsum_()
+        v[1] = 0
+        assert.are.same({0, 3, 6}, {v[1], v[2], v[3]})
+      end
+    )
+    it(
+      "should fix the results of other calls at recording time",
+      function()
+        local x, y = vec {1, 2}, vec(2)
+        local g = vec.record(
+          function()
+            y:add_(x:sum())
+            y:add_(x * 2)
+          end
+        )
+        -- the recording itself did not run anything
+        assert.are.same({0, 0}, {y[1], y[2]})
+
+        x[1] = 10
+        g:run()
+        -- 3 is the sum of x, and {2, 4} twice x, as they were while recording
+        assert.are.same({5, 7}, {y[1], y[2]})
+      end
+    )
+    it(
+      "should refuse to run after a vector changed length",
+      function()
+        local v = vec {1, 2}
+        local g = vec.record(
+          function()
+            v:sq_()
+          end
+        )
+        v:push(3)
+        assert.has.errors(
+          function()
+            g:run()
+          end
+        )
+      end
+    )
+    it(
+      "should keep the vectors it refers to alive",
+      function()
+        local g
+        do
+          local v = vec {2}
+          g = vec.record(
+            function()
+              v:sq_()
+            end
+          )
+        end
+        collectgarbage()
+        collectgarbage()
+        g:run(3)
+      end
+    )
+  end
+)
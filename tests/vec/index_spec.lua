@@ -0,0 +1,146 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function brute_force(rows, q, metric)
+  local ranked = {}
+  for id, row in ipairs(rows) do
+    local score
+    if metric == "dot" then
+      score = row:dot(q)
+    elseif metric == "l2" then
+      score = (row - q):norm()
+    else
+      score = row:cosine_similarity(q)
+    end
+    ranked[#ranked + 1] = {id = id, score = score}
+  end
+  table.sort(
+    ranked,
+    function(a, b)
+      if metric == "l2" then
+        return a.score < b.score
+      end
+      return a.score > b.score
+    end
+  )
+  return ranked
+end
+
+describe(
+  "similarity index",
+  function()
+    local dim = 13
+    local rows = {}
+    local idx = vec.index(dim)
+    local rng = vec.rng(7)
+    for i = 1, 300 do
+      rows[i] = rng:randn(dim)
+      assert.are.equal(i, idx:add(rows[i]))
+    end
+
+    it(
+      "should rank like a brute force search",
+      function()
+        for _, metric in ipairs {"cosine", "dot", "l2"} do
+          local q = rng:randn(dim)
+          local ids, scores = idx:search(q, 10, metric)
+          local expected = brute_force(rows, q, metric)
+          assert.are.equal(10, #ids)
+          for i = 1, 10 do
+            assert.are.equal(expected[i].id, ids[i])
+            assert.near(expected[i].score, scores[i], 1e-9)
+          end
+        end
+      end
+    )
+    it(
+      "should search a batch of queries at once",
+      function()
+        local queries = {rng:randn(dim), rng:randn(dim), rng:randn(dim)}
+        local ids, scores = idx:search(queries, 5, "l2")
+        assert.are.equal(3, #ids)
+        for j, q in ipairs(queries) do
+          local single_ids, single_scores = idx:search(q, 5, "l2")
+          for i = 1, 5 do
+            assert.are.equal(single_ids[i], ids[j][i])
+            assert.are.equal(single_scores[i], scores[j][i])
+          end
+        end
+      end
+    )
+    it(
+      "should return at most as many results as rows",
+      function()
+        local small = vec.index(2)
+        small:add(vec {1, 0})
+        small:add(vec {0, 1})
+        local ids, scores = small:search(vec {1, 1}, 5)
+        assert.are.equal(2, #ids)
+        -- ties are broken by insertion order
+        assert.are.equal(1, ids[1])
+        assert.are.equal(2, ids[2])
+        assert.near(math.sqrt(0.5), scores[1], 1e-12)
+        assert.are.equal(0, #small:search(vec {1, 1}, 0))
+        assert.has.errors(
+          function()
+            small:search(vec {1, 1, 1}, 1)
+          end
+        )
+        assert.has.errors(
+          function()
+            small:add(vec {1})
+          end
+        )
+      end
+    )
+    it(
+      "should rank NaN scores last",
+      function()
+        local nan = 0 / 0
+        local small = vec.index(2)
+        small:add(vec {1, 0})
+        small:add(vec {nan, 0})
+        small:add(vec {0, 1})
+        small:add(vec {nan, nan})
+        for _, metric in ipairs {"cosine", "dot", "l2"} do
+          local ids, scores = small:search(vec {1, 1}, 4, metric)
+          assert.are.same({1, 3, 2, 4}, {ids[1], ids[2], ids[3], ids[4]})
+          assert.are_not.equal(scores[3], scores[3])
+          ids = small:search(vec {1, 1}, 2, metric)
+          assert.are.same({1, 3}, {ids[1], ids[2]})
+          ids = small:search(vec {nan, 1}, 3, metric)
+          assert.are.same({1, 2, 3}, {ids[1], ids[2], ids[3]})
+        end
+      end
+    )
+    it(
+      "should round trip through the binary format",
+      function()
+        local filename = os.tmpname()
+        idx:save(filename, 1)
+        local loaded = vec.index(dim, vec.load(filename))
+        os.remove(filename)
+
+        assert.are.equal(#idx, #loaded)
+        assert.are.equal(dim, loaded:dim())
+        for i = 1, #idx, 37 do
+          local a, b = idx:get(i), loaded:get(i)
+          for j = 1, dim do
+            assert.are.equal(a[j], b[j])
+          end
+        end
+        local q = rng:randn(dim)
+        local ids = idx:search(q, 3)
+        local loaded_ids = loaded:search(q, 3)
+        for i = 1, 3 do
+          assert.are.equal(ids[i], loaded_ids[i])
+        end
+        assert.has.errors(
+          function()
+            vec.index(4, vec {1, 2, 3})
+          end
+        )
+      end
+    )
+  end
+)
@@ -0,0 +1,149 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+describe(
+  "gather",
+  function()
+    it(
+      "should pick the elements at the given indices",
+      function()
+        local v = vec {10, 20, 30, 40}
+        local w = v:gather(vec {4, 1, 1, 3, 2})
+        assert.are.equal(5, #w)
+        assert.are.equal(40, w[1])
+        assert.are.equal(10, w[2])
+        assert.are.equal(10, w[3])
+        assert.are.equal(30, w[4])
+        assert.are.equal(20, w[5])
+      end
+    )
+    it(
+      "should be available through indexing with a vector",
+      function()
+        local v = vec {10, 20, 30}
+        local w = v[vec {3, 2}]
+        assert.are.equal(30, w[1])
+        assert.are.equal(20, w[2])
+      end
+    )
+    it(
+      "should error on oob indices",
+      function()
+        local v = vec(3)
+        assert.has.errors(
+          function()
+            v:gather(vec {1, 4})
+          end
+        )
+        assert.has.errors(
+          function()
+            v:gather(vec {0, 1})
+          end
+        )
+        assert.has.errors(
+          function()
+            v:gather(vec {0 / 0})
+          end
+        )
+        assert.has.errors(
+          function()
+            v:gather(vec {1.5, 2})
+          end
+        )
+        assert.has.errors(
+          function()
+            v:scatter_(vec {2.9}, vec {1})
+          end
+        )
+      end
+    )
+  end
+)
+
+describe(
+  "scatter",
+  function()
+    it(
+      "should write to the given indices in place",
+      function()
+        local v = vec {1, 2, 3, 4}
+        v:scatter_(vec {4, 2}, vec {-4, -2})
+        assert.are.equal(1, v[1])
+        assert.are.equal(-2, v[2])
+        assert.are.equal(3, v[3])
+        assert.are.equal(-4, v[4])
+      end
+    )
+    it(
+      "should not modify the original when not in place",
+      function()
+        local v = vec {1, 2, 3}
+        local w = v:scatter(vec {1}, vec {9})
+        assert.are.equal(1, v[1])
+        assert.are.equal(9, w[1])
+        assert.are.equal(2, w[2])
+      end
+    )
+    it(
+      "should be available through assignment with a vector index",
+      function()
+        local v = vec(3)
+        v[vec {3, 1}] = vec {5, 6}
+        assert.are.equal(6, v[1])
+        assert.are.equal(0, v[2])
+        assert.are.equal(5, v[3])
+      end
+    )
+  end
+)
+
+describe(
+  "compress",
+  function()
+    it(
+      "should keep only elements with a nonzero mask",
+      function()
+        local v = vec {1, 2, 3, 4, 5}
+        local w = v:compress(vec {0, 1, 0, 1, 1})
+        assert.are.equal(3, #w)
+        assert.are.equal(2, w[1])
+        assert.are.equal(4, w[2])
+        assert.are.equal(5, w[3])
+        assert.are.equal(vec.where, vec.compress)
+      end
+    )
+    it(
+      "should return the number of selected elements in place",
+      function()
+        local v = vec {1, 2, 3, 4}
+        local out, n = v:compress_(vec {1, 0, 0, 1}, v)
+        assert.are.equal(v, out)
+        assert.are.equal(2, n)
+        assert.are.equal(1, v[1])
+        assert.are.equal(4, v[2])
+      end
+    )
+  end
+)
+
+describe(
+  "select",
+  function()
+    it(
+      "should choose between vectors and scalars",
+      function()
+        local mask = vec {1, 0, 1}
+        local a = vec {1, 2, 3}
+        local b = vec {-1, -2, -3}
+        local w = vec.select(mask, a, b)
+        assert.are.equal(1, w[1])
+        assert.are.equal(-2, w[2])
+        assert.are.equal(3, w[3])
+
+        w = vec.select(mask, a, 0)
+        assert.are.equal(0, w[2])
+        assert.are.equal(3, w[3])
+      end
+    )
+  end
+)
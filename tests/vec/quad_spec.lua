@@ -0,0 +1,123 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+describe(
+  "quadrature",
+  function()
+    it(
+      "should integrate cubics exactly with simpson",
+      function()
+        local function cubic(x)
+          return x:dup():pow_(3):add_(x:sq()):add_(1)
+        end
+        -- integral of x^3 + x^2 + 1 over [0, 2]
+        local expected = 4 + 8 / 3 + 2
+        for _, n in ipairs {3, 5, 9} do
+          local x = vec.linspace(0, 2, n)
+          assert.near(expected, vec.simpson(cubic(x), x), 1e-12)
+          assert.near(expected, vec.simpson(cubic(x), 2 / (n - 1)), 1e-12)
+        end
+
+        -- uneven spacing, or an odd number of intervals, is exact for
+        -- quadratics
+        local x = vec {0, 0.1, 0.5, 0.6, 1.3, 2}
+        local y = x:sq():add_(x):add_(1)
+        assert.near(8 / 3 + 2 + 2, vec.simpson(y, x), 1e-12)
+        assert.near(1.5, vec.simpson(vec {1, 2}, 1), 0)
+        assert.are.equal(0, vec.simpson(vec {1}))
+      end
+    )
+    it(
+      "should converge much faster than trapz",
+      function()
+        local x = vec.linspace(0, math.pi, 65)
+        local y = x:sin()
+        local romb_err = math.abs(vec.romb(y, math.pi / 64) - 2)
+        local simpson_err = math.abs(vec.simpson(y, x) - 2)
+        local trapz_err = math.abs(vec.trapz(y, x) - 2)
+        assert.is_true(romb_err < 1e-12)
+        assert.is_true(simpson_err < 1e-6)
+        assert.is_true(trapz_err > 1e-4)
+        assert.has.errors(
+          function()
+            vec.romb(vec(6))
+          end
+        )
+      end
+    )
+    it(
+      "should integrate adaptively with few batched calls",
+      function()
+        local calls = 0
+        local value, err, neval =
+          vec.quad(
+          function(x)
+            calls = calls + 1
+            return x:sin_()
+          end,
+          0,
+          math.pi
+        )
+        assert.near(2, value, 1e-14)
+        assert.is_true(err < 1e-8)
+        assert.are.equal(15, neval)
+        assert.are.equal(1, calls)
+
+        -- a sharp peak needs several rounds, each a single call
+        calls = 0
+        value, err, neval =
+          vec.quad(
+          function(x)
+            calls = calls + 1
+            -- 1 / (1e-4 + x^2)
+            return x:sq():add_(1e-4):reciproc_()
+          end,
+          -1,
+          1,
+          {epsabs = 0, epsrel = 1e-10}
+        )
+        assert.near(200 * math.atan(100), value, 1e-7)
+        assert.is_true(calls > 1)
+        assert.is_true(neval / 15 >= calls)
+        assert.is_true(neval < 2000)
+      end
+    )
+    it(
+      "should stop at the interval limit",
+      function()
+        local value, err =
+          vec.quad(
+          function(x)
+            return x:sq():add_(1e-4):reciproc_()
+          end,
+          -1,
+          1,
+          {limit = 3, epsabs = 0, epsrel = 1e-12}
+        )
+        assert.is_true(err > 1e-12 * value)
+        assert.has.errors(
+          function()
+            vec.quad(
+              function()
+                return 1
+              end,
+              0,
+              1
+            )
+          end
+        )
+        assert.has.errors(
+          function()
+            vec.quad(
+              function(x)
+                return x
+              end,
+              0,
+              math.huge
+            )
+          end
+        )
+      end
+    )
+  end
+)
@@ -0,0 +1,66 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+describe(
+  "random",
+  function()
+    it(
+      "rand should be uniform in [0, 1)",
+      function()
+        local v = vec.rand(100000)
+        assert.are.equal(100000, #v)
+        assert.is_true(v:ge(0):all())
+        assert.is_true(v:lt(1):all())
+        assert.near(0.5, v:sum() / #v, 0.01)
+      end
+    )
+    it(
+      "randn should be standard normal",
+      function()
+        local v = vec.randn(100001)
+        local mean = v:sum() / #v
+        local var = (v - mean):norm2() / #v
+        assert.near(0, mean, 0.02)
+        assert.near(1, var, 0.02)
+        assert.is_true(v:isfinite():all())
+      end
+    )
+    it(
+      "should be reproducible for a given seed",
+      function()
+        local a = vec.randn(11, 1234)
+        local b = vec(11):randn_(1234)
+        for i = 1, #a do
+          assert.are.equal(a[i], b[i])
+        end
+        assert.are_not.equal(a[1], vec.randn(11, 4321)[1])
+      end
+    )
+    it(
+      "should create empty vectors",
+      function()
+        assert.are.equal(0, #vec.rand(0))
+        assert.are.equal(0, #vec.randn(0))
+        assert.are.equal(0, #vec.rng(1):randn(0))
+        assert.has.errors(
+          function()
+            vec.rand(-1)
+          end
+        )
+      end
+    )
+    it(
+      "should split generators into independent streams",
+      function()
+        local g = vec.rng(7)
+        local h = g:split()
+        local u = g:rand(10)
+        local v = h:rand(10)
+        assert.are_not.equal(u[1], v[1])
+
+        local h2 = vec.rng(7):split()
+        assert.are.equal(v[1], h2:rand(1)[1])
+      end
+    )
+  end
+)
@@ -0,0 +1,76 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+describe(
+  "ring buffer",
+  function()
+    it(
+      "should evict the oldest element once full",
+      function()
+        local r = vec.ring(3)
+        assert.is_nil(r:push(1))
+        assert.is_nil(r:push(2))
+        assert.is_nil(r:push(3))
+        assert.is_true(r:full())
+        assert.are.equal(1, r:push(4))
+        assert.are.equal(3, #r)
+        assert.are.equal(2, r[1])
+        assert.are.equal(4, r[3])
+      end
+    )
+    it(
+      "should keep rolling statistics over the window",
+      function()
+        local r = vec.ring(5)
+        local values = {}
+        math.randomseed(42)
+        for i = 1, 200 do
+          values[i] = math.random() * 100 - 50
+          r:push(values[i])
+
+          local first = math.max(1, i - 4)
+          local n = i - first + 1
+          local sum, lo, hi = 0, math.huge, -math.huge
+          for j = first, i do
+            sum = sum + values[j]
+            lo = math.min(lo, values[j])
+            hi = math.max(hi, values[j])
+          end
+          local mean = sum / n
+          local var = 0
+          for j = first, i do
+            var = var + (values[j] - mean) ^ 2
+          end
+          var = var / n
+
+          assert.near(sum, r:sum(), 1e-9)
+          assert.near(mean, r:mean(), 1e-9)
+          assert.near(var, r:var(), 1e-9)
+          assert.are.equal(lo, r:min())
+          assert.are.equal(hi, r:max())
+        end
+      end
+    )
+    it(
+      "should linearize the window in order",
+      function()
+        local r = vec.ring(4)
+        r:extend(vec {1, 2, 3, 4, 5, 6})
+        local v = r:linearize()
+        assert.are.equal(4, #v)
+        for i = 1, 4 do
+          assert.are.equal(i + 2, v[i])
+        end
+
+        local out = vec(4)
+        assert.are.equal(out, r:linearize_(out))
+        assert.are.equal(6, out[4])
+        assert.has.errors(
+          function()
+            r:linearize_(vec(3))
+          end
+        )
+      end
+    )
+  end
+)
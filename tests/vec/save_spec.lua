@@ -0,0 +1,99 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function file_size(filename)
+  local f = assert(io.open(filename, "rb"))
+  local size = f:seek("end")
+  f:close()
+  return size
+end
+
+describe(
+  "save and load",
+  function()
+    local filename = os.tmpname()
+    teardown(
+      function()
+        os.remove(filename)
+      end
+    )
+
+    local function assert_roundtrip(v, level)
+      vec.save(v, filename, level)
+      local w = vec.load(filename)
+      assert.are.equal(#v, #w)
+      for i = 1, #v do
+        assert.are.equal(v[i], w[i])
+      end
+    end
+
+    it(
+      "should round-trip uncompressed vectors",
+      function()
+        assert_roundtrip(vec.randn(1000, 1))
+        assert_roundtrip(vec.seq())
+      end
+    )
+    it(
+      "should round-trip at every compression level",
+      function()
+        local v = vec.linspace(0, 10, 20000):sin()
+        v:extend(vec.randn(20000, 2))
+        for level = 1, 9 do
+          assert_roundtrip(v, level)
+        end
+        assert_roundtrip(vec.seq(), 1)
+        assert_roundtrip(vec {1, 2, 3}, 5)
+      end
+    )
+    it(
+      "should shrink smooth data",
+      function()
+        local v = vec.linspace(0, 10, 100000):sin()
+        vec.save(v, filename)
+        local raw = file_size(filename)
+        vec.save(v, filename, 1)
+        assert.is_true(file_size(filename) * 3 < raw)
+      end
+    )
+    it(
+      "should detect corrupted files",
+      function()
+        vec.save(vec.linspace(0, 1, 1000), filename, 5)
+        local f = assert(io.open(filename, "rb"))
+        local contents = f:read("*a")
+        f:close()
+
+        f = assert(io.open(filename, "wb"))
+        f:write(contents:sub(1, #contents - 10))
+        f:close()
+        assert.has.errors(
+          function()
+            vec.load(filename)
+          end
+        )
+
+        -- a length far too large to allocate, after the 6 byte header of a
+        -- little endian machine with 8 byte integers
+        f = assert(io.open(filename, "wb"))
+        f:write(contents:sub(1, 6), ("\255"):rep(7), "\127", contents:sub(15))
+        f:close()
+        assert.has.errors(
+          function()
+            vec.load(filename)
+          end
+        )
+      end
+    )
+    it(
+      "should reject invalid levels",
+      function()
+        assert.has.errors(
+          function()
+            vec.save(vec {1}, filename, 10)
+          end
+        )
+      end
+    )
+  end
+)
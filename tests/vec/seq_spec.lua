@@ -0,0 +1,104 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+describe(
+  "sequence",
+  function()
+    it(
+      "should start empty",
+      function()
+        local s = vec.seq()
+        assert.are.equal(0, #s)
+        assert.are.equal("[]", tostring(s))
+      end
+    )
+    it(
+      "should grow when pushed to",
+      function()
+        local s = vec.seq(1)
+        for i = 1, 100 do
+          s:push(i)
+        end
+        assert.are.equal(100, #s)
+        assert.is_true(s:capacity() >= 100)
+        for i = 1, 100 do
+          assert.are.equal(i, s[i])
+        end
+      end
+    )
+    it(
+      "should accept several values per push",
+      function()
+        local s = vec.seq():push(1, 2, 3)
+        assert.are.equal(3, #s)
+        assert.are.equal(3, s[3])
+      end
+    )
+    it(
+      "should extend with another vector, including itself",
+      function()
+        local s = vec {1, 2}
+        s:extend(vec {3})
+        s:extend(s)
+        assert.are.equal(6, #s)
+        assert.are.equal(1, s[4])
+        assert.are.equal(3, s[6])
+      end
+    )
+    it(
+      "should reserve and shrink capacity",
+      function()
+        local s = vec.seq():reserve(50)
+        assert.are.equal(50, s:capacity())
+        s:push(1, 2)
+        s:shrink_to_fit()
+        assert.are.equal(2, s:capacity())
+        assert.are.equal(2, s[2])
+      end
+    )
+    it(
+      "should refuse capacities too large to allocate",
+      function()
+        local s = vec.seq():push(1)
+        assert.has_error(
+          function()
+            s:reserve(math.maxinteger)
+          end
+        )
+        assert.has_error(
+          function()
+            s:reserve(math.maxinteger // 2 + 1)
+          end
+        )
+        assert.has_error(
+          function()
+            vec.seq(math.maxinteger)
+          end
+        )
+        assert.are.equal(8, s:capacity())
+        assert.are.equal(1, s[1])
+      end
+    )
+    it(
+      "should work with the regular vector functions",
+      function()
+        local s = vec.seq():push(1, 2, 3)
+        local t = s + vec {1, 1, 1}
+        assert.are.equal(4, t[3])
+        assert.are.equal(6, s:sum())
+        assert.are.equal(0, #vec.seq():dup())
+      end
+    )
+    it(
+      "should error on oob-accessing beyond its length",
+      function()
+        local s = vec.seq(10):push(1)
+        assert.has.errors(
+          function()
+            _ = s[2]
+          end
+        )
+      end
+    )
+  end
+)
@@ -0,0 +1,143 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+describe(
+  "shared vectors",
+  function()
+    it(
+      "should see the same values after adoption",
+      function()
+        local v = vec {1, 2, 3}
+        local w = vec.adopt(vec.share(v))
+        assert.are.equal(3, #w)
+        w[2] = 20
+        assert.are.equal(20, v[2])
+        v:add_(1)
+        assert.are.equal(4, w[3])
+      end
+    )
+    it(
+      "should keep the buffer alive while any vector uses it",
+      function()
+        local v = vec.linspace(1, 5, 5)
+        local handle = vec.share(v)
+        v = nil
+        collectgarbage()
+        collectgarbage()
+        local w = vec.adopt(handle)
+        assert.are.equal(5, w[5])
+      end
+    )
+    it(
+      "should only adopt each handle once",
+      function()
+        local handle = vec.share(vec {1})
+        vec.adopt(handle)
+        assert.has.errors(
+          function()
+            vec.adopt(handle)
+          end
+        )
+        handle = vec.share(vec {1})
+        vec.release(handle)
+        assert.has.errors(
+          function()
+            vec.adopt(handle)
+          end
+        )
+        assert.has.errors(
+          function()
+            vec.release(handle)
+          end
+        )
+      end
+    )
+    it(
+      "should give each share of a vector its own handle",
+      function()
+        local v = vec {1, 2}
+        local h1, h2 = vec.share(v), vec.share(v)
+        assert.are_not.equal(h1, h2)
+        vec.release(h1)
+        local w = vec.adopt(h2)
+        w[1] = 10
+        assert.are.equal(10, v[1])
+        assert.has.errors(
+          function()
+            vec.adopt(h1)
+          end
+        )
+      end
+    )
+    it(
+      "should not grow shared vectors",
+      function()
+        local v = vec.seq():push(1, 2)
+        vec.release(vec.share(v))
+        assert.has.errors(
+          function()
+            v:push(3)
+          end
+        )
+      end
+    )
+    it(
+      "should enforce read-only sharing",
+      function()
+        local v = vec {1, 2, 3}
+        local ro = vec.adopt(vec.share(v, true))
+        assert.is_true(ro:readonly())
+        assert.is_false(v:readonly())
+
+        -- reading, and writing into other vectors, is allowed
+        assert.are.equal(6, ro:sum())
+        local out = vec(3)
+        ro:add_(1, out)
+        assert.are.equal(4, out[3])
+        assert.are.equal(2, (ro * 2)[1])
+
+        for _, f in ipairs {
+          function()
+            ro[1] = 0
+          end,
+          function()
+            ro:add_(1)
+          end,
+          function()
+            ro:add_(vec {10, 10, 10})
+          end,
+          function()
+            ro:mul_(ro)
+          end,
+          function()
+            ro:pow_(vec {2, 2, 2})
+          end,
+          function()
+            ro:lt_(vec {2, 2, 2})
+          end,
+          function()
+            ro:sin_()
+          end,
+          function()
+            out:add_(1, ro)
+          end,
+          function()
+            out:dup_(ro)
+          end,
+          function()
+            ro:reset()
+          end,
+          function()
+            ro:cumsum_()
+          end,
+          function()
+            vec.share(ro)
+          end
+        } do
+          assert.has.errors(f)
+        end
+        assert.are.equal(1, ro[1])
+      end
+    )
+  end
+)
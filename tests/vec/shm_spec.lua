@@ -0,0 +1,82 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function unique_name()
+  return ("vectorize-test-%d-%d"):format(os.time(), math.random(1, 1e9))
+end
+
+describe(
+  "shared memory vectors",
+  function()
+    if not pcall(vec.shm_create, unique_name(), 0) then
+      -- not supported on this platform
+      return
+    end
+
+    it(
+      "should share values between mappings",
+      function()
+        local name = unique_name()
+        local writer = vec.shm_create(name, 100)
+        assert.are.equal(100, #writer)
+        assert.are.equal(0, writer[50])
+
+        local reader = vec.shm_open(name)
+        assert.are.equal(100, #reader)
+        vec.linspace(1, 100, 100):dup_(writer)
+        assert.are.equal(50, reader[50])
+        reader[1] = -1
+        assert.are.equal(-1, writer[1])
+      end
+    )
+    it(
+      "should count publications",
+      function()
+        local name = unique_name()
+        local writer = vec.shm_create(name, 4)
+        local reader = vec.shm_open(name)
+        assert.are.equal(0, vec.shm_seq(reader))
+        assert.are.equal(1, vec.shm_publish(writer))
+        assert.are.equal(2, vec.shm_publish(writer))
+        assert.are.equal(2, vec.shm_seq(reader))
+        assert.has.errors(
+          function()
+            vec.shm_seq(vec {1})
+          end
+        )
+      end
+    )
+    it(
+      "should not grow or be created twice",
+      function()
+        local name = unique_name()
+        local v = vec.shm_create(name, 2)
+        assert.has.errors(
+          function()
+            v:push(1)
+          end
+        )
+        assert.has.errors(
+          function()
+            vec.shm_create(name, 2)
+          end
+        )
+      end
+    )
+    it(
+      "should unlink the name once the creator is collected",
+      function()
+        local name = unique_name()
+        local v = vec.shm_create(name, 2)
+        v = nil
+        collectgarbage()
+        collectgarbage()
+        assert.has.errors(
+          function()
+            vec.shm_open(name)
+          end
+        )
+      end
+    )
+  end
+)
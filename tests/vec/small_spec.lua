@@ -0,0 +1,168 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function assert_components(expected, v)
+  assert.are.equal(#expected, #v)
+  for i = 1, #expected do
+    assert.near(expected[i], v[i], 1e-15)
+  end
+end
+
+describe(
+  "small vectors",
+  function()
+    it(
+      "should be constructed from numbers and vectors",
+      function()
+        assert_components({1, 2}, vec.vec2(1, 2))
+        assert_components({1, 2, 0}, vec.vec3(1, 2))
+        assert_components({0, 0, 0, 0}, vec.vec4())
+        assert_components({4, 5, 6}, vec.vec3(vec {4, 5, 6}))
+        assert_components({4, 5, 6}, vec {4, 5, 6}:vec3())
+
+        local v = vec.vec3(1, 2, 3)
+        local copy = vec.vec3(v)
+        copy.x = 10
+        assert.are.equal(1, v.x)
+        assert.has_error(
+          function()
+            vec.vec3(vec {1, 2})
+          end
+        )
+        assert.has_error(
+          function()
+            vec.vec3(vec.vec2(1, 2))
+          end
+        )
+      end
+    )
+    it(
+      "should index components by position and by name",
+      function()
+        local v = vec.vec4(1, 2, 3, 4)
+        assert.are.equal(1, v.x)
+        assert.are.equal(2, v.y)
+        assert.are.equal(3, v.z)
+        assert.are.equal(4, v.w)
+        assert.are.equal(3, v[3])
+        v.y = 7
+        v[4] = 8
+        assert_components({1, 7, 3, 8}, v)
+        assert.are.equal(4, #v)
+
+        local p = vec.vec2(1, 2)
+        assert.is_nil(p.z)
+        assert.has_error(
+          function()
+            return p[3]
+          end
+        )
+        assert.has_error(
+          function()
+            p.z = 1
+          end
+        )
+      end
+    )
+    it(
+      "should do arithmetic",
+      function()
+        local a, b = vec.vec3(1, 2, 3), vec.vec3(4, 5, 6)
+        assert_components({5, 7, 9}, a + b)
+        assert_components({-3, -3, -3}, a - b)
+        assert_components({4, 10, 18}, a * b)
+        assert_components({2, 4, 6}, a * 2)
+        assert_components({2, 4, 6}, 2 * a)
+        assert_components({0.5, 1, 1.5}, a / 2)
+        assert_components({4, 2.5, 2}, b / a)
+        assert_components({-1, -2, -3}, -a)
+        assert_components({2, 3, 4}, a:add(1))
+        assert.are.equal(vec.vec3(1, 2, 3), a)
+        assert.are_not.equal(vec.vec3(1, 2, 4), a)
+        assert.has_error(
+          function()
+            return a + vec.vec2(1, 2)
+          end
+        )
+      end
+    )
+    it(
+      "should update in place without allocating",
+      function()
+        local a, b = vec.vec3(1, 2, 3), vec.vec3(4, 5, 6)
+        assert.are.equal(a, a:add_(b))
+        assert_components({5, 7, 9}, a)
+        a:mul_(2):sub_(b)
+        assert_components({6, 9, 12}, a)
+
+        local out = vec.vec3()
+        assert.are.equal(out, a:div_(3, out))
+        assert_components({2, 3, 4}, out)
+        assert_components({6, 9, 12}, a)
+        a:neg_()
+        assert_components({-6, -9, -12}, a)
+        assert_components({1, 2, 3}, a:set(1, 2, 3))
+
+        -- a loop of in-place updates creates no garbage
+        collectgarbage()
+        collectgarbage("stop")
+        local before = collectgarbage("count")
+        for _ = 1, 1000 do
+          a:add_(b):mul_(0.5):lerp_(b, 0.1)
+        end
+        local after = collectgarbage("count")
+        collectgarbage("restart")
+        assert.is_true(after - before < 1)
+      end
+    )
+    it(
+      "should compute products and norms",
+      function()
+        local a, b = vec.vec3(1, 0, 0), vec.vec3(0, 1, 0)
+        assert_components({0, 0, 1}, a:cross(b))
+        assert_components({0, 0, -1}, b:cross(a))
+        local c = vec.vec3(1, 2, 3)
+        c:cross_(vec.vec3(4, 5, 6))
+        assert_components({-3, 6, -3}, c)
+        assert.are.equal(-2, vec.vec2(1, 2):cross(vec.vec2(3, 4)))
+        assert.is_nil(vec.vec4().cross)
+
+        local v = vec.vec4(1, 2, 3, 4)
+        assert.are.equal(30, v:dot(v))
+        assert.are.equal(30, v:norm2())
+        assert.near(math.sqrt(30), v:norm(), 1e-15)
+        assert.near(1, v:normalize():norm(), 1e-15)
+        v:normalize_()
+        assert.near(1, v:norm(), 1e-15)
+      end
+    )
+    it(
+      "should interpolate",
+      function()
+        local a, b = vec.vec2(0, 10), vec.vec2(10, 20)
+        assert_components({2.5, 12.5}, a:lerp(b, 0.25))
+        assert_components({0, 10}, a:lerp(b, 0))
+        assert_components({10, 20}, a:lerp(b, 1))
+        a:lerp_(b, 0.5)
+        assert_components({5, 15}, a)
+      end
+    )
+    it(
+      "should convert to and from vectors",
+      function()
+        local v = vec.vec3(1, 2, 3)
+        local x = v:tovec()
+        assert.are.equal(3, #x)
+        assert.are.equal(6, x:sum())
+        x[1] = 10
+        assert.are.equal(1, v.x)
+        assert.are.same({1, 2, 3}, {v:unpack()})
+        assert.are.equal("vec3(1.0, 2.0, 3.0)", tostring(v))
+
+        local d = v:dup()
+        d.x = 5
+        assert.are.equal(1, v.x)
+      end
+    )
+  end
+)
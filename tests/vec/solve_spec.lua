@@ -0,0 +1,239 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+-- tridiagonal operator with the given diagonals, as a function and as a dense
+-- matrix
+local function tridiag(n, lower, diag, upper)
+  local function apply(x, out)
+    for i = 1, n do
+      local y = diag(i) * x[i]
+      if i > 1 then
+        y = y + lower * x[i - 1]
+      end
+      if i < n then
+        y = y + upper * x[i + 1]
+      end
+      out[i] = y
+    end
+  end
+
+  local dense = vec(n * n)
+  for i = 1, n do
+    dense[(i - 1) * n + i] = diag(i)
+    if i > 1 then
+      dense[(i - 1) * n + i - 1] = lower
+    end
+    if i < n then
+      dense[(i - 1) * n + i + 1] = upper
+    end
+  end
+  return apply, dense
+end
+
+local function rhs(apply, n)
+  local expected = vec.linspace(-1, 1, n):sin_()
+  local b = vec(n)
+  apply(expected, b)
+  return expected, b
+end
+
+local function assert_solved(expected, x, tol)
+  for i = 1, #expected do
+    assert.near(expected[i], x[i], tol)
+  end
+end
+
+describe(
+  "iterative solvers",
+  function()
+    local n = 60
+    local spd, spd_dense = tridiag(
+      n,
+      -1,
+      function(i)
+        return 2 + i / 10
+      end,
+      -1
+    )
+    local nonsym, nonsym_dense = tridiag(
+      n,
+      -1.5,
+      function()
+        return 3
+      end,
+      -0.5
+    )
+
+    it(
+      "should solve symmetric positive definite systems with CG",
+      function()
+        local expected, b = rhs(spd, n)
+        for _, A in ipairs {spd, spd_dense} do
+          for _, jacobi in ipairs {false, true} do
+            local diag = jacobi
+            if jacobi and type(A) == "function" then
+              diag = vec(n)
+              for i = 1, n do
+                diag[i] = 2 + i / 10
+              end
+            end
+            local x, converged, iters, res =
+              vec.solve_cg(A, b, nil, {tol = 1e-12, jacobi = diag})
+            assert.is_true(converged)
+            assert.is_true(iters <= n)
+            assert.is_true(res <= 1e-12)
+            assert_solved(expected, x, 1e-9)
+          end
+        end
+      end
+    )
+    it(
+      "should solve nonsymmetric systems with BiCGSTAB and GMRES",
+      function()
+        local expected, b = rhs(nonsym, n)
+        for _, solve in ipairs {vec.solve_bicgstab, vec.solve_gmres} do
+          for _, A in ipairs {nonsym, nonsym_dense} do
+            for _, jacobi in ipairs {false, true} do
+              local x, converged =
+                solve(
+                A,
+                b,
+                nil,
+                {tol = 1e-12, jacobi = jacobi and vec.ones(n):scale_(3)}
+              )
+              assert.is_true(converged)
+              assert_solved(expected, x, 1e-9)
+            end
+          end
+        end
+      end
+    )
+    it(
+      "should restart GMRES and start from the initial guess",
+      function()
+        local expected, b = rhs(nonsym, n)
+        local x0 = vec.ones(n)
+        local x, converged, iters =
+          vec.solve_gmres(nonsym, b, x0, {tol = 1e-10, restart = 5})
+        assert.are.equal(x0, x)
+        assert.is_true(converged)
+        assert.is_true(iters > 5)
+        assert_solved(expected, x, 1e-8)
+      end
+    )
+    it(
+      "should report running out of iterations",
+      function()
+        local _, b = rhs(spd, n)
+        local _, converged, iters, res =
+          vec.solve_cg(spd, b, nil, {maxiter = 3})
+        assert.is_false(converged)
+        assert.are.equal(3, iters)
+        assert.is_true(res > 1e-8)
+      end
+    )
+    it(
+      "should return zero for a zero right hand side",
+      function()
+        local x, converged, iters = vec.solve_bicgstab(spd, vec(n))
+        assert.is_true(converged)
+        assert.are.equal(0, iters)
+        assert.are.equal(0, x:norm())
+      end
+    )
+    it(
+      "should follow vectors the operator reallocates",
+      function()
+        local function move(v)
+          v:reserve(2 * #v):shrink_to_fit()
+        end
+        for _, solve in ipairs {
+          vec.solve_cg,
+          vec.solve_bicgstab,
+          vec.solve_gmres
+        } do
+          local A = solve == vec.solve_cg and spd or nonsym
+          local expected, b = rhs(A, n)
+          local x0 = vec(n)
+          local x, converged =
+            solve(
+            function(x, out)
+              move(x)
+              move(out)
+              move(b)
+              move(x0)
+              A(x, out)
+            end,
+            b,
+            x0,
+            {tol = 1e-12}
+          )
+          assert.is_true(converged)
+          assert_solved(expected, x, 1e-9)
+        end
+        assert.has.errors(
+          function()
+            vec.solve_cg(
+              function(x, out)
+                out:push(0)
+              end,
+              vec(n)
+            )
+          end
+        )
+      end
+    )
+    it(
+      "should validate its arguments",
+      function()
+        local b = vec(n)
+        assert.has.errors(
+          function()
+            vec.solve_cg(vec(n), b)
+          end
+        )
+        assert.has.errors(
+          function()
+            vec.solve_cg(spd, b, nil, {jacobi = true})
+          end
+        )
+        assert.has.errors(
+          function()
+            vec.solve_cg(spd, b, vec(n - 1))
+          end
+        )
+        for _, opts in ipairs {
+          {maxiter = 0 / 0},
+          {maxiter = 2.5},
+          {maxiter = -1},
+          {maxiter = 1e300},
+          {restart = 0},
+          {restart = 0 / 0},
+          {tol = 0 / 0}
+        } do
+          assert.has.errors(
+            function()
+              vec.solve_gmres(spd, b, nil, opts)
+            end
+          )
+        end
+      end
+    )
+    it(
+      "should solve empty systems",
+      function()
+        for _, solve in ipairs {
+          vec.solve_cg,
+          vec.solve_bicgstab,
+          vec.solve_gmres
+        } do
+          local x, converged, iters, res = solve(vec.seq(), vec.seq())
+          assert.are.equal(0, #x)
+          assert.is_true(converged)
+          assert.are.equal(0, iters)
+          assert.are.equal(0, res)
+        end
+      end
+    )
+  end
+)
@@ -0,0 +1,102 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+describe(
+  "sparse vector",
+  function()
+    it(
+      "should read zeros where nothing is stored",
+      function()
+        local s = vec.sparse(1000)
+        assert.are.equal(1000, #s)
+        assert.are.equal(0, s:nnz())
+        assert.are.equal(0, s[500])
+      end
+    )
+    it(
+      "should index lengths beyond the range of an int",
+      function()
+        local s = vec.sparse(5000000000)
+        s[3000000000] = 1
+        assert.are.equal(1, s[3000000000])
+        assert.are.equal(0, s[4999999999])
+        local str = tostring(s)
+        assert.is_truthy(str:find("sparse(5000000000){[3000000000]=", 1, true))
+        local ok, err = pcall(
+          function()
+            return s[5000000001]
+          end
+        )
+        assert.is_false(ok)
+        assert.is_truthy(err:find("5000000001", 1, true))
+      end
+    )
+    it(
+      "should keep elements sorted regardless of insertion order",
+      function()
+        local s = vec.sparse(10)
+        s[7] = 7
+        s[2] = 2
+        s:set(9, 9)
+        s[2] = 4
+        assert.are.equal(3, s:nnz())
+        local seen = {}
+        for i, x in s:iter() do
+          seen[#seen + 1] = i
+        end
+        assert.are.same({2, 7, 9}, seen)
+        assert.are.equal(4, s[2])
+
+        s[7] = 0
+        assert.are.equal(2, s:nnz())
+        assert.are.equal(0, s[7])
+      end
+    )
+    it(
+      "should convert from and to dense vectors",
+      function()
+        local v = vec {0, 1e-9, 3, 0, -2}
+        local s = vec.fromdense(v, 1e-6)
+        assert.are.equal(2, s:nnz())
+        local d = s:todense()
+        assert.are.equal(5, #d)
+        assert.are.equal(0, d[2])
+        assert.are.equal(3, d[3])
+        assert.are.equal(-2, d[5])
+        assert.are.equal(3, vec.fromdense(v):nnz())
+
+        local nan = vec.fromdense(vec {1, 0 / 0, 2}):todense()
+        assert.are.equal(1, nan[1])
+        assert.are_not.equal(nan[2], nan[2])
+        assert.are.equal(2, nan[3])
+
+        assert.are.equal(0, #vec.sparse(0))
+        local empty = vec.fromdense(vec.seq())
+        assert.are.equal(0, #empty)
+        assert.are.equal(0, empty:nnz())
+        assert.are.equal(0, #empty:todense())
+      end
+    )
+    it(
+      "should compute dot products with dense and sparse vectors",
+      function()
+        local a = vec {1, 0, 2, 0, 3}
+        local b = vec {0, 5, 4, 0, -1}
+        local sa = vec.fromdense(a)
+        assert.are.equal(a:dot(b), sa:dot(b))
+        assert.are.equal(a:dot(b), sa:dot(vec.fromdense(b)))
+      end
+    )
+    it(
+      "should add a scaled sparse vector into a dense one",
+      function()
+        local s = vec.fromdense(vec {0, 1, 0, 2})
+        local y = vec.ones(4)
+        assert.are.equal(y, s:axpy_(2, y))
+        assert.are.equal(1, y[1])
+        assert.are.equal(3, y[2])
+        assert.are.equal(5, y[4])
+      end
+    )
+  end
+)
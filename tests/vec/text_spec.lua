@@ -0,0 +1,217 @@
+pcall(require, "luarocks.require")
+local vec = require "vec"
+
+local function read_all(filename)
+  local f = assert(io.open(filename, "r"))
+  local contents = f:read("*a")
+  f:close()
+  return contents
+end
+
+describe(
+  "tostring",
+  function()
+    it(
+      "should print the shortest representation which reads back exactly",
+      function()
+        local v = vec {0.1, 1 / 3, 1e300, -2, 5e-324}
+        assert.are.equal(
+          "[0.1, 0.3333333333333333, 1e+300, -2.0, 5e-324]",
+          tostring(v)
+        )
+        for x in tostring(v):gmatch("[^%[%], ]+") do
+          assert.is_not_nil(tonumber(x))
+        end
+      end
+    )
+    it(
+      "should print special values",
+      function()
+        local v = vec {math.huge, -math.huge, 0 / 0, -0.0}
+        assert.are.equal("[inf, -inf, nan, -0.0]", tostring(v))
+      end
+    )
+    it(
+      "should summarize long vectors",
+      function()
+        local v = vec.linspace(1, 2000, 2000)
+        assert.are.equal(
+          "[1.0, 2.0, 3.0, ..., 1998.0, 1999.0, 2000.0]",
+          tostring(v)
+        )
+
+        local threshold, edgeitems = vec.printoptions(5, 1)
+        assert.are.equal(1000, threshold)
+        assert.are.equal(3, edgeitems)
+        assert.are.equal("[1.0, ..., 2000.0]", tostring(v))
+        assert.are.equal("[1.0, 2.0, 3.0]", tostring(vec {1, 2, 3}))
+        vec.printoptions(threshold, edgeitems)
+      end
+    )
+  end
+)
+
+describe(
+  "savetxt",
+  function()
+    local filename = os.tmpname()
+    teardown(
+      function()
+        os.remove(filename)
+      end
+    )
+
+    it(
+      "should write one element per line by default",
+      function()
+        vec {1, 0.5, -3}:savetxt(filename)
+        assert.are.equal("1.0\n0.5\n-3.0\n", read_all(filename))
+      end
+    )
+    it(
+      "should accept a separator and a number format",
+      function()
+        vec {1, 0.5, -3}:savetxt(filename, ", ", "%.2f")
+        assert.are.equal("1.00, 0.50, -3.00\n", read_all(filename))
+      end
+    )
+    it(
+      "should round-trip large vectors",
+      function()
+        local v = vec.rand(100000, 7)
+        v:savetxt(filename)
+        local i = 0
+        for line in io.lines(filename) do
+          i = i + 1
+          assert.are.equal(v[i], tonumber(line))
+        end
+        assert.are.equal(#v, i)
+      end
+    )
+    it(
+      "should reject invalid formats",
+      function()
+        for _, fmt in ipairs {"%d", "%s", "%f %f", "no conversion", "%"} do
+          assert.has.errors(
+            function()
+              vec {1}:savetxt(filename, "\n", fmt)
+            end
+          )
+        end
+      end
+    )
+  end
+)
+
+describe(
+  "loadtxt",
+  function()
+    local filename = os.tmpname()
+    teardown(
+      function()
+        os.remove(filename)
+      end
+    )
+
+    local function write(contents)
+      local f = assert(io.open(filename, "wb"))
+      f:write(contents)
+      f:close()
+    end
+
+    it(
+      "should read back what savetxt wrote",
+      function()
+        local v = vec.rand(100000, 3) * 1e6 - 5e5
+        v:savetxt(filename)
+        local w = vec.loadtxt(filename)
+        assert.are.equal(#v, #w)
+        for i = 1, #v do
+          assert.are.equal(v[i], w[i])
+        end
+      end
+    )
+    it(
+      "should return one vector per column",
+      function()
+        write("# comment\n1 2 3\n\n  4\t5 6  \r\n7 8 9")
+        local a, b, c = vec.loadtxt(filename)
+        assert.are.equal(3, #a)
+        assert.are.equal(4, a[2])
+        assert.are.equal(5, b[2])
+        assert.are.equal(9, c[3])
+      end
+    )
+    it(
+      "should parse csv with a header and column selection",
+      function()
+        write("x,y,z\r\n1.5, -2e3 ,0.25\r\n-0.125,1E-2,inf\r\n")
+        local z, x = vec.loadtxt(
+          filename,
+          {delimiter = ",", skip = 1, columns = {3, 1}}
+        )
+        assert.are.equal(2, #z)
+        assert.are.equal(0.25, z[1])
+        assert.are.equal(math.huge, z[2])
+        assert.are.equal(1.5, x[1])
+        assert.are.equal(-0.125, x[2])
+        local y = vec.loadtxt(
+          filename,
+          {delimiter = ",", skip = 1, columns = {2}}
+        )
+        assert.are.equal(-2000, y[1])
+        assert.are.equal(0.01, y[2])
+      end
+    )
+    it(
+      "should parse numbers exactly",
+      function()
+        local strings = {
+          "0.1", "123456789012345678901234567890", "2.2250738585072014e-308",
+          "4.9e-324", "1.7976931348623157e308", "9007199254740993",
+          "0.30000000000000004", "-1e-22", "1e23"
+        }
+        write(table.concat(strings, "\n"))
+        local v = vec.loadtxt(filename)
+        for i, s in ipairs(strings) do
+          assert.are.equal(tonumber(s) * 1.0, v[i])
+        end
+      end
+    )
+    it(
+      "should return empty vectors for files without data",
+      function()
+        write("# nothing here\n\n")
+        assert.are.equal(0, #vec.loadtxt(filename))
+      end
+    )
+    it(
+      "should error on malformed input",
+      function()
+        write("1 2\n3\n")
+        assert.has.errors(
+          function()
+            vec.loadtxt(filename)
+          end
+        )
+        write("1,2\n3,x\n")
+        assert.has.errors(
+          function()
+            vec.loadtxt(filename, {delimiter = ","})
+          end
+        )
+        write("1,2\n3,4\n")
+        assert.has.errors(
+          function()
+            vec.loadtxt(filename, {delimiter = ",", columns = {3}})
+          end
+        )
+        assert.has.errors(
+          function()
+            vec.loadtxt(filename, {delimiter = ",", columns = {2, 1, 2}})
+          end
+        )
+      end
+    )
+  end
+)
@@ -1,29 +1,61 @@
+// ftruncate, shm_open and mmap are POSIX and hidden by strict -std=c99 builds,
+// so ask for them before any system header gets included
+#if defined(__unix__) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
 #include "lauxlib.h"
 #include "lua.h"
 #include <errno.h>
+#include <float.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "vector.h"
+#include "vector_ext.h"
 
 #include "vectorize_compat.h"
+#include "vectorize_dtoa.h"
+
+#ifdef VECTORIZE_HAVE_SHM
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 const char vector_lib_mt_name[] = "liblua-vectorize";
 
 const uint8_t intsize = sizeof(lua_Integer);
 const uint8_t numbersize = sizeof(lua_Number);
 
-static inline void _vec_check_oob(lua_State *L, int idx, lua_Integer len) {
+// lua_pushfstring only formats ints with %d, so lua_Integers which may not fit
+// in one are printed into a buffer of this size first
+#define VEC_INTEGER_BUFSIZE 32
+
+static inline const char *_vec_integer_str(char *buf, lua_Integer x) {
+  snprintf(buf, VEC_INTEGER_BUFSIZE, LUA_INTEGER_FMT, x);
+  return buf;
+}
+
+static inline void
+_vec_check_oob(lua_State *L, lua_Integer idx, lua_Integer len) {
   // idx is the 0-based index!
+  char ibuf[VEC_INTEGER_BUFSIZE], lbuf[VEC_INTEGER_BUFSIZE];
   if (idx < 0) {
-    luaL_error(L, "Expected positive integer, got %d", idx + 1);
+    luaL_error(
+      L, "Expected positive integer, got %s", _vec_integer_str(ibuf, idx + 1));
   } else if (idx >= len) {
     luaL_error(
-      L, "Index out of bounds: %d (vector has length %d)", idx + 1, len);
+      L,
+      "Index out of bounds: %s (vector has length %s)",
+      _vec_integer_str(ibuf, idx + 1),
+      _vec_integer_str(lbuf, len));
   }
 }
 
@@ -35,37 +67,76 @@ _vec_check_same_len(lua_State *L, const Vector *x, const Vector *y) {
   }
 }
 
-int vec_new(lua_State *L) {
-  lua_Integer len;
-  lua_Number *values;
-  Vector *v;
-
-  len = luaL_checkinteger(L, 1);
-  lua_pop(L, 1);
-  if (len <= 0) {
-    return luaL_error(L, "Expected positive integer for size, got %d", len);
+static inline Vector *_vec_check_writable(lua_State *L, Vector *v) {
+  if (v->storage == VEC_STORAGE_READONLY) {
+    luaL_error(L, "Vector is read-only");
   }
+  return v;
+}
 
-  values = calloc(len, sizeof(*values));
-  if (values == NULL) {
-    return luaL_error(L, "Could not allocate vector");
-  }
+static inline Vector *_vec_check_out(lua_State *L, int idx) {
+  return _vec_check_writable(L, luaL_checkudata(L, idx, vector_mt_name));
+}
 
-  v = newudata(L, sizeof(*v));
+static inline Vector *
+_vec_push_alloc(lua_State *L, lua_Integer len, lua_Integer capacity) {
+  if (len < 0) {
+    luaL_error(L, "Expected non-negative integer for size, got %d", len);
+  }
 
+  Vector *v = newudata(L, sizeof(*v));
+  v->values = NULL;
+  v->len = 0;
+  v->capacity = 0;
+  v->storage = VEC_STORAGE_OWNED;
   setmetatable(L, vector_mt_name);
 
+  // always allocate at least one element so values is never NULL
+  v->values = calloc(capacity > 0 ? capacity : 1, sizeof(*v->values));
+  if (v->values == NULL) {
+    luaL_error(L, "Could not allocate vector");
+  }
   v->len = len;
-  v->values = values;
+  v->capacity = capacity;
+  return v;
+}
+
+int vec_new(lua_State *L) {
+  lua_Integer len = luaL_checkinteger(L, 1);
+  lua_pop(L, 1);
+  if (len <= 0) {
+    return luaL_error(L, "Expected positive integer for size, got %d", len);
+  }
+
+  _vec_push_alloc(L, len, len);
   return 1;
 }
 
 static inline Vector *_vec_push_new(lua_State *L, lua_Integer len) {
-  lua_pushcfunction(L, &vec_new);
-  lua_pushinteger(L, len);
-  lua_call(L, 1, 1);
+  return _vec_push_alloc(L, len, len);
+}
+
+const char vector_views_key[] = "vector_views";
+
+static inline Vector *_vec_push_view(
+  lua_State *L, lua_Number *values, lua_Integer len, int owner_idx) {
+  owner_idx = lua_absindex(L, owner_idx);
+
+  Vector *v = newudata(L, sizeof(*v));
+  v->values = values;
+  v->len = len;
+  v->capacity = len;
+  v->storage = VEC_STORAGE_VIEW;
+  setmetatable(L, vector_mt_name);
 
-  return lua_touserdata(L, -1);
+  // keep the owner of the memory alive for as long as the view is reachable
+  // through a weak-keyed table in the registry
+  lua_getfield(L, LUA_REGISTRYINDEX, vector_views_key);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, owner_idx);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  return v;
 }
 
 int vec_from(lua_State *L) {
@@ -125,14 +196,443 @@ int vec_basis(lua_State *L) {
   return 1;
 }
 
-int vec_save(lua_State *L) {
-  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  const char *filename = luaL_checkstring(L, 2);
+// compressed vector files: a header, then blocks which are filtered,
+// byte-shuffled and LZ-compressed independently
+#define VECZ_VERSION 1
+#define VECZ_BLOCK_BYTES 65536
+#define VECZ_HASH_BITS 14
+#define VECZ_MIN_MATCH 4
+#define VECZ_MAX_OFFSET 65535
+#define VECZ_STORED 0x80
+
+static const char vecz_magic[] = {'\0', 'V', 'Z', VECZ_VERSION};
+
+enum VeczFilter {
+  VECZ_FILTER_NONE = 0,
+  VECZ_FILTER_XOR,    // each number xor the previous one
+  VECZ_FILTER_DELTA,  // each number minus the previous one, as an integer
+  VECZ_FILTER_LINEAR, // each number minus its linear extrapolation
+  VECZ_NFILTERS
+};
+
+static inline bool _vecz_has_filter(int filter) {
+  // integer deltas need a word type as wide as lua_Number
+  return filter <= VECZ_FILTER_XOR || numbersize == 8 || numbersize == 4;
+}
+
+static inline uint64_t _vecz_load_word(const uint8_t *p) {
+  if (numbersize == 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    return w;
+  } else {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return w;
+  }
+}
+
+static inline void _vecz_store_word(uint8_t *p, uint64_t w) {
+  if (numbersize == 8) {
+    memcpy(p, &w, 8);
+  } else {
+    uint32_t w32 = (uint32_t)w;
+    memcpy(p, &w32, 4);
+  }
+}
+
+static inline uint64_t
+_vecz_predict(const uint8_t *cur, size_t i, size_t width, int filter) {
+  // integer prediction of the number at cur from the ones before it
+  if (i == 0) {
+    return 0;
+  } else if (filter == VECZ_FILTER_DELTA || i == 1) {
+    return _vecz_load_word(cur - width);
+  } else {
+    return 2 * _vecz_load_word(cur - width) - _vecz_load_word(cur - 2 * width);
+  }
+}
+
+static void _vecz_filter(
+  const uint8_t *src, uint8_t *dst, size_t n, size_t width, int filter) {
+  // dst receives the filtered numbers transposed into byte planes
+  for (size_t i = 0; i < n; i++) {
+    uint8_t word[sizeof(lua_Number)];
+    const uint8_t *cur = src + i * width;
+    if (filter == VECZ_FILTER_NONE || i == 0) {
+      memcpy(word, cur, width);
+    } else if (filter == VECZ_FILTER_XOR) {
+      for (size_t b = 0; b < width; b++) {
+        word[b] = cur[b] ^ (cur - width)[b];
+      }
+    } else {
+      uint64_t residual =
+        _vecz_load_word(cur) - _vecz_predict(cur, i, width, filter);
+      _vecz_store_word(word, residual);
+    }
+    for (size_t b = 0; b < width; b++) {
+      dst[b * n + i] = word[b];
+    }
+  }
+}
+
+static void _vecz_unfilter(
+  const uint8_t *src, uint8_t *dst, size_t n, size_t width, int filter) {
+  for (size_t i = 0; i < n; i++) {
+    uint8_t *cur = dst + i * width;
+    for (size_t b = 0; b < width; b++) {
+      cur[b] = src[b * n + i];
+    }
+    if (i == 0 || filter == VECZ_FILTER_NONE) {
+      continue;
+    } else if (filter == VECZ_FILTER_XOR) {
+      for (size_t b = 0; b < width; b++) {
+        cur[b] ^= (cur - width)[b];
+      }
+    } else {
+      uint64_t residual = _vecz_load_word(cur);
+      _vecz_store_word(cur, residual + _vecz_predict(cur, i, width, filter));
+    }
+  }
+}
+
+static inline uint32_t _vecz_hash(const uint8_t *p) {
+  uint32_t w;
+  memcpy(&w, p, sizeof(w));
+  return (w * 2654435761U) >> (32 - VECZ_HASH_BITS);
+}
+
+static inline bool
+_vecz_put_length(uint8_t **op, const uint8_t *end, size_t len) {
+  // remainder of a length which did not fit in its token nibble
+  while (len >= 255) {
+    if (*op == end) {
+      return false;
+    }
+    *(*op)++ = 255;
+    len -= 255;
+  }
+  if (*op == end) {
+    return false;
+  }
+  *(*op)++ = (uint8_t)len;
+  return true;
+}
+
+static bool _vecz_put_sequence(
+  uint8_t **op,
+  const uint8_t *end,
+  const uint8_t *literals,
+  size_t nliterals,
+  size_t offset,
+  size_t match) {
+  // match == 0 marks the final, literals-only sequence
+  size_t mcode = match > 0 ? match - VECZ_MIN_MATCH : 0;
+  if (*op == end) {
+    return false;
+  }
+  *(*op)++ = (uint8_t)(
+    ((nliterals < 15 ? nliterals : 15) << 4) | (mcode < 15 ? mcode : 15));
+  if (nliterals >= 15 && !_vecz_put_length(op, end, nliterals - 15)) {
+    return false;
+  }
+  if ((size_t)(end - *op) < nliterals) {
+    return false;
+  }
+  memcpy(*op, literals, nliterals);
+  *op += nliterals;
+  if (match == 0) {
+    return true;
+  }
+
+  if (end - *op < 2) {
+    return false;
+  }
+  *(*op)++ = (uint8_t)(offset & 0xFF);
+  *(*op)++ = (uint8_t)(offset >> 8);
+  return mcode < 15 || _vecz_put_length(op, end, mcode - 15);
+}
+
+static size_t _vecz_compress(
+  const uint8_t *src,
+  size_t n,
+  uint8_t *dst,
+  size_t capacity,
+  int depth,
+  int32_t *head,
+  int32_t *chain) {
+  // returns the compressed size, or 0 if it would not fit in capacity
+  uint8_t *op = dst;
+  const uint8_t *end = dst + capacity;
+  size_t ip = 0, anchor = 0;
+
+  memset(head, 0xFF, sizeof(*head) << VECZ_HASH_BITS);
+  while (ip + VECZ_MIN_MATCH <= n) {
+    uint32_t h = _vecz_hash(src + ip);
+    size_t best_len = 0, best_offset = 0;
+    int32_t cand = head[h];
+    for (int d = 0; d < depth && cand >= 0 && ip - cand <= VECZ_MAX_OFFSET;
+         d++) {
+      size_t len = 0;
+      while (ip + len < n && src[cand + len] == src[ip + len]) {
+        len++;
+      }
+      if (len > best_len) {
+        best_len = len;
+        best_offset = ip - cand;
+      }
+      cand = chain[cand];
+    }
+    chain[ip] = head[h];
+    head[h] = (int32_t)ip;
+
+    if (best_len < VECZ_MIN_MATCH) {
+      ip++;
+      continue;
+    }
+    if (!_vecz_put_sequence(
+          &op, end, src + anchor, ip - anchor, best_offset, best_len)) {
+      return 0;
+    }
+    for (size_t k = ip + 1; k < ip + best_len && k + VECZ_MIN_MATCH <= n;
+         k++) {
+      h = _vecz_hash(src + k);
+      chain[k] = head[h];
+      head[h] = (int32_t)k;
+    }
+    ip += best_len;
+    anchor = ip;
+  }
+
+  if (!_vecz_put_sequence(&op, end, src + anchor, n - anchor, 0, 0)) {
+    return 0;
+  }
+  return op - dst;
+}
+
+static inline bool
+_vecz_get_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+  uint8_t byte;
+  do {
+    if (*ip == end) {
+      return false;
+    }
+    byte = *(*ip)++;
+    *len += byte;
+  } while (byte == 255);
+  return true;
+}
+
+static bool
+_vecz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t n) {
+  // false unless src decodes to exactly n bytes
+  const uint8_t *ip = src, *end = src + size;
+  size_t op = 0;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t nliterals = token >> 4;
+    if (nliterals == 15 && !_vecz_get_length(&ip, end, &nliterals)) {
+      return false;
+    }
+    if ((size_t)(end - ip) < nliterals || n - op < nliterals) {
+      return false;
+    }
+    memcpy(dst + op, ip, nliterals);
+    ip += nliterals;
+    op += nliterals;
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    size_t match = token & 15;
+    if (match == 15 && !_vecz_get_length(&ip, end, &match)) {
+      return false;
+    }
+    match += VECZ_MIN_MATCH;
+    if (offset == 0 || offset > op || n - op < match) {
+      return false;
+    }
+    // byte by byte, since the match may overlap its own output
+    for (size_t k = 0; k < match; k++, op++) {
+      dst[op] = dst[op - offset];
+    }
+  }
+  return op == n;
+}
+
+typedef struct VeczScratch {
+  uint8_t *filtered;
+  uint8_t *packed;
+  uint8_t *best;
+  int32_t *head;
+  int32_t *chain;
+} VeczScratch;
+
+static size_t _vecz_encode_block(
+  const uint8_t *src, size_t n, int level, VeczScratch *s, uint8_t *mode) {
+  // best of the filters tried for this level, or the raw block if nothing
+  // makes it smaller; the payload is left in s->best
+  size_t nbytes = n * numbersize;
+  size_t best_size = nbytes;
+  int depth = 1 << (level - 1);
+  *mode = VECZ_STORED;
+  memcpy(s->best, src, nbytes);
+
+  for (int filter = 0; filter < VECZ_NFILTERS; filter++) {
+    bool fast_filter =
+      filter == VECZ_FILTER_XOR || filter == VECZ_FILTER_LINEAR;
+    if (!_vecz_has_filter(filter) || (level < 4 && !fast_filter)) {
+      continue;
+    }
+    _vecz_filter(src, s->filtered, n, numbersize, filter);
+    size_t size = _vecz_compress(
+      s->filtered, nbytes, s->packed, best_size - 1, depth, s->head, s->chain);
+    if (size > 0) {
+      uint8_t *tmp = s->best;
+      s->best = s->packed;
+      s->packed = tmp;
+      best_size = size;
+      *mode = (uint8_t)filter;
+    }
+  }
+  return best_size;
+}
+
+static void
+_vec_save_compressed(lua_State *L, const Vector *self, FILE *fp, int level) {
+  const char *what = "header";
+  uint32_t block_len = VECZ_BLOCK_BYTES / numbersize;
+  VeczScratch s;
+  uint8_t *mem = malloc(
+    3 * VECZ_BLOCK_BYTES + (sizeof(int32_t) << VECZ_HASH_BITS) +
+    sizeof(int32_t) * VECZ_BLOCK_BYTES);
+  if (mem == NULL) {
+    fclose(fp);
+    luaL_error(L, "Could not allocate compression buffers");
+  }
+  s.head = (int32_t *)mem;
+  s.chain = s.head + (1 << VECZ_HASH_BITS);
+  s.filtered = (uint8_t *)(s.chain + VECZ_BLOCK_BYTES);
+  s.packed = s.filtered + VECZ_BLOCK_BYTES;
+  s.best = s.packed + VECZ_BLOCK_BYTES;
+
+  bool ok = fwrite(vecz_magic, sizeof(vecz_magic), 1, fp) == 1 &&
+            fwrite(&intsize, sizeof(intsize), 1, fp) == 1 &&
+            fwrite(&numbersize, sizeof(numbersize), 1, fp) == 1 &&
+            fwrite(&self->len, sizeof(self->len), 1, fp) == 1 &&
+            fwrite(&block_len, sizeof(block_len), 1, fp) == 1;
+
+  for (lua_Integer start = 0; ok && start < self->len; start += block_len) {
+    size_t n = self->len - start < block_len ? self->len - start : block_len;
+    uint8_t mode;
+    uint32_t size = (uint32_t)_vecz_encode_block(
+      (const uint8_t *)(self->values + start), n, level, &s, &mode);
+    what = "vector contents";
+    ok = fwrite(&mode, sizeof(mode), 1, fp) == 1 &&
+         fwrite(&size, sizeof(size), 1, fp) == 1 &&
+         fwrite(s.best, 1, size, fp) == size;
+  }
+
+  free(mem);
+  if (fclose(fp) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    luaL_error(
+      L,
+      "Could not write compressed %s to file.\n"
+      "errno: %d\n"
+      "%s",
+      what,
+      errno,
+      strerror(errno));
+  }
+}
+
+static const char *_vec_load_compressed(lua_State *L, FILE *fp) {
+  // the first byte of the magic has already been read; pushes the vector,
+  // or returns an error message
+  char magic[sizeof(vecz_magic) - 1];
+  uint8_t load_intsize, load_numbersize;
+  lua_Integer len;
+  uint32_t block_len;
+
+  if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+      memcmp(magic, vecz_magic + 1, sizeof(magic)) != 0) {
+    return "Not a vector file, or saved by an incompatible version.";
+  }
+  if (
+    fread(&load_intsize, sizeof(load_intsize), 1, fp) != 1 ||
+    fread(&load_numbersize, sizeof(load_numbersize), 1, fp) != 1 ||
+    load_intsize != intsize || load_numbersize != numbersize) {
+    return "Incompatible architectures: vector was saved in a machine with a "
+           "different lua_Integer or lua_Number size.";
+  }
+  if (
+    fread(&len, sizeof(len), 1, fp) != 1 ||
+    fread(&block_len, sizeof(block_len), 1, fp) != 1 || len < 0 ||
+    block_len == 0 || block_len > VECZ_BLOCK_BYTES / numbersize) {
+    return "Corrupted file: invalid header.";
+  }
+
+  Vector *new = _vec_push_alloc(L, len, len);
+  uint8_t *mem = malloc(2 * VECZ_BLOCK_BYTES);
+  if (mem == NULL) {
+    return "Could not allocate decompression buffers.";
+  }
+  uint8_t *packed = mem, *shuffled = mem + VECZ_BLOCK_BYTES;
+
+  const char *err = NULL;
+  for (lua_Integer start = 0; err == NULL && start < len; start += block_len) {
+    size_t n = len - start < block_len ? len - start : block_len;
+    size_t nbytes = n * numbersize;
+    uint8_t *dst = (uint8_t *)(new->values + start);
+    uint8_t mode;
+    uint32_t size;
+
+    if (
+      fread(&mode, sizeof(mode), 1, fp) != 1 ||
+      fread(&size, sizeof(size), 1, fp) != 1 || size > nbytes ||
+      fread(packed, 1, size, fp) != size) {
+      err = "Could not read whole vector. Was the file truncated?";
+    } else if (mode == VECZ_STORED) {
+      if (size == nbytes) {
+        memcpy(dst, packed, nbytes);
+      } else {
+        err = "Corrupted file: stored block has the wrong size.";
+      }
+    } else if (
+      mode >= VECZ_NFILTERS || !_vecz_has_filter(mode) ||
+      !_vecz_decompress(packed, size, shuffled, nbytes)) {
+      err = "Corrupted file: could not decompress block.";
+    } else {
+      _vecz_unfilter(shuffled, dst, n, numbersize, mode);
+    }
+  }
+  free(mem);
+  return err;
+}
+
+static int _vec_save(
+  lua_State *L, const Vector *self, const char *filename, lua_Integer level) {
+  if (level < 0 || level > 9) {
+    return luaL_error(L, "Compression level must be in [0, 9], got %d", level);
+  }
   FILE *fp = fopen(filename, "wb+");
 
   if (fp == NULL) {
     return luaL_error(L, "Could not open file %s for writing.", filename);
   }
+  if (level > 0) {
+    _vec_save_compressed(L, self, fp, (int)level);
+    return 0;
+  }
 
   // save architecture info (size of a lua integer)
   if (fwrite(&intsize, sizeof(intsize), 1, fp) == 0) {
@@ -171,7 +671,8 @@ int vec_save(lua_State *L) {
   }
 
   // save vector data
-  if (fwrite(self->values, sizeof(*self->values), self->len, fp) == 0) {
+  if (((lua_Integer)fwrite(
+        self->values, sizeof(*self->values), self->len, fp)) < self->len) {
     fclose(fp);
     return luaL_error(
       L,
@@ -187,18 +688,203 @@ int vec_save(lua_State *L) {
   return 0;
 }
 
-// TODO vec_savetxt
+int vec_save(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  const char *filename = luaL_checkstring(L, 2);
+  return _vec_save(L, self, filename, luaL_optinteger(L, 3, 0));
+}
+
+#define SAVETXT_BUFFER_SIZE 65536
+
+static void _vec_check_number_format(lua_State *L, const char *fmt) {
+  // exactly one floating point conversion, such as "%.6f" or "%10.3e"
+  int conversions = 0;
+  for (const char *p = fmt; *p != '\0'; p++) {
+    if (*p != '%') {
+      continue;
+    }
+    p++;
+    if (*p == '%') {
+      continue;
+    }
+    p += strspn(p, "-+ #0");
+    p += strspn(p, "0123456789");
+    if (*p == '.') {
+      p++;
+      p += strspn(p, "0123456789");
+    }
+    if (*p == '\0' || strchr("aAeEfFgG", *p) == NULL) {
+      luaL_error(L, "Invalid number format \"%s\"", fmt);
+    }
+    conversions++;
+  }
+  if (conversions != 1) {
+    luaL_error(
+      L, "Number format must have exactly one conversion, got \"%s\"", fmt);
+  }
+}
+
+typedef struct TextWriter {
+  FILE *fp;
+  char *buf;
+  size_t pos;
+  bool ok;
+} TextWriter;
+
+static void _vec_writer_flush(TextWriter *w) {
+  if (w->ok && fwrite(w->buf, 1, w->pos, w->fp) < w->pos) {
+    w->ok = false;
+  }
+  w->pos = 0;
+}
+
+static void _vec_writer_write(TextWriter *w, const char *data, size_t len) {
+  if (len > SAVETXT_BUFFER_SIZE - w->pos) {
+    _vec_writer_flush(w);
+  }
+  if (len > SAVETXT_BUFFER_SIZE) {
+    if (w->ok && fwrite(data, 1, len, w->fp) < len) {
+      w->ok = false;
+    }
+  } else {
+    memcpy(w->buf + w->pos, data, len);
+    w->pos += len;
+  }
+}
+
+static bool
+_vec_writer_number(TextWriter *w, lua_Number x, const char *fmt) {
+  // false if a formatted number would not fit in the buffer
+  if (fmt == NULL) {
+    if (SAVETXT_BUFFER_SIZE - w->pos < VEC_DTOA_BUFSIZE) {
+      _vec_writer_flush(w);
+    }
+    w->pos += vec_dtoa(x, w->buf + w->pos);
+    return true;
+  }
+
+  size_t avail = SAVETXT_BUFFER_SIZE - w->pos;
+  int len = snprintf(w->buf + w->pos, avail, fmt, (double)x);
+  if (len >= 0 && (size_t)len >= avail) {
+    _vec_writer_flush(w);
+    avail = SAVETXT_BUFFER_SIZE;
+    len = snprintf(w->buf, avail, fmt, (double)x);
+  }
+  if (len < 0 || (size_t)len >= avail) {
+    return false;
+  }
+  w->pos += len;
+  return true;
+}
+
+int vec_savetxt(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  const char *filename = luaL_checkstring(L, 2);
+  size_t seplen;
+  const char *sep = luaL_optlstring(L, 3, "\n", &seplen);
+  const char *fmt = luaL_optstring(L, 4, NULL);
+  if (fmt != NULL) {
+    _vec_check_number_format(L, fmt);
+  }
+
+  TextWriter w = {NULL, malloc(SAVETXT_BUFFER_SIZE), 0, true};
+  if (w.buf == NULL) {
+    return luaL_error(L, "Could not allocate write buffer");
+  }
+  w.fp = fopen(filename, "w");
+  if (w.fp == NULL) {
+    free(w.buf);
+    return luaL_error(L, "Could not open file %s for writing.", filename);
+  }
+
+  bool fits = true;
+  for (lua_Integer i = 0; i < self->len && fits && w.ok; i++) {
+    if (i > 0) {
+      _vec_writer_write(&w, sep, seplen);
+    }
+    fits = _vec_writer_number(&w, self->values[i], fmt);
+  }
+  _vec_writer_write(&w, "\n", 1);
+  _vec_writer_flush(&w);
+
+  free(w.buf);
+  if (fclose(w.fp) != 0) {
+    w.ok = false;
+  }
+  if (!fits) {
+    return luaL_error(L, "Number format \"%s\" produced too long a text", fmt);
+  } else if (!w.ok) {
+    return luaL_error(
+      L,
+      "Could not write whole vector contents to file.\n"
+      "errno: %d\n"
+      "%s",
+      errno,
+      strerror(errno));
+  }
+
+  return 0;
+}
+
+const char file_mt_name[] = "vector_file";
+
+// a file being read, closed when collected so that an error raised halfway
+// through loading, even by an allocation, does not leak it
+typedef struct VecFile {
+  FILE *fp;
+} VecFile;
+
+static VecFile *_vec_push_file(lua_State *L, const char *filename) {
+  VecFile *f = newudata(L, sizeof(*f));
+  f->fp = NULL;
+  setmetatable(L, file_mt_name);
+  f->fp = fopen(filename, "rb");
+  if (f->fp == NULL) {
+    luaL_error(L, "Could not open file %s for reading.", filename);
+  }
+  return f;
+}
+
+static void _vec_close_file(VecFile *f) {
+  if (f->fp != NULL) {
+    fclose(f->fp);
+    f->fp = NULL;
+  }
+}
+
+int file__gc(lua_State *L) {
+  _vec_close_file(luaL_checkudata(L, 1, file_mt_name));
+  return 0;
+}
+
+void create_file_metatable(lua_State *L) {
+  luaL_newmetatable(L, file_mt_name);
+  lua_pushcfunction(L, &file__gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
+
+static int _vec_load_finish(lua_State *L, VecFile *f) {
+  char dummy;
+  if (fread(&dummy, sizeof(dummy), 1, f->fp) != 0) {
+    return luaL_error(
+      L,
+      "File has additional data after end of vector. Is this really a vector "
+      "file?");
+  }
+
+  _vec_close_file(f);
+  return 1;
+}
 
 int vec_load(lua_State *L) {
   const char *filename = luaL_checkstring(L, 1);
-  FILE *fp = fopen(filename, "rb");
-  if (fp == NULL) {
-    return luaL_error(L, "Could not open file %s for reading.", filename);
-  }
+  lua_settop(L, 1);
+  VecFile *f = _vec_push_file(L, filename);
+  FILE *fp = f->fp;
 
   uint8_t load_intsize;
   if (fread(&load_intsize, sizeof(load_intsize), 1, fp) == 0) {
-    fclose(fp);
     return luaL_error(
       L,
       "Corrupted file: could not read architecture information (lua_Integer "
@@ -208,8 +894,13 @@ int vec_load(lua_State *L) {
       errno,
       strerror(errno));
   }
-  if (load_intsize != intsize) {
-    fclose(fp);
+  if (load_intsize == (uint8_t)vecz_magic[0]) {
+    const char *err = _vec_load_compressed(L, fp);
+    if (err != NULL) {
+      return luaL_error(L, "%s", err);
+    }
+    return _vec_load_finish(L, f);
+  } else if (load_intsize != intsize) {
     return luaL_error(
       L,
       "Incompatible architectures: vector was saved in a machine with "
@@ -220,7 +911,6 @@ int vec_load(lua_State *L) {
   }
   uint8_t load_numbersize;
   if (fread(&load_numbersize, sizeof(load_numbersize), 1, fp) == 0) {
-    fclose(fp);
     return luaL_error(
       L,
       "Corrupted file: could not read architecture information (lua_Number "
@@ -231,7 +921,6 @@ int vec_load(lua_State *L) {
       strerror(errno));
   }
   if (load_numbersize != numbersize) {
-    fclose(fp);
     return luaL_error(
       L,
       "Incompatible architectures: vector was saved in a machine with "
@@ -245,7 +934,6 @@ int vec_load(lua_State *L) {
 
   lua_Integer len;
   if (fread(&len, sizeof(len), 1, fp) == 0) {
-    fclose(fp);
     return luaL_error(
       L,
       "Could not read vector length from file.\n"
@@ -257,7 +945,6 @@ int vec_load(lua_State *L) {
 
   Vector *new = _vec_push_new(L, len);
   if (((lua_Integer)fread(new->values, numbersize, len, fp)) < len) {
-    fclose(fp);
     return luaL_error(
       L,
       "Could not read whole vector. Was the file truncated?\n"
@@ -267,38 +954,453 @@ int vec_load(lua_State *L) {
       strerror(errno));
   }
 
-  char dummy;
-  if (fread(&dummy, sizeof(dummy), 1, fp) != 0) {
-    fclose(fp);
-    return luaL_error(
-      L,
-      "File has additional data after end of vector. Is this really a vector "
-      "file?");
-  }
+  return _vec_load_finish(L, f);
+}
 
-  fclose(fp);
-  return 1;
+#define LOADTXT_BLOCK_SIZE (1 << 20)
+#define LOADTXT_ERROR_SIZE 256
+
+// 10^k for the exactly representable range of doubles
+static const double loadtxt_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+const char text_reader_mt_name[] = "vector_text_reader";
+
+// kept in a userdata which closes the file and frees the buffer when
+// collected, so that errors raised while reading do not leak them
+typedef struct TextReader {
+  FILE *fp;
+  char *buf; // one spare byte past capacity for a NUL
+  size_t capacity;
+  size_t len;
+  size_t pos;
+  bool eof;
+  bool failed; // out of memory
+} TextReader;
+
+static void _txt_close(TextReader *r) {
+  if (r->fp != NULL) {
+    fclose(r->fp);
+    r->fp = NULL;
+  }
+  free(r->buf);
+  r->buf = NULL;
 }
 
-// TODO vec_loadtxt
+int text_reader__gc(lua_State *L) {
+  _txt_close(luaL_checkudata(L, 1, text_reader_mt_name));
+  return 0;
+}
 
-int vec_reset(lua_State *L) {
-  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  memset(self->values, 0, self->len * sizeof(lua_Number));
-  lua_settop(L, 1);
-  return 1;
+void create_text_reader_metatable(lua_State *L) {
+  luaL_newmetatable(L, text_reader_mt_name);
+  lua_pushcfunction(L, &text_reader__gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
 }
 
-int vec_dup(lua_State *L) {
-  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *new = _vec_push_new(L, self->len);
-  memcpy(new->values, self->values, self->len * sizeof(lua_Number));
-  return 1;
+typedef struct TextOptions {
+  char delimiter; // '\0' for runs of blanks
+  char comment;   // '\0' for no comments
+  lua_Integer skip;
+  lua_Integer *slot_of; // column -> output vector, or -1 if unused
+  lua_Integer ncolumns; // length of slot_of
+  lua_Integer nout;
+} TextOptions;
+
+static inline bool _txt_is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool _txt_next_line(TextReader *r, char **start, char **end) {
+  // false on end of file or read error
+  for (;;) {
+    char *nl = memchr(r->buf + r->pos, '\n', r->len - r->pos);
+    if (nl != NULL) {
+      *start = r->buf + r->pos;
+      *end = nl;
+      r->pos = nl - r->buf + 1;
+      return true;
+    }
+    if (r->eof) {
+      if (r->pos == r->len) {
+        return false;
+      }
+      // last line has no trailing newline
+      *start = r->buf + r->pos;
+      *end = r->buf + r->len;
+      r->pos = r->len;
+      return true;
+    }
+
+    // move the partial line to the front and read another block after it
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    if (r->len == r->capacity) {
+      char *buf = realloc(r->buf, 2 * r->capacity + 1);
+      if (buf == NULL) {
+        r->failed = true;
+        return false;
+      }
+      r->buf = buf;
+      r->capacity *= 2;
+    }
+    size_t wanted = r->capacity - r->len;
+    size_t nread = fread(r->buf + r->len, 1, wanted, r->fp);
+    r->len += nread;
+    r->eof = nread < wanted;
+  }
+}
+
+static bool _txt_parse_number(char *start, char *end, lua_Number *out) {
+  while (start < end && _txt_is_blank(*start)) {
+    start++;
+  }
+  while (end > start && _txt_is_blank(end[-1])) {
+    end--;
+  }
+
+  // fast path: at most 19 significant digits and a small exponent, where
+  // the result of a single multiplication or division is correctly rounded
+  const char *s = start;
+  bool negative = false;
+  if (s < end && (*s == '-' || *s == '+')) {
+    negative = *s == '-';
+    s++;
+  }
+  uint64_t mantissa = 0;
+  int ndigits = 0, exp10 = 0;
+  bool any = false;
+  for (; s < end && (unsigned)(*s - '0') < 10; s++) {
+    mantissa = mantissa * 10 + (*s - '0');
+    ndigits += mantissa != 0;
+    any = true;
+  }
+  if (s < end && *s == '.') {
+    for (s++; s < end && (unsigned)(*s - '0') < 10; s++) {
+      mantissa = mantissa * 10 + (*s - '0');
+      ndigits += mantissa != 0;
+      exp10--;
+      any = true;
+    }
+  }
+  if (any && s < end && (*s == 'e' || *s == 'E')) {
+    s++;
+    bool negative_exp = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+      negative_exp = *s == '-';
+      s++;
+    }
+    int e = 0;
+    any = s < end;
+    for (; s < end && (unsigned)(*s - '0') < 10; s++) {
+      e = e < 10000 ? e * 10 + (*s - '0') : e;
+    }
+    exp10 += negative_exp ? -e : e;
+  }
+
+  if (any && s == end && ndigits <= 19 && mantissa <= (1ULL << 53) &&
+      -22 <= exp10 && exp10 <= 22) {
+    double x = (double)mantissa;
+    x = exp10 < 0 ? x / loadtxt_pow10[-exp10] : x * loadtxt_pow10[exp10];
+    *out = negative ? -x : x;
+    return true;
+  }
+
+  // slow path for long mantissas, huge exponents, inf and nan
+  if (start == end) {
+    return false;
+  }
+  char saved = *end;
+  char *parsed;
+  *end = '\0';
+  *out = strtod(start, &parsed);
+  *end = saved;
+  return parsed == end;
+}
+
+static inline char *
+_txt_field_end(const TextOptions *opts, char *p, char *end) {
+  if (opts->delimiter != '\0') {
+    char *d = memchr(p, opts->delimiter, end - p);
+    return d != NULL ? d : end;
+  }
+  while (p < end && !_txt_is_blank(*p)) {
+    p++;
+  }
+  return p;
+}
+
+static inline char *
+_txt_next_field(const TextOptions *opts, char *p, char *end) {
+  // p is the end of the previous field; NULL if there are no more fields
+  if (opts->delimiter != '\0') {
+    return p < end ? p + 1 : NULL;
+  }
+  while (p < end && _txt_is_blank(*p)) {
+    p++;
+  }
+  return p < end ? p : NULL;
+}
+
+static char *_txt_first_field(const TextOptions *opts, char *p, char *end) {
+  // NULL if the line is blank or a comment
+  char *first = p;
+  while (p < end && _txt_is_blank(*p)) {
+    p++;
+  }
+  if (p == end || (opts->comment != '\0' && *p == opts->comment)) {
+    return NULL;
+  }
+  return opts->delimiter != '\0' ? first : p;
+}
+
+static lua_Integer
+_txt_count_fields(const TextOptions *opts, char *p, char *end) {
+  lua_Integer n = 0;
+  while (p != NULL) {
+    n++;
+    p = _txt_next_field(opts, _txt_field_end(opts, p, end), end);
+  }
+  return n;
+}
+
+static inline bool _txt_append(Vector *v, lua_Number x) {
+  if (v->len == v->capacity) {
+    lua_Number *values = realloc(v->values, 2 * v->capacity * sizeof(x));
+    if (values == NULL) {
+      return false;
+    }
+    v->values = values;
+    v->capacity *= 2;
+  }
+  v->values[v->len++] = x;
+  return true;
+}
+
+static void _txt_check_options(lua_State *L, int idx, TextOptions *opts) {
+  opts->delimiter = '\0';
+  opts->comment = '#';
+  opts->skip = 0;
+  opts->slot_of = NULL;
+  opts->ncolumns = 0;
+  opts->nout = 0;
+  if (lua_isnoneornil(L, idx)) {
+    return;
+  }
+  luaL_checktype(L, idx, LUA_TTABLE);
+
+  lua_getfield(L, idx, "delimiter");
+  if (!lua_isnil(L, -1)) {
+    size_t len;
+    const char *delimiter = luaL_checklstring(L, -1, &len);
+    if (len != 1 || *delimiter == '\n') {
+      luaL_error(L, "Delimiter must be a single character");
+    }
+    opts->delimiter = *delimiter;
+  }
+  lua_getfield(L, idx, "comment");
+  if (!lua_isnil(L, -1)) {
+    size_t len;
+    const char *comment = luaL_checklstring(L, -1, &len);
+    if (len > 1) {
+      luaL_error(L, "Comment must be a single character or empty");
+    }
+    opts->comment = *comment;
+  }
+  lua_getfield(L, idx, "skip");
+  opts->skip = luaL_optinteger(L, -1, 0);
+  if (opts->skip < 0) {
+    luaL_error(L, "Number of lines to skip must be non-negative");
+  }
+  lua_pop(L, 3);
+
+  lua_getfield(L, idx, "columns");
+  if (!lua_isnil(L, -1)) {
+    luaL_checktype(L, -1, LUA_TTABLE);
+    opts->nout = luaL_len(L, -1);
+    if (opts->nout == 0) {
+      luaL_error(L, "At least one column must be selected");
+    }
+    for (lua_Integer k = 1; k <= opts->nout; k++) {
+      lua_rawgeti(L, -1, k);
+      lua_Integer col = luaL_checkinteger(L, -1);
+      lua_pop(L, 1);
+      if (col < 1) {
+        luaL_error(L, "Column numbers must be positive, got %d", col);
+      }
+      if (col > opts->ncolumns) {
+        opts->ncolumns = col;
+      }
+    }
+
+    // kept on the stack so the garbage collector frees it
+    opts->slot_of = newudata(L, opts->ncolumns * sizeof(*opts->slot_of));
+    for (lua_Integer col = 0; col < opts->ncolumns; col++) {
+      opts->slot_of[col] = -1;
+    }
+    for (lua_Integer k = 1; k <= opts->nout; k++) {
+      lua_rawgeti(L, -2, k);
+      lua_Integer col = lua_tointeger(L, -1) - 1;
+      lua_pop(L, 1);
+      if (opts->slot_of[col] >= 0) {
+        luaL_error(L, "Column %d is selected more than once", col + 1);
+      }
+      opts->slot_of[col] = k - 1;
+    }
+    lua_remove(L, -2);
+  } else {
+    lua_pop(L, 1);
+  }
+}
+
+static bool _txt_parse_line(
+  TextOptions *opts,
+  char *p,
+  char *end,
+  Vector **out,
+  lua_Integer lineno,
+  char *err) {
+  lua_Integer col = 0;
+  for (; p != NULL && col < opts->ncolumns; col++) {
+    char *field_end = _txt_field_end(opts, p, end);
+    lua_Integer slot = opts->slot_of != NULL ? opts->slot_of[col] : col;
+    lua_Number x;
+    if (slot >= 0) {
+      if (!_txt_parse_number(p, field_end, &x)) {
+        snprintf(
+          err,
+          LOADTXT_ERROR_SIZE,
+          "Invalid number in line %lld, column %lld",
+          (long long)lineno,
+          (long long)col + 1);
+        return false;
+      }
+      if (!_txt_append(out[slot], x)) {
+        snprintf(err, LOADTXT_ERROR_SIZE, "Could not allocate memory");
+        return false;
+      }
+    }
+    p = _txt_next_field(opts, field_end, end);
+  }
+
+  if (col < opts->ncolumns || (opts->slot_of == NULL && p != NULL)) {
+    snprintf(
+      err,
+      LOADTXT_ERROR_SIZE,
+      "Line %lld has %lld columns, expected %s%lld",
+      (long long)lineno,
+      (long long)(col + (p != NULL ? _txt_count_fields(opts, p, end) : 0)),
+      opts->slot_of != NULL ? "at least " : "",
+      (long long)opts->ncolumns);
+    return false;
+  }
+  return true;
+}
+
+int vec_loadtxt(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  TextOptions opts;
+  _txt_check_options(L, 2, &opts);
+
+  TextReader *r = newudata(L, sizeof(*r));
+  r->fp = NULL;
+  r->buf = NULL;
+  r->capacity = LOADTXT_BLOCK_SIZE;
+  r->len = 0;
+  r->pos = 0;
+  r->eof = false;
+  r->failed = false;
+  setmetatable(L, text_reader_mt_name);
+  int first_out = lua_gettop(L) + 1;
+
+  r->buf = malloc(LOADTXT_BLOCK_SIZE + 1);
+  if (r->buf == NULL) {
+    return luaL_error(L, "Could not allocate read buffer");
+  }
+  r->fp = fopen(filename, "rb");
+  if (r->fp == NULL) {
+    return luaL_error(L, "Could not open file %s for reading.", filename);
+  }
+
+  char err[LOADTXT_ERROR_SIZE] = "";
+  Vector *stackout[16];
+  Vector **out = NULL;
+  lua_Integer lineno = 0;
+  char *start, *end;
+  while (err[0] == '\0' && _txt_next_line(r, &start, &end)) {
+    lineno++;
+    char *p = _txt_first_field(&opts, start, end);
+    if (lineno <= opts.skip || p == NULL) {
+      continue;
+    }
+
+    if (out == NULL) {
+      // the first data line decides the number of columns
+      if (opts.slot_of == NULL) {
+        opts.ncolumns = _txt_count_fields(&opts, p, end);
+        opts.nout = opts.ncolumns;
+      }
+      luaL_checkstack(L, (int)opts.nout, "too many columns");
+      out = opts.nout <= 16 ? stackout : newudata(L, opts.nout * sizeof(*out));
+      for (lua_Integer k = 0; k < opts.nout; k++) {
+        out[k] = _vec_push_alloc(L, 0, 1024);
+      }
+    }
+    _txt_parse_line(&opts, p, end, out, lineno, err);
+  }
+
+  if (err[0] == '\0' && r->failed) {
+    snprintf(err, LOADTXT_ERROR_SIZE, "Could not allocate memory");
+  } else if (err[0] == '\0' && ferror(r->fp)) {
+    snprintf(
+      err,
+      LOADTXT_ERROR_SIZE,
+      "Could not read file %s.\nerrno: %d\n%s",
+      filename,
+      errno,
+      strerror(errno));
+  }
+  _txt_close(r);
+  if (err[0] != '\0') {
+    return luaL_error(L, "%s", err);
+  }
+
+  if (out == NULL) {
+    // no data at all
+    lua_Integer nout = opts.nout > 0 ? opts.nout : 1;
+    luaL_checkstack(L, (int)nout, "too many columns");
+    for (lua_Integer k = 0; k < nout; k++) {
+      _vec_push_alloc(L, 0, 0);
+    }
+    return (int)nout;
+  }
+  if (opts.nout > 16) {
+    // the udata holding the vector pointers sits before the vectors
+    lua_remove(L, first_out);
+  }
+  return (int)opts.nout;
+}
+
+int vec_reset(lua_State *L) {
+  Vector *self = _vec_check_out(L, 1);
+  memset(self->values, 0, self->len * sizeof(lua_Number));
+  lua_settop(L, 1);
+  return 1;
+}
+
+int vec_dup(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *new = _vec_push_new(L, self->len);
+  memcpy(new->values, self->values, self->len * sizeof(lua_Number));
+  return 1;
 }
 
 int vec_dup_into(lua_State *L) {
   Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *new = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *new = _vec_check_out(L, 2);
   _vec_check_same_len(L, self, new);
 
   memcpy(new->values, self->values, self->len * sizeof(lua_Number));
@@ -306,6 +1408,255 @@ int vec_dup_into(lua_State *L) {
   return 1;
 }
 
+// largest capacity whose size in bytes can't overflow
+#define VEC_MAX_CAPACITY ((lua_Integer)(PTRDIFF_MAX / sizeof(lua_Number)))
+
+static inline void
+_vec_realloc(lua_State *L, Vector *v, lua_Integer capacity) {
+  if (v->storage != VEC_STORAGE_OWNED) {
+    luaL_error(L, "Cannot resize a vector which does not own its memory");
+  } else if (capacity > VEC_MAX_CAPACITY) {
+    luaL_error(L, "Vector capacity %d is too large", capacity);
+  }
+  lua_Number *values =
+    realloc(v->values, (capacity > 0 ? capacity : 1) * sizeof(*values));
+  if (values == NULL) {
+    luaL_error(L, "Could not resize vector to capacity %d", capacity);
+  }
+  v->values = values;
+  v->capacity = capacity;
+}
+
+static inline void _vec_reserve(lua_State *L, Vector *v, lua_Integer needed) {
+  if (needed <= v->capacity) {
+    return;
+  } else if (needed > VEC_MAX_CAPACITY) {
+    luaL_error(L, "Vector capacity %d is too large", needed);
+  }
+
+  // geometric growth keeps appending amortized O(1)
+  lua_Integer capacity = v->capacity > 0 ? v->capacity : 1;
+  while (capacity < needed) {
+    capacity =
+      capacity > VEC_MAX_CAPACITY / 2 ? VEC_MAX_CAPACITY : 2 * capacity;
+  }
+  _vec_realloc(L, v, capacity);
+}
+
+int vec_seq(lua_State *L) {
+  lua_Integer capacity = luaL_optinteger(L, 1, 8);
+  if (capacity < 0) {
+    return luaL_error(
+      L, "Expected non-negative integer for capacity, got %d", capacity);
+  }
+  lua_settop(L, 0);
+  _vec_push_alloc(L, 0, capacity);
+  return 1;
+}
+
+int vec_push(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  int nargs = lua_gettop(L) - 1;
+  for (int i = 2; i <= nargs + 1; i++) {
+    luaL_checknumber(L, i);
+  }
+
+  _vec_reserve(L, self, self->len + nargs);
+  for (int i = 2; i <= nargs + 1; i++) {
+    self->values[self->len++] = lua_tonumber(L, i);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+int vec_extend(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *other = luaL_checkudata(L, 2, vector_mt_name);
+  lua_Integer n = other->len;
+
+  // other may be self, so only read its values after reallocating
+  _vec_reserve(L, self, self->len + n);
+  memcpy(self->values + self->len, other->values, n * sizeof(lua_Number));
+  self->len += n;
+  lua_settop(L, 1);
+  return 1;
+}
+
+int vec_reserve(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Integer capacity = luaL_checkinteger(L, 2);
+  if (capacity > self->capacity) {
+    _vec_realloc(L, self, capacity);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+int vec_shrink_to_fit(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  if (self->capacity > self->len) {
+    _vec_realloc(L, self, self->len);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+int vec_capacity(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_pushinteger(L, self->capacity);
+  return 1;
+}
+
+// memory of vectors shared between lua_States, freed by the last one
+typedef struct SharedBuffer {
+  int64_t refcount;
+  lua_Integer len;
+  lua_Number values[];
+} SharedBuffer;
+
+// one reference to a shared buffer, in transit to another lua_State
+typedef struct ShareHandle {
+  uintptr_t id;
+  SharedBuffer *buf;
+  bool readonly;
+} ShareHandle;
+
+// Handles given to Lua are ids into this process-wide table rather than
+// pointers, so a stale, foreign or NULL light userdata is never dereferenced,
+// and each handle can be claimed only once even by concurrent lua_States.
+static struct {
+  int64_t lock;
+  uintptr_t next_id;
+  ShareHandle *pending;
+  size_t len;
+  size_t capacity;
+} share_handles = {0, 1, NULL, 0, 0};
+
+static inline void _share_handles_lock(void) {
+  while (atomic_xchg64(&share_handles.lock, 1) != 0) {
+    while (atomic_load64(&share_handles.lock) != 0) {
+    }
+  }
+}
+
+static inline void _share_handles_unlock(void) {
+  atomic_xchg64(&share_handles.lock, 0);
+}
+
+static inline SharedBuffer *_vec_shared_buffer(const Vector *v) {
+  return (SharedBuffer *)((char *)v->values - offsetof(SharedBuffer, values));
+}
+
+static inline void _vec_release_shared(SharedBuffer *buf) {
+  if (atomic_add64(&buf->refcount, -1) == 0) {
+    free(buf);
+  }
+}
+
+static void _vec_make_shared(lua_State *L, Vector *v) {
+  // move the values of an owned vector into a shared buffer
+  SharedBuffer *buf = malloc(sizeof(*buf) + v->len * sizeof(lua_Number));
+  if (buf == NULL) {
+    luaL_error(L, "Could not allocate shared buffer");
+  }
+  buf->refcount = 1;
+  buf->len = v->len;
+  memcpy(buf->values, v->values, v->len * sizeof(lua_Number));
+
+  free(v->values);
+  v->values = buf->values;
+  v->capacity = v->len;
+  v->storage = VEC_STORAGE_SHARED;
+}
+
+int vec_share(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  bool readonly = lua_toboolean(L, 2);
+  if (self->storage == VEC_STORAGE_VIEW) {
+    return luaL_error(L, "Cannot share a vector which does not own its memory");
+  } else if (self->storage == VEC_STORAGE_READONLY && !readonly) {
+    return luaL_error(L, "Cannot share a read-only vector as writable");
+  } else if (self->storage == VEC_STORAGE_OWNED) {
+    _vec_make_shared(L, self);
+  }
+
+  _share_handles_lock();
+  if (share_handles.len == share_handles.capacity) {
+    size_t capacity =
+      share_handles.capacity == 0 ? 8 : 2 * share_handles.capacity;
+    ShareHandle *pending =
+      realloc(share_handles.pending, capacity * sizeof(*pending));
+    if (pending == NULL) {
+      _share_handles_unlock();
+      return luaL_error(L, "Could not allocate share handle");
+    }
+    share_handles.pending = pending;
+    share_handles.capacity = capacity;
+  }
+  ShareHandle *handle = &share_handles.pending[share_handles.len++];
+  handle->id = share_handles.next_id++;
+  if (share_handles.next_id == 0) {
+    share_handles.next_id = 1;
+  }
+  handle->buf = _vec_shared_buffer(self);
+  handle->readonly = readonly;
+  atomic_add64(&handle->buf->refcount, 1);
+  uintptr_t id = handle->id;
+  _share_handles_unlock();
+
+  lua_pushlightuserdata(L, (void *)id);
+  return 1;
+}
+
+// remove the handle at idx from the pending table and return it
+static ShareHandle _vec_claim_share_handle(lua_State *L, int idx) {
+  luaL_checktype(L, idx, LUA_TLIGHTUSERDATA);
+  uintptr_t id = (uintptr_t)lua_touserdata(L, idx);
+  ShareHandle handle = {0, NULL, false};
+
+  _share_handles_lock();
+  for (size_t i = 0; i < share_handles.len; i++) {
+    if (share_handles.pending[i].id == id) {
+      handle = share_handles.pending[i];
+      share_handles.pending[i] = share_handles.pending[--share_handles.len];
+      break;
+    }
+  }
+  _share_handles_unlock();
+
+  if (handle.buf == NULL) {
+    luaL_error(L, "Invalid or already used share handle");
+  }
+  return handle;
+}
+
+int vec_adopt(lua_State *L) {
+  // allocate first, so that no error can leak the claimed reference
+  Vector *v = newudata(L, sizeof(*v));
+  ShareHandle handle = _vec_claim_share_handle(L, 1);
+
+  // the vector takes over the reference held by the handle
+  v->values = handle.buf->values;
+  v->len = handle.buf->len;
+  v->capacity = v->len;
+  v->storage = handle.readonly ? VEC_STORAGE_READONLY : VEC_STORAGE_SHARED;
+  setmetatable(L, vector_mt_name);
+  return 1;
+}
+
+int vec_release(lua_State *L) {
+  ShareHandle handle = _vec_claim_share_handle(L, 1);
+  _vec_release_shared(handle.buf);
+  return 0;
+}
+
+
+int vec_readonly(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_pushboolean(L, self->storage == VEC_STORAGE_READONLY);
+  return 1;
+}
+
 int vec_at(lua_State *L) {
   Vector *v = luaL_checkudata(L, 1, vector_mt_name);
   lua_Integer idx = lua_tointeger(L, 2) - 1;
@@ -354,11 +1705,11 @@ int vec_normalize_into(lua_State *L) {
   Vector *out;
 
   if (lua_gettop(L) > 1) {
-    out = luaL_checkudata(L, 2, vector_mt_name);
+    out = _vec_check_out(L, 2);
     _vec_check_same_len(L, self, out);
     lua_settop(L, 2);
   } else {
-    out = self;
+    out = _vec_check_writable(L, self);
   }
 
   for (lua_Integer i = 0; i < self->len; i++) {
@@ -400,492 +1751,5248 @@ int vec_trapz(lua_State *L) {
   return 1;
 }
 
-int vec__index(lua_State *L) {
-  if (lua_isinteger(L, 2)) {
-    // integer indexing
-    return vec_at(L);
-  } else {
-    // anything else falls back to the lib
-    lua_pushvalue(L, 2);
-    lua_rawget(L, lua_upvalueindex(1));
-    return 1;
+#define def_vec_scan(name, combine)                                            \
+  static inline void _vec_##name##_scan(const Vector *self, Vector *out) {     \
+    if (self->len == 0) {                                                      \
+      return;                                                                  \
+    }                                                                          \
+    lua_Number acc = self->values[0];                                          \
+    out->values[0] = acc;                                                      \
+    for (lua_Integer i = 1; i < self->len; i++) {                              \
+      lua_Number x = self->values[i];                                          \
+      acc = (combine);                                                         \
+      out->values[i] = acc;                                                    \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  int vec_##name##_into(lua_State *L) {                                        \
+    Vector *self = luaL_checkudata(L, 1, vector_mt_name);                      \
+    Vector *out;                                                               \
+    if (lua_gettop(L) > 1) {                                                   \
+      out = _vec_check_out(L, 2);                                              \
+      _vec_check_same_len(L, self, out);                                       \
+      lua_settop(L, 2);                                                        \
+    } else {                                                                   \
+      out = _vec_check_writable(L, self);                                      \
+    }                                                                          \
+    _vec_##name##_scan(self, out);                                             \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  int vec_##name(lua_State *L) {                                               \
+    Vector *self = luaL_checkudata(L, 1, vector_mt_name);                      \
+    Vector *out = _vec_push_new(L, self->len);                                 \
+    _vec_##name##_scan(self, out);                                             \
+    return 1;                                                                  \
   }
-}
 
-int vec__newindex(lua_State *L) {
-  Vector *v = luaL_checkudata(L, 1, vector_mt_name);
-  lua_Integer idx = luaL_checkinteger(L, 2) - 1;
-  _vec_check_oob(L, idx, v->len);
+def_vec_scan(cumsum, acc + x);
+def_vec_scan(cumprod, acc * x);
+def_vec_scan(cummax, (x > acc || x != x) ? x : acc);
+def_vec_scan(cummin, (x < acc || x != x) ? x : acc);
 
-  v->values[idx] = luaL_checknumber(L, 3);
-  return 0;
+static inline void _vec_cumtrapz_into(
+  lua_State *L, const Vector *y, const Vector *x, Vector *out) {
+  _vec_check_same_len(L, y, x);
+  _vec_check_same_len(L, y, out);
+  if (y->len == 0) {
+    return;
+  }
+
+  // out may alias y or x, so keep the previous inputs around
+  lua_Number total = 0;
+  lua_Number prev_y = y->values[0];
+  lua_Number prev_x = x->values[0];
+  out->values[0] = 0;
+  for (lua_Integer i = 1; i < y->len; i++) {
+    lua_Number cur_y = y->values[i];
+    lua_Number cur_x = x->values[i];
+    total += ((cur_y + prev_y) * (cur_x - prev_x)) / 2;
+    out->values[i] = total;
+    prev_y = cur_y;
+    prev_x = cur_x;
+  }
 }
 
-int vec__tostring(lua_State *L) {
-  Vector *v = luaL_checkudata(L, 1, vector_mt_name);
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
+int vec_cumtrapz_into(lua_State *L) {
+  Vector *y = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *x = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *out;
 
-  luaL_addstring(&b, "[");
-  for (lua_Integer i = 0; i < v->len; i++) {
-    lua_pushnumber(L, v->values[i]);
-    luaL_addvalue(&b);
-    if (i < v->len - 1) {
-      luaL_addstring(&b, ", ");
-    } else {
-      luaL_addstring(&b, "]");
-    }
+  if (lua_gettop(L) > 2) {
+    out = _vec_check_out(L, 3);
+    lua_settop(L, 3);
+  } else {
+    out = _vec_check_writable(L, y);
+    lua_pushvalue(L, 1);
   }
-  luaL_pushresult(&b);
+
+  _vec_cumtrapz_into(L, y, x, out);
   return 1;
 }
 
-int vec__len(lua_State *L) {
-  Vector *v = luaL_checkudata(L, 1, vector_mt_name);
-  lua_pushinteger(L, v->len);
+int vec_cumtrapz(lua_State *L) {
+  Vector *y = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *x = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *new = _vec_push_new(L, y->len);
+  _vec_cumtrapz_into(L, y, x, new);
   return 1;
 }
 
-static inline void _vec_broadcast_add_into(
-  lua_State *L, Vector *v, lua_Number scalar, Vector *out) {
-  _vec_check_same_len(L, v, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = v->values[i] + scalar;
-  }
+static inline lua_Number _vec_simpson_pair(
+  lua_Number h0, lua_Number h1, lua_Number y0, lua_Number y1, lua_Number y2) {
+  // integral over [x0, x2] of the parabola through the three points, which
+  // is the usual (h/3)(y0 + 4y1 + y2) when h0 == h1
+  lua_Number h = h0 + h1;
+  return h / 6 *
+         ((2 - h1 / h0) * y0 + h * h / (h0 * h1) * y1 + (2 - h0 / h1) * y2);
 }
 
-static inline void _vec_broadcast_rev_sub_into(
-  lua_State *L, lua_Number scalar, Vector *v, Vector *out) {
-  _vec_check_same_len(L, v, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = scalar - v->values[i];
+int vec_simpson(lua_State *L) {
+  Vector *y = luaL_checkudata(L, 1, vector_mt_name);
+  const lua_Number *x = NULL;
+  lua_Number dx = 1;
+  if (lua_isnumber(L, 2)) {
+    dx = lua_tonumber(L, 2);
+  } else if (!lua_isnoneornil(L, 2)) {
+    Vector *xv = luaL_checkudata(L, 2, vector_mt_name);
+    _vec_check_same_len(L, y, xv);
+    x = xv->values;
   }
-}
 
-static inline void _vec_broadcast_pow_rev_into(
-  lua_State *L, lua_Number base, const Vector *v, Vector *out) {
-  _vec_check_same_len(L, v, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = pow(base, v->values[i]);
+  const lua_Number *v = y->values;
+  lua_Integer n = y->len;
+  lua_Number total = 0;
+#define SIMPSON_H(i) (x != NULL ? x[(i) + 1] - x[(i)] : dx)
+  if (n == 2) {
+    total = (v[0] + v[1]) * SIMPSON_H(0) / 2;
+  }
+  for (lua_Integer i = 0; i + 2 < n; i += 2) {
+    total += _vec_simpson_pair(
+      SIMPSON_H(i), SIMPSON_H(i + 1), v[i], v[i + 1], v[i + 2]);
   }
+  if (n > 2 && n % 2 == 0) {
+    // odd number of intervals: the last one gets the integral of the
+    // parabola through the last three points over it
+    lua_Number h0 = SIMPSON_H(n - 3), h1 = SIMPSON_H(n - 2);
+    lua_Number alpha = (2 * h1 * h1 + 3 * h0 * h1) / (6 * (h0 + h1));
+    lua_Number beta = (h1 * h1 + 3 * h0 * h1) / (6 * h0);
+    lua_Number eta = h1 * h1 * h1 / (6 * h0 * (h0 + h1));
+    total += alpha * v[n - 1] + beta * v[n - 2] - eta * v[n - 3];
+  }
+#undef SIMPSON_H
+
+  lua_pushnumber(L, total);
+  return 1;
 }
 
-static inline void _vec_broadcast_pow_into(
-  lua_State *L, const Vector *v, lua_Number e, Vector *out) {
-  _vec_check_same_len(L, v, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = pow(v->values[i], e);
+int vec_romb(lua_State *L) {
+  Vector *y = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number dx = luaL_optnumber(L, 2, 1);
+  lua_Integer intervals = y->len - 1;
+  if (intervals < 0 || (intervals & (intervals - 1)) != 0) {
+    return luaL_error(
+      L, "Expected 2^k + 1 samples for Romberg integration, got %d", y->len);
+  } else if (intervals == 0) {
+    lua_pushnumber(L, 0);
+    return 1;
+  }
+
+  // prev and row are consecutive rows of the Romberg table, one per halving
+  // of the step, extrapolated as far as the samples allow
+  lua_Number prev[64], row[64];
+  const lua_Number *v = y->values;
+  prev[0] = (v[0] + v[intervals]) * intervals * dx / 2;
+  int k = 0;
+  for (lua_Integer step = intervals / 2; step > 0; step /= 2) {
+    lua_Number sum = 0;
+    for (lua_Integer i = step; i < intervals; i += 2 * step) {
+      sum += v[i];
+    }
+    k++;
+    row[0] = prev[0] / 2 + sum * step * dx;
+    lua_Number factor = 1;
+    for (int j = 1; j <= k; j++) {
+      factor *= 4;
+      row[j] = row[j - 1] + (row[j - 1] - prev[j - 1]) / (factor - 1);
+    }
+    memcpy(prev, row, (k + 1) * sizeof(*row));
   }
+
+  lua_pushnumber(L, prev[k]);
+  return 1;
 }
 
-static inline void
-_vec_pow_into(lua_State *L, const Vector *b, const Vector *e, Vector *out) {
-  _vec_check_same_len(L, b, e);
-  _vec_check_same_len(L, b, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = pow(b->values[i], e->values[i]);
+#define QUAD_NODES 15
+#define QUAD_DEFAULT_TOL 1.49e-8
+#define QUAD_DEFAULT_LIMIT 1000
+
+// Gauss-Kronrod abscissas on [-1, 1] (only the non-negative ones, the last
+// being the center), and the weights of the 15-point Kronrod rule and of the
+// 7-point Gauss rule embedded in it
+static const lua_Number quad_xgk[8] = {
+  0.991455371120812639206854697526329,
+  0.949107912342758524526189684047851,
+  0.864864423359769072789712788640926,
+  0.741531185599394439863864773280788,
+  0.586087235467691130294144845693013,
+  0.405845151377397166906606412076961,
+  0.207784955007898467600689403773245,
+  0.000000000000000000000000000000000,
+};
+static const lua_Number quad_wgk[8] = {
+  0.022935322010529224963732008058970,
+  0.063092092629978553290700663189204,
+  0.104790010322250183839876322541518,
+  0.140653259715525918745189590510238,
+  0.169004726639267902826583426598550,
+  0.190350578064785409913256402421014,
+  0.204432940075298892414161999234649,
+  0.209482141084727828012999174891714,
+};
+static const lua_Number quad_wg[4] = {
+  0.129484966168869693270611432679082,
+  0.279705391489276667901467771423780,
+  0.381830050505118944950369775488975,
+  0.417959183673469387755102040816327,
+};
+
+typedef struct QuadInterval {
+  lua_Number a, b;
+  lua_Number result, err;
+  bool split;
+} QuadInterval;
+
+static void _quad_nodes(const QuadInterval *iv, lua_Number *x) {
+  lua_Number center = (iv->a + iv->b) / 2, half = (iv->b - iv->a) / 2;
+  x[0] = center;
+  for (int j = 0; j < 7; j++) {
+    x[1 + 2 * j] = center - half * quad_xgk[j];
+    x[2 + 2 * j] = center + half * quad_xgk[j];
   }
 }
 
-static inline void _vec_xpsy_into(
-  lua_State *L, const Vector *x, lua_Number s, const Vector *y, Vector *out) {
-  _vec_check_same_len(L, x, y);
-  _vec_check_same_len(L, x, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = x->values[i] + s * y->values[i];
+static void _quad_estimate(QuadInterval *iv, const lua_Number *f) {
+  // the 15-point Kronrod estimate, with the error scaled as in QUADPACK's
+  // qk15 from its difference to the 7-point Gauss estimate
+  lua_Number half = (iv->b - iv->a) / 2;
+  lua_Number resk = f[0] * quad_wgk[7];
+  lua_Number resg = f[0] * quad_wg[3];
+  lua_Number resabs = fabs(resk);
+  for (int j = 0; j < 7; j++) {
+    lua_Number pair = f[1 + 2 * j] + f[2 + 2 * j];
+    resk += quad_wgk[j] * pair;
+    resabs += quad_wgk[j] * (fabs(f[1 + 2 * j]) + fabs(f[2 + 2 * j]));
+    if (j % 2 == 1) {
+      resg += quad_wg[j / 2] * pair;
+    }
+  }
+  lua_Number mean = resk / 2;
+  lua_Number resasc = quad_wgk[7] * fabs(f[0] - mean);
+  for (int j = 0; j < 7; j++) {
+    resasc +=
+      quad_wgk[j] * (fabs(f[1 + 2 * j] - mean) + fabs(f[2 + 2 * j] - mean));
+  }
+
+  lua_Number err = fabs((resk - resg) * half);
+  resasc *= fabs(half);
+  resabs *= fabs(half);
+  if (resasc != 0 && err != 0) {
+    lua_Number scale = pow(200 * err / resasc, 1.5);
+    err = resasc * (scale < 1 ? scale : 1);
   }
+  if (resabs > DBL_MIN / (50 * DBL_EPSILON) &&
+      err < 50 * DBL_EPSILON * resabs) {
+    err = 50 * DBL_EPSILON * resabs;
+  }
+  iv->result = resk * half;
+  iv->err = err;
 }
 
-static inline void _vec_hadamard_product_into(
-  lua_State *L, const Vector *x, const Vector *y, Vector *out) {
-  _vec_check_same_len(L, x, y);
-  _vec_check_same_len(L, x, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = x->values[i] * y->values[i];
+static int _quad_cmp_err(const void *a, const void *b) {
+  const QuadInterval *x = a, *y = b;
+  return (x->err < y->err) - (x->err > y->err);
+}
+
+static void _quad_eval(
+  lua_State *L, QuadInterval *intervals, lua_Integer first, lua_Integer count) {
+  // expects the integrand at stack index 1; evaluates it once on the nodes of
+  // every interval in [first, first + count)
+  lua_pushvalue(L, 1);
+  Vector *x = _vec_push_new(L, count * QUAD_NODES);
+  for (lua_Integer i = 0; i < count; i++) {
+    _quad_nodes(&intervals[first + i], x->values + i * QUAD_NODES);
+  }
+  lua_call(L, 1, 1);
+
+  Vector *f = testudata(L, -1, vector_mt_name);
+  if (f == NULL || f->len != count * QUAD_NODES) {
+    luaL_error(
+      L, "Integrand must return a vector of %d values", count * QUAD_NODES);
+  }
+  for (lua_Integer i = 0; i < count; i++) {
+    _quad_estimate(&intervals[first + i], f->values + i * QUAD_NODES);
   }
+  lua_pop(L, 1);
 }
 
-static inline void
-_vec_scale_into(lua_State *L, const Vector *v, lua_Number s, Vector *out) {
-  _vec_check_same_len(L, v, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = v->values[i] * s;
+int vec_quad(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  lua_Number a = luaL_checknumber(L, 2);
+  lua_Number b = luaL_checknumber(L, 3);
+  lua_Number epsabs = QUAD_DEFAULT_TOL, epsrel = QUAD_DEFAULT_TOL;
+  lua_Integer limit = QUAD_DEFAULT_LIMIT;
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_getfield(L, 4, "epsabs");
+    epsabs = luaL_optnumber(L, -1, epsabs);
+    lua_getfield(L, 4, "epsrel");
+    epsrel = luaL_optnumber(L, -1, epsrel);
+    lua_getfield(L, 4, "limit");
+    limit = luaL_optinteger(L, -1, limit);
+  }
+  lua_settop(L, 3);
+  if (!isfinite(a) || !isfinite(b)) {
+    return luaL_error(L, "Integration bounds must be finite");
+  } else if (limit < 1) {
+    return luaL_error(L, "Expected positive interval limit, got %d", limit);
+  }
+
+  // intervals are rebuilt into the other half of the buffer every round
+  QuadInterval *cur = newudata(L, 2 * limit * sizeof(*cur));
+  QuadInterval *next = cur + limit;
+  cur[0].a = a;
+  cur[0].b = b;
+  lua_Integer count = 1, pending = 1, neval = 0;
+  lua_Number total, err;
+
+  // every round evaluates all the intervals created by the previous one in a
+  // single call to f, then bisects each interval whose error is larger than
+  // its share of the tolerance, largest errors first
+  for (;;) {
+    _quad_eval(L, cur, count - pending, pending);
+    neval += pending * QUAD_NODES;
+
+    total = 0;
+    err = 0;
+    for (lua_Integer i = 0; i < count; i++) {
+      total += cur[i].result;
+      err += cur[i].err;
+    }
+    lua_Number tol = fmax(epsabs, epsrel * fabs(total));
+    if (err <= tol) {
+      break;
+    }
+
+    qsort(cur, count, sizeof(*cur), &_quad_cmp_err);
+    lua_Integer nsplit = 0;
+    for (lua_Integer i = 0; i < count; i++) {
+      QuadInterval *iv = &cur[i];
+      lua_Number mid = (iv->a + iv->b) / 2;
+      iv->split = count + nsplit < limit && mid != iv->a && mid != iv->b &&
+                  iv->err > tol * fabs((iv->b - iv->a) / (b - a));
+      nsplit += iv->split;
+    }
+    if (nsplit == 0) {
+      break;
+    }
+
+    lua_Integer n = 0;
+    for (lua_Integer i = 0; i < count; i++) {
+      if (!cur[i].split) {
+        next[n++] = cur[i];
+      }
+    }
+    for (lua_Integer i = 0; i < count; i++) {
+      if (cur[i].split) {
+        lua_Number mid = (cur[i].a + cur[i].b) / 2;
+        next[n] = cur[i];
+        next[n++].b = mid;
+        next[n] = cur[i];
+        next[n++].a = mid;
+      }
+    }
+    QuadInterval *tmp = cur;
+    cur = next;
+    next = tmp;
+    count = n;
+    pending = 2 * nsplit;
   }
+
+  lua_pushnumber(L, total);
+  lua_pushnumber(L, err);
+  lua_pushinteger(L, neval);
+  return 3;
 }
 
-static inline void _vec_scale_reciproc_into(
-  lua_State *L, const Vector *v, lua_Number s, Vector *out) {
-  _vec_check_same_len(L, v, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = v->values[i] / s;
+static inline Vector *
+_vec_check_shrunk_out(lua_State *L, Vector *self, int idx, lua_Integer len) {
+  // functions whose result is shorter than their input either write into an
+  // output vector of the right length, or shrink self
+  if (lua_gettop(L) >= idx) {
+    Vector *out = _vec_check_out(L, idx);
+    if (out->len != len) {
+      luaL_error(
+        L, "Output vector must have length %d, got %d", len, out->len);
+    }
+    lua_settop(L, idx);
+    return out;
+  } else {
+    lua_settop(L, 1);
+    return _vec_check_writable(L, self);
   }
 }
 
-static inline void _vec_elmwise_div_into(
-  lua_State *L, const Vector *x, const Vector *y, Vector *out) {
-  _vec_check_same_len(L, x, y);
-  _vec_check_same_len(L, x, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = x->values[i] / y->values[i];
+static inline void _vec_diff_into(
+  lua_State *L, const Vector *self, lua_Integer n, Vector *out) {
+  lua_Integer len = self->len;
+  lua_Number *work = out->values;
+
+  if (n == 0) {
+    if (out != self) {
+      memcpy(out->values, self->values, len * sizeof(lua_Number));
+    }
+    return;
+  }
+
+  // intermediate differences need one element less than the input, which
+  // does not fit in a separate output vector of the final length
+  if (out != self && n > 1) {
+    work = malloc((len - 1) * sizeof(*work));
+    if (work == NULL) {
+      luaL_error(L, "Could not allocate temporary buffer");
+    }
+  }
+
+  for (lua_Integer i = 0; i < len - 1; i++) {
+    work[i] = self->values[i + 1] - self->values[i];
+  }
+  for (lua_Integer k = 2; k <= n; k++) {
+    for (lua_Integer i = 0; i < len - k; i++) {
+      work[i] = work[i + 1] - work[i];
+    }
+  }
+
+  if (work != out->values) {
+    memcpy(out->values, work, (len - n) * sizeof(lua_Number));
+    free(work);
+  }
+  if (out == self) {
+    out->len = len - n;
   }
 }
 
-static inline void _vec_elmwise_div_scalar_into(
-  lua_State *L, lua_Number scalar, const Vector *x, Vector *out) {
-  _vec_check_same_len(L, x, out);
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = scalar / x->values[i];
+static inline lua_Integer
+_vec_diff_order(lua_State *L, const Vector *self, int idx) {
+  lua_Integer n = lua_isnumber(L, idx) ? lua_tointeger(L, idx) : 1;
+  if (n < 0) {
+    luaL_error(L, "Expected non-negative difference order, got %d", n);
   }
+  return n < self->len ? n : self->len;
 }
 
-int vec_psy_into(lua_State *L) {
+int vec_diff_into(lua_State *L) {
   Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  lua_Number scalar = luaL_checknumber(L, 2);
-  Vector *other = luaL_checkudata(L, 3, vector_mt_name);
-  Vector *out;
-
-  if (lua_gettop(L) > 3) {
-    out = luaL_checkudata(L, 4, vector_mt_name);
-    _vec_check_same_len(L, self, out);
-    lua_settop(L, 4);
-  } else {
-    out = self;
-    lua_pushvalue(L, 1);
+  lua_Integer n = _vec_diff_order(L, self, 2);
+  if (lua_isnumber(L, 2)) {
+    lua_remove(L, 2);
   }
-  _vec_xpsy_into(L, self, scalar, other, out);
+  Vector *out = _vec_check_shrunk_out(L, self, 2, self->len - n);
+  _vec_diff_into(L, self, n, out);
   return 1;
 }
 
-int vec_psy(lua_State *L) {
+int vec_diff(lua_State *L) {
   Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  lua_Number scalar = luaL_checknumber(L, 2);
-  Vector *other = luaL_checkudata(L, 3, vector_mt_name);
-  Vector *new = _vec_push_new(L, self->len);
-  _vec_xpsy_into(L, self, scalar, other, new);
+  lua_Integer n = _vec_diff_order(L, self, 2);
+  Vector *new = _vec_push_new(L, self->len - n);
+  _vec_diff_into(L, self, n, new);
   return 1;
 }
 
-int vec_hadamard_product_into(lua_State *L) {
-  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *other = luaL_checkudata(L, 2, vector_mt_name);
-  Vector *out;
+static inline void
+_vec_moving_average_into(const Vector *self, lua_Integer w, Vector *out) {
+  lua_Integer outlen = self->len - w + 1;
+  lua_Number sum = 0, comp = 0;
+  for (lua_Integer i = 0; i < w - 1; i++) {
+    sum += self->values[i];
+  }
 
-  if (lua_gettop(L) > 2) {
-    out = luaL_checkudata(L, 3, vector_mt_name);
-    _vec_check_same_len(L, self, out);
-    lua_settop(L, 3);
-  } else {
-    out = self;
-    lua_pushvalue(L, 1);
+  // running sum with Kahan compensation, so that the error from adding and
+  // removing elements does not grow with the length of the vector.
+  // out may be self: the element leaving the window is saved before its
+  // slot is overwritten
+  lua_Number leaving = 0;
+  for (lua_Integer i = 0; i < outlen; i++) {
+    lua_Number delta = (self->values[i + w - 1] - leaving) - comp;
+    lua_Number t = sum + delta;
+    comp = (t - sum) - delta;
+    sum = t;
+
+    leaving = self->values[i];
+    out->values[i] = sum / w;
+  }
+  if (out == self) {
+    out->len = outlen;
   }
+}
 
-  _vec_hadamard_product_into(L, self, other, out);
+static inline lua_Integer
+_vec_check_window(lua_State *L, const Vector *self, lua_Integer w) {
+  if (w <= 0 || w > self->len) {
+    luaL_error(
+      L, "Window size must be between 1 and %d, got %d", self->len, w);
+  }
+  return w;
+}
+
+int vec_moving_average_into(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Integer w = _vec_check_window(L, self, luaL_checkinteger(L, 2));
+  lua_remove(L, 2);
+  Vector *out = _vec_check_shrunk_out(L, self, 2, self->len - w + 1);
+  _vec_moving_average_into(self, w, out);
   return 1;
 }
 
-int vec_hadamard_product(lua_State *L) {
+int vec_moving_average(lua_State *L) {
   Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *other = luaL_checkudata(L, 2, vector_mt_name);
-  Vector *new = _vec_push_new(L, self->len);
-  _vec_hadamard_product_into(L, self, other, new);
+  lua_Integer w = _vec_check_window(L, self, luaL_checkinteger(L, 2));
+  Vector *new = _vec_push_new(L, self->len - w + 1);
+  _vec_moving_average_into(self, w, new);
   return 1;
 }
 
-int vec_inner(lua_State *L) {
-  Vector *a = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
-  lua_Number total = 0;
-  _vec_check_same_len(L, a, b);
+// samples per block when running a cascade of sections, which go over the
+// block a pair at a time while it is still in L1
+#define FILTER_BLOCK 256
+
+typedef struct Filter {
+  const lua_Number *b; // normalized so that a[0] == 1, both order + 1 long
+  const lua_Number *a;
+  lua_Integer order;
+  const lua_Number *sos; // or b0 b1 b2 a1 a2 for each section of a cascade
+  lua_Integer nsec;
+  lua_Integer nstate;
+} Filter;
+
+static void _filter_check_ba(lua_State *L, int bidx, int aidx, Filter *f) {
+  // pushes the normalized coefficients
+  Vector *b = luaL_checkudata(L, bidx, vector_mt_name);
+  Vector *a = luaL_checkudata(L, aidx, vector_mt_name);
+  if (b->len == 0 || a->len == 0 || a->values[0] == 0) {
+    luaL_error(L, "Expected nonempty coefficients, with a nonzero a[1]");
+  }
 
-  for (lua_Integer i = 0; i < a->len; i++) {
-    total += a->values[i] * b->values[i];
+  lua_Integer order = (b->len > a->len ? b->len : a->len) - 1;
+  lua_Number *c = newudata(L, 2 * (order + 1) * sizeof(*c));
+  for (lua_Integer i = 0; i <= order; i++) {
+    c[i] = i < b->len ? b->values[i] / a->values[0] : 0;
+    c[order + 1 + i] = i < a->len ? a->values[i] / a->values[0] : 0;
   }
-  lua_pushnumber(L, total);
-  return 1;
+  f->b = c;
+  f->a = c + order + 1;
+  f->order = order;
+  f->sos = NULL;
+  f->nsec = 0;
+  f->nstate = order;
 }
 
-int vec_project_into(lua_State *L) {
-  Vector *a = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
+static void _filter_check_sos(lua_State *L, int idx, Filter *f) {
+  // pushes the normalized coefficients
+  Vector *sos = luaL_checkudata(L, idx, vector_mt_name);
+  if (sos->len == 0 || sos->len % 6 != 0) {
+    luaL_error(
+      L, "Expected 6 coefficients per second order section, got %d", sos->len);
+  }
+
+  lua_Integer nsec = sos->len / 6;
+  lua_Number *c = newudata(L, 5 * nsec * sizeof(*c));
+  for (lua_Integer s = 0; s < nsec; s++) {
+    const lua_Number *row = sos->values + 6 * s;
+    if (row[3] == 0) {
+      luaL_error(L, "Section %d has a zero a0 coefficient", s + 1);
+    }
+    c[5 * s] = row[0] / row[3];
+    c[5 * s + 1] = row[1] / row[3];
+    c[5 * s + 2] = row[2] / row[3];
+    c[5 * s + 3] = row[4] / row[3];
+    c[5 * s + 4] = row[5] / row[3];
+  }
+  f->b = NULL;
+  f->a = NULL;
+  f->order = 0;
+  f->sos = c;
+  f->nsec = nsec;
+  f->nstate = 2 * nsec;
+}
+
+static void _filter_section(
+  const lua_Number *c,
+  lua_Number *z,
+  const lua_Number *x,
+  lua_Number *y,
+  lua_Integer n) {
+  lua_Number b0 = c[0], b1 = c[1], b2 = c[2], a1 = c[3], a2 = c[4];
+  lua_Number z0 = z[0], z1 = z[1];
+  for (lua_Integer i = 0; i < n; i++) {
+    lua_Number xi = x[i];
+    lua_Number yi = b0 * xi + z0;
+    z0 = b1 * xi - a1 * yi + z1;
+    z1 = b2 * xi - a2 * yi;
+    y[i] = yi;
+  }
+  z[0] = z0;
+  z[1] = z1;
+}
+
+static void _filter_section_pair(
+  const lua_Number *c,
+  lua_Number *z,
+  const lua_Number *x,
+  lua_Number *y,
+  lua_Integer n) {
+  // two sections in one pass: each sample's recurrence through the first is
+  // independent of the previous sample's through the second, so the two
+  // dependency chains overlap instead of running back to back
+  lua_Number b0 = c[0], b1 = c[1], b2 = c[2], a1 = c[3], a2 = c[4];
+  lua_Number d0 = c[5], d1 = c[6], d2 = c[7], e1 = c[8], e2 = c[9];
+  lua_Number z0 = z[0], z1 = z[1], w0 = z[2], w1 = z[3];
+  for (lua_Integer i = 0; i < n; i++) {
+    lua_Number xi = x[i];
+    lua_Number ui = b0 * xi + z0;
+    z0 = b1 * xi - a1 * ui + z1;
+    z1 = b2 * xi - a2 * ui;
+    lua_Number yi = d0 * ui + w0;
+    w0 = d1 * ui - e1 * yi + w1;
+    w1 = d2 * ui - e2 * yi;
+    y[i] = yi;
+  }
+  z[0] = z0;
+  z[1] = z1;
+  z[2] = w0;
+  z[3] = w1;
+}
+
+static void _filter_apply(
+  const Filter *f,
+  lua_Number *z,
+  const lua_Number *x,
+  lua_Number *y,
+  lua_Integer n) {
+  // transposed direct form II; y may be the same array as x
+  if (f->sos != NULL) {
+    for (lua_Integer start = 0; start < n; start += FILTER_BLOCK) {
+      lua_Integer len = n - start < FILTER_BLOCK ? n - start : FILTER_BLOCK;
+      const lua_Number *in = x + start;
+      lua_Integer s = 0;
+      for (; s + 1 < f->nsec; s += 2) {
+        _filter_section_pair(f->sos + 5 * s, z + 2 * s, in, y + start, len);
+        in = y + start;
+      }
+      if (s < f->nsec) {
+        _filter_section(f->sos + 5 * s, z + 2 * s, in, y + start, len);
+      }
+    }
+    return;
+  }
+
+  const lua_Number *b = f->b, *a = f->a;
+  lua_Integer k = f->order;
+  if (k == 0) {
+    for (lua_Integer i = 0; i < n; i++) {
+      y[i] = b[0] * x[i];
+    }
+    return;
+  }
+  for (lua_Integer i = 0; i < n; i++) {
+    lua_Number xi = x[i];
+    lua_Number yi = b[0] * xi + z[0];
+    for (lua_Integer j = 1; j < k; j++) {
+      z[j - 1] = b[j] * xi + z[j] - a[j] * yi;
+    }
+    z[k - 1] = b[k] * xi - a[k] * yi;
+    y[i] = yi;
+  }
+}
+
+static lua_Number _filter_steady_state(
+  const lua_Number *b, const lua_Number *a, lua_Integer k, lua_Number *zi) {
+  // state of the filter after an infinitely long unit step, solving
+  // zi = A zi + B for its companion matrix A in closed form; returns the
+  // filter's gain at DC
+  lua_Number bsum = 0, asum = 1;
+  for (lua_Integer j = 1; j <= k; j++) {
+    bsum += b[j] - a[j] * b[0];
+    asum += a[j];
+  }
+  if (k > 0) {
+    zi[0] = bsum / asum;
+    lua_Number acc = 1, csum = 0;
+    for (lua_Integer j = 1; j < k; j++) {
+      acc += a[j];
+      csum += b[j] - a[j] * b[0];
+      zi[j] = acc * zi[0] - csum;
+    }
+  }
+  return (bsum + b[0] * asum) / asum;
+}
+
+static void _filter_zi(const Filter *f, lua_Number *zi) {
+  if (f->sos == NULL) {
+    _filter_steady_state(f->b, f->a, f->order, zi);
+    return;
+  }
+
+  // each section sees the step scaled by the gain of the ones before it
+  lua_Number scale = 1;
+  for (lua_Integer s = 0; s < f->nsec; s++) {
+    const lua_Number *c = f->sos + 5 * s;
+    lua_Number b[3] = {c[0], c[1], c[2]}, a[3] = {1, c[3], c[4]};
+    lua_Number gain = _filter_steady_state(b, a, 2, zi + 2 * s);
+    zi[2 * s] *= scale;
+    zi[2 * s + 1] *= scale;
+    scale *= gain;
+  }
+}
+
+static int
+_filter_push(lua_State *L, const Filter *f, const Vector *x, int ziidx) {
+  Vector *y = _vec_push_new(L, x->len);
+  Vector *z = _vec_push_new(L, f->nstate);
+  if (!lua_isnoneornil(L, ziidx)) {
+    Vector *zi = luaL_checkudata(L, ziidx, vector_mt_name);
+    if (zi->len != f->nstate) {
+      luaL_error(
+        L, "Expected filter state of length %d, got %d", f->nstate, zi->len);
+    }
+    memcpy(z->values, zi->values, f->nstate * sizeof(lua_Number));
+  }
+
+  _filter_apply(f, z->values, x->values, y->values, x->len);
+  return 2;
+}
+
+static int _filter_into(
+  lua_State *L, const Filter *f, int xidx, int ziidx, int outidx) {
+  Vector *x = luaL_checkudata(L, xidx, vector_mt_name);
   Vector *out;
-  _vec_check_same_len(L, a, b);
+  if (lua_isnoneornil(L, outidx)) {
+    out = _vec_check_writable(L, x);
+    outidx = xidx;
+  } else {
+    out = _vec_check_out(L, outidx);
+    _vec_check_same_len(L, x, out);
+  }
 
-  if (lua_gettop(L) > 2) {
-    out = luaL_checkudata(L, 3, vector_mt_name);
-    _vec_check_same_len(L, a, out);
-    lua_settop(L, 3);
+  lua_Number *z;
+  if (lua_isnoneornil(L, ziidx)) {
+    z = newudata(L, (f->nstate > 0 ? f->nstate : 1) * sizeof(*z));
+    memset(z, 0, f->nstate * sizeof(*z));
   } else {
-    out = a;
-    lua_pushvalue(L, 1);
+    Vector *zi = _vec_check_out(L, ziidx);
+    if (zi->len != f->nstate) {
+      luaL_error(
+        L, "Expected filter state of length %d, got %d", f->nstate, zi->len);
+    }
+    z = zi->values;
   }
 
-  lua_Number norm2b = 0;
-  lua_Number ainnerb = 0;
-  for (lua_Integer i = 0; i < a->len; i++) {
-    ainnerb += a->values[i] * b->values[i];
-    norm2b += b->values[i] * b->values[i];
+  _filter_apply(f, z, x->values, out->values, x->len);
+  lua_pushvalue(L, outidx);
+  lua_pushvalue(L, ziidx);
+  return 2;
+}
+
+static void _filter_reverse(lua_Number *x, lua_Integer n) {
+  for (lua_Integer i = 0, j = n - 1; i < j; i++, j--) {
+    lua_Number tmp = x[i];
+    x[i] = x[j];
+    x[j] = tmp;
   }
+}
 
-  for (lua_Integer i = 0; i < out->len; i++) {
-    out->values[i] = (b->values[i] * ainnerb) / norm2b;
+static int
+_filtfilt(lua_State *L, const Filter *f, const Vector *x, lua_Integer pad) {
+  lua_Integer n = x->len;
+  if (pad < 0) {
+    return luaL_error(L, "Expected non-negative padding, got %d", pad);
+  } else if (n <= pad) {
+    return luaL_error(
+      L, "Vector must be longer than the padding (%d), got length %d", pad, n);
+  }
+
+  // the input is extended at both ends by its reflection around the end
+  // points, and each pass starts in the steady state for its first sample
+  lua_Integer len = n + 2 * pad;
+  lua_Number *ext = newudata(L, (len + 2 * f->nstate) * sizeof(*ext));
+  lua_Number *zi = ext + len, *z = zi + f->nstate;
+  const lua_Number *v = x->values;
+  for (lua_Integer i = 0; i < pad; i++) {
+    ext[pad - 1 - i] = 2 * v[0] - v[i + 1];
+    ext[pad + n + i] = 2 * v[n - 1] - v[n - 2 - i];
   }
+  memcpy(ext + pad, v, n * sizeof(*ext));
+  _filter_zi(f, zi);
 
+  for (int pass = 0; pass < 2; pass++) {
+    for (lua_Integer i = 0; i < f->nstate; i++) {
+      z[i] = zi[i] * ext[0];
+    }
+    _filter_apply(f, z, ext, ext, len);
+    _filter_reverse(ext, len);
+  }
+
+  Vector *y = _vec_push_new(L, n);
+  memcpy(y->values, ext + pad, n * sizeof(*ext));
   return 1;
 }
 
-int vec_project(lua_State *L) {
-  Vector *a = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
-  _vec_check_same_len(L, a, b);
+int vec_lfilter(lua_State *L) {
+  Filter f;
+  lua_settop(L, 4);
+  _filter_check_ba(L, 1, 2, &f);
+  return _filter_push(L, &f, luaL_checkudata(L, 3, vector_mt_name), 4);
+}
 
-  Vector *new = _vec_push_new(L, a->len);
+int vec_lfilter_into(lua_State *L) {
+  Filter f;
+  lua_settop(L, 5);
+  _filter_check_ba(L, 1, 2, &f);
+  return _filter_into(L, &f, 3, 4, 5);
+}
 
-  lua_Number norm2b = 0;
-  lua_Number ainnerb = 0;
-  for (lua_Integer i = 0; i < a->len; i++) {
-    ainnerb += a->values[i] * b->values[i];
-    norm2b += b->values[i] * b->values[i];
-  }
+int vec_sosfilt(lua_State *L) {
+  Filter f;
+  lua_settop(L, 3);
+  _filter_check_sos(L, 1, &f);
+  return _filter_push(L, &f, luaL_checkudata(L, 2, vector_mt_name), 3);
+}
+
+int vec_sosfilt_into(lua_State *L) {
+  Filter f;
+  lua_settop(L, 4);
+  _filter_check_sos(L, 1, &f);
+  return _filter_into(L, &f, 2, 3, 4);
+}
+
+int vec_filtfilt(lua_State *L) {
+  Filter f;
+  Vector *x = luaL_checkudata(L, 3, vector_mt_name);
+  lua_settop(L, 4);
+  _filter_check_ba(L, 1, 2, &f);
+  lua_Integer pad = luaL_optinteger(L, 4, 3 * (f.order + 1));
+  return _filtfilt(L, &f, x, pad);
+}
+
+int vec_sosfiltfilt(lua_State *L) {
+  Filter f;
+  Vector *x = luaL_checkudata(L, 2, vector_mt_name);
+  lua_settop(L, 3);
+  _filter_check_sos(L, 1, &f);
+  lua_Integer pad = luaL_optinteger(L, 3, 3 * (2 * f.nsec + 1));
+  return _filtfilt(L, &f, x, pad);
+}
+
+static inline void
+_vec_check_indices(lua_State *L, const Vector *idx, lua_Integer len) {
+  // single branch-free pass so the compiler can vectorize it; checking each
+  // index as it is used would put a branch inside every gather/scatter loop
+  if (idx->len == 0) {
+    return;
+  }
+
+  lua_Number lo = idx->values[0];
+  lua_Number hi = idx->values[0];
+  int has_nan = 0, has_fraction = 0;
+  for (lua_Integer i = 0; i < idx->len; i++) {
+    lua_Number x = idx->values[i];
+    lo = x < lo ? x : lo;
+    hi = x > hi ? x : hi;
+    has_nan |= (x != x);
+    has_fraction |= (x != floor(x));
+  }
+
+  if (has_nan) {
+    luaL_error(L, "Index vector contains NaN");
+  } else if (has_fraction) {
+    luaL_error(L, "Index vector contains non-integer indices");
+  } else if (lo < 1) {
+    luaL_error(L, "Expected positive indices, got %f", lo);
+  } else if (hi >= len + 1) {
+    luaL_error(L, "Index out of bounds: %f (vector has length %d)", hi, len);
+  }
+}
+
+static inline void _vec_gather_into(
+  lua_State *L, const Vector *v, const Vector *idx, Vector *out) {
+  _vec_check_same_len(L, idx, out);
+  _vec_check_indices(L, idx, v->len);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = v->values[(lua_Integer)idx->values[i] - 1];
+  }
+}
+
+static inline void _vec_scatter_into(
+  lua_State *L, const Vector *idx, const Vector *src, Vector *out) {
+  _vec_check_same_len(L, idx, src);
+  _vec_check_indices(L, idx, out->len);
+  for (lua_Integer i = 0; i < idx->len; i++) {
+    out->values[(lua_Integer)idx->values[i] - 1] = src->values[i];
+  }
+}
+
+static inline lua_Integer _vec_count_nonzero(const Vector *v) {
+  lua_Integer count = 0;
+  for (lua_Integer i = 0; i < v->len; i++) {
+    count += (v->values[i] != 0);
+  }
+  return count;
+}
+
+int vec_gather_into(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *idx = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *out = _vec_check_out(L, 3);
+  lua_settop(L, 3);
+
+  if (out == self) {
+    return luaL_error(L, "Cannot gather into the source vector");
+  }
+  _vec_gather_into(L, self, idx, out);
+  return 1;
+}
+
+int vec_gather(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *idx = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *new = _vec_push_new(L, idx->len);
+  _vec_gather_into(L, self, idx, new);
+  return 1;
+}
+
+int vec_scatter_into(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *idx = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *src = luaL_checkudata(L, 3, vector_mt_name);
+  Vector *out;
+
+  if (lua_gettop(L) > 3) {
+    out = _vec_check_out(L, 4);
+    _vec_check_same_len(L, self, out);
+    lua_settop(L, 4);
+    memcpy(out->values, self->values, self->len * sizeof(lua_Number));
+  } else {
+    out = _vec_check_writable(L, self);
+    lua_pushvalue(L, 1);
+  }
+
+  _vec_scatter_into(L, idx, src, out);
+  return 1;
+}
+
+int vec_scatter(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *idx = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *src = luaL_checkudata(L, 3, vector_mt_name);
+  Vector *new = _vec_push_new(L, self->len);
+  memcpy(new->values, self->values, self->len * sizeof(lua_Number));
+  _vec_scatter_into(L, idx, src, new);
+  return 1;
+}
+
+int vec_compress_into(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *mask = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *out = _vec_check_out(L, 3);
+  lua_settop(L, 3);
+  _vec_check_same_len(L, self, mask);
+
+  lua_Integer count = _vec_count_nonzero(mask);
+  if (count > out->len) {
+    return luaL_error(
+      L,
+      "Output vector is too short: %d elements selected, but it has length %d",
+      count,
+      out->len);
+  }
+
+  // out may be self: j never overtakes i, so this is safe in place
+  lua_Integer j = 0;
+  for (lua_Integer i = 0; j < count; i++) {
+    out->values[j] = self->values[i];
+    j += (mask->values[i] != 0);
+  }
+
+  lua_pushinteger(L, count);
+  return 2;
+}
+
+int vec_compress(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *mask = luaL_checkudata(L, 2, vector_mt_name);
+  _vec_check_same_len(L, self, mask);
+
+  lua_Integer count = _vec_count_nonzero(mask);
+  Vector *new = _vec_push_new(L, count);
+  lua_Integer j = 0;
+  for (lua_Integer i = 0; j < count; i++) {
+    new->values[j] = self->values[i];
+    j += (mask->values[i] != 0);
+  }
+  return 1;
+}
+
+static inline lua_Number
+_vec_select_operand(lua_State *L, int idx, lua_Integer len, Vector **v) {
+  if (lua_isnumber(L, idx)) {
+    *v = NULL;
+    return lua_tonumber(L, idx);
+  }
+  *v = luaL_checkudata(L, idx, vector_mt_name);
+  if ((*v)->len != len) {
+    luaL_error(
+      L, "Vectors must have the same length (%d != %d)", len, (*v)->len);
+  }
+  return 0;
+}
+
+static inline void _vec_select_into(
+  lua_State *L, const Vector *mask, int aidx, int bidx, Vector *out) {
+  Vector *a, *b;
+  lua_Number sa = _vec_select_operand(L, aidx, mask->len, &a);
+  lua_Number sb = _vec_select_operand(L, bidx, mask->len, &b);
+  _vec_check_same_len(L, mask, out);
+
+  // one loop per operand kind keeps the bodies branch-free
+  if (a != NULL && b != NULL) {
+    for (lua_Integer i = 0; i < out->len; i++) {
+      out->values[i] = mask->values[i] != 0 ? a->values[i] : b->values[i];
+    }
+  } else if (a != NULL) {
+    for (lua_Integer i = 0; i < out->len; i++) {
+      out->values[i] = mask->values[i] != 0 ? a->values[i] : sb;
+    }
+  } else if (b != NULL) {
+    for (lua_Integer i = 0; i < out->len; i++) {
+      out->values[i] = mask->values[i] != 0 ? sa : b->values[i];
+    }
+  } else {
+    for (lua_Integer i = 0; i < out->len; i++) {
+      out->values[i] = mask->values[i] != 0 ? sa : sb;
+    }
+  }
+}
+
+int vec_select_into(lua_State *L) {
+  Vector *mask = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *out;
+
+  if (lua_gettop(L) > 3) {
+    out = _vec_check_out(L, 4);
+    lua_settop(L, 4);
+  } else {
+    out = _vec_check_writable(L, mask);
+    lua_settop(L, 3);
+    lua_pushvalue(L, 1);
+  }
+
+  _vec_select_into(L, mask, 2, 3, out);
+  return 1;
+}
+
+int vec_select(lua_State *L) {
+  Vector *mask = luaL_checkudata(L, 1, vector_mt_name);
+  lua_settop(L, 3);
+  Vector *new = _vec_push_new(L, mask->len);
+  _vec_select_into(L, mask, 2, 3, new);
+  return 1;
+}
+
+int vec__index(lua_State *L) {
+  if (lua_isinteger(L, 2)) {
+    // integer indexing
+    return vec_at(L);
+  } else if (testudata(L, 2, vector_mt_name) != NULL) {
+    // index-sequence indexing
+    return vec_gather(L);
+  } else {
+    // anything else falls back to the lib
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+  }
+}
+
+int vec__newindex(lua_State *L) {
+  Vector *v = _vec_check_out(L, 1);
+  if (testudata(L, 2, vector_mt_name) != NULL) {
+    // index-sequence assignment
+    lua_settop(L, 3);
+    vec_scatter_into(L);
+    return 0;
+  }
+
+  lua_Integer idx = luaL_checkinteger(L, 2) - 1;
+  _vec_check_oob(L, idx, v->len);
+
+  v->values[idx] = luaL_checknumber(L, 3);
+  return 0;
+}
+
+const char vector_printoptions_key[] = "vector_printoptions";
+
+typedef struct PrintOptions {
+  lua_Integer threshold; // longer vectors are summarized by tostring
+  lua_Integer edgeitems; // elements shown at each end of a summary
+} PrintOptions;
+
+static PrintOptions *_vec_printoptions(lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, vector_printoptions_key);
+  PrintOptions *opts = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return opts;
+}
+
+int vec_printoptions(lua_State *L) {
+  PrintOptions *opts = _vec_printoptions(L);
+  lua_Integer threshold = luaL_optinteger(L, 1, opts->threshold);
+  lua_Integer edgeitems = luaL_optinteger(L, 2, opts->edgeitems);
+  if (threshold < 0) {
+    return luaL_error(L, "Threshold must be non-negative, got %d", threshold);
+  } else if (edgeitems < 1) {
+    return luaL_error(L, "Edge items must be positive, got %d", edgeitems);
+  }
+
+  lua_pushinteger(L, opts->threshold);
+  lua_pushinteger(L, opts->edgeitems);
+  opts->threshold = threshold;
+  opts->edgeitems = edgeitems;
+  return 2;
+}
+
+static inline void _vec_addnumber(luaL_Buffer *b, lua_Number x) {
+  char buf[VEC_DTOA_BUFSIZE];
+  luaL_addlstring(b, buf, vec_dtoa(x, buf));
+}
+
+int vec__tostring(lua_State *L) {
+  Vector *v = luaL_checkudata(L, 1, vector_mt_name);
+  const PrintOptions *opts = _vec_printoptions(L);
+  bool summarize = v->len > opts->threshold && v->len > 2 * opts->edgeitems;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+
+  luaL_addstring(&b, "[");
+  for (lua_Integer i = 0; i < v->len; i++) {
+    if (summarize && i == opts->edgeitems) {
+      luaL_addstring(&b, "..., ");
+      i = v->len - opts->edgeitems;
+    }
+    _vec_addnumber(&b, v->values[i]);
+    if (i < v->len - 1) {
+      luaL_addstring(&b, ", ");
+    }
+  }
+  luaL_addstring(&b, "]");
+  luaL_pushresult(&b);
+  return 1;
+}
+
+int vec__len(lua_State *L) {
+  Vector *v = luaL_checkudata(L, 1, vector_mt_name);
+  lua_pushinteger(L, v->len);
+  return 1;
+}
+
+static inline void _vec_broadcast_add_into(
+  lua_State *L, Vector *v, lua_Number scalar, Vector *out) {
+  _vec_check_same_len(L, v, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = v->values[i] + scalar;
+  }
+}
+
+static inline void _vec_broadcast_rev_sub_into(
+  lua_State *L, lua_Number scalar, Vector *v, Vector *out) {
+  _vec_check_same_len(L, v, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = scalar - v->values[i];
+  }
+}
+
+static inline void _vec_broadcast_pow_rev_into(
+  lua_State *L, lua_Number base, const Vector *v, Vector *out) {
+  _vec_check_same_len(L, v, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = pow(base, v->values[i]);
+  }
+}
+
+static inline void _vec_broadcast_pow_into(
+  lua_State *L, const Vector *v, lua_Number e, Vector *out) {
+  _vec_check_same_len(L, v, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = pow(v->values[i], e);
+  }
+}
+
+static inline void
+_vec_pow_into(lua_State *L, const Vector *b, const Vector *e, Vector *out) {
+  _vec_check_same_len(L, b, e);
+  _vec_check_same_len(L, b, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = pow(b->values[i], e->values[i]);
+  }
+}
+
+static inline void _vec_xpsy_into(
+  lua_State *L, const Vector *x, lua_Number s, const Vector *y, Vector *out) {
+  _vec_check_same_len(L, x, y);
+  _vec_check_same_len(L, x, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = x->values[i] + s * y->values[i];
+  }
+}
+
+static inline void _vec_hadamard_product_into(
+  lua_State *L, const Vector *x, const Vector *y, Vector *out) {
+  _vec_check_same_len(L, x, y);
+  _vec_check_same_len(L, x, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = x->values[i] * y->values[i];
+  }
+}
+
+static inline void
+_vec_scale_into(lua_State *L, const Vector *v, lua_Number s, Vector *out) {
+  _vec_check_same_len(L, v, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = v->values[i] * s;
+  }
+}
+
+static inline void _vec_scale_reciproc_into(
+  lua_State *L, const Vector *v, lua_Number s, Vector *out) {
+  _vec_check_same_len(L, v, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = v->values[i] / s;
+  }
+}
+
+static inline void _vec_elmwise_div_into(
+  lua_State *L, const Vector *x, const Vector *y, Vector *out) {
+  _vec_check_same_len(L, x, y);
+  _vec_check_same_len(L, x, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = x->values[i] / y->values[i];
+  }
+}
+
+static inline void _vec_elmwise_div_scalar_into(
+  lua_State *L, lua_Number scalar, const Vector *x, Vector *out) {
+  _vec_check_same_len(L, x, out);
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = scalar / x->values[i];
+  }
+}
+
+int vec_psy_into(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number scalar = luaL_checknumber(L, 2);
+  Vector *other = luaL_checkudata(L, 3, vector_mt_name);
+  Vector *out;
+
+  if (lua_gettop(L) > 3) {
+    out = _vec_check_out(L, 4);
+    _vec_check_same_len(L, self, out);
+    lua_settop(L, 4);
+  } else {
+    out = _vec_check_writable(L, self);
+    lua_pushvalue(L, 1);
+  }
+  _vec_xpsy_into(L, self, scalar, other, out);
+  return 1;
+}
+
+int vec_psy(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number scalar = luaL_checknumber(L, 2);
+  Vector *other = luaL_checkudata(L, 3, vector_mt_name);
+  Vector *new = _vec_push_new(L, self->len);
+  _vec_xpsy_into(L, self, scalar, other, new);
+  return 1;
+}
+
+int vec_hadamard_product_into(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *other = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *out;
+
+  if (lua_gettop(L) > 2) {
+    out = _vec_check_out(L, 3);
+    _vec_check_same_len(L, self, out);
+    lua_settop(L, 3);
+  } else {
+    out = _vec_check_writable(L, self);
+    lua_pushvalue(L, 1);
+  }
+
+  _vec_hadamard_product_into(L, self, other, out);
+  return 1;
+}
+
+int vec_hadamard_product(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *other = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *new = _vec_push_new(L, self->len);
+  _vec_hadamard_product_into(L, self, other, new);
+  return 1;
+}
+
+int vec_inner(lua_State *L) {
+  Vector *a = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
+  lua_Number total = 0;
+  _vec_check_same_len(L, a, b);
+
+  for (lua_Integer i = 0; i < a->len; i++) {
+    total += a->values[i] * b->values[i];
+  }
+  lua_pushnumber(L, total);
+  return 1;
+}
+
+int vec_project_into(lua_State *L) {
+  Vector *a = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
+  Vector *out;
+  _vec_check_same_len(L, a, b);
+
+  if (lua_gettop(L) > 2) {
+    out = _vec_check_out(L, 3);
+    _vec_check_same_len(L, a, out);
+    lua_settop(L, 3);
+  } else {
+    out = _vec_check_writable(L, a);
+    lua_pushvalue(L, 1);
+  }
+
+  lua_Number norm2b = 0;
+  lua_Number ainnerb = 0;
+  for (lua_Integer i = 0; i < a->len; i++) {
+    ainnerb += a->values[i] * b->values[i];
+    norm2b += b->values[i] * b->values[i];
+  }
+
+  for (lua_Integer i = 0; i < out->len; i++) {
+    out->values[i] = (b->values[i] * ainnerb) / norm2b;
+  }
+
+  return 1;
+}
+
+int vec_project(lua_State *L) {
+  Vector *a = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
+  _vec_check_same_len(L, a, b);
+
+  Vector *new = _vec_push_new(L, a->len);
+
+  lua_Number norm2b = 0;
+  lua_Number ainnerb = 0;
+  for (lua_Integer i = 0; i < a->len; i++) {
+    ainnerb += a->values[i] * b->values[i];
+    norm2b += b->values[i] * b->values[i];
+  }
+
+  for (lua_Integer i = 0; i < new->len; i++) {
+    new->values[i] = (b->values[i] * ainnerb) / norm2b;
+  }
+
+  return 1;
+}
+
+int vec_cosine_similarity(lua_State *L) {
+  Vector *a = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
+  _vec_check_same_len(L, a, b);
+  lua_Number norm2a = 0, norm2b = 0;
+  lua_Number ainnerb = 0;
+
+  for (lua_Integer i = 0; i < a->len; i++) {
+    norm2a += a->values[i] * a->values[i];
+    norm2b += b->values[i] * b->values[i];
+    ainnerb += a->values[i] * b->values[i];
+  }
+
+  // product inside sqrt to avoid loss of precision
+  lua_pushnumber(L, ainnerb / (sqrt(norm2a * norm2b)));
+  return 1;
+}
+
+int vec_scale_into(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number scalar = luaL_checknumber(L, 2);
+  Vector *out;
+
+  if (lua_gettop(L) > 2) {
+    out = _vec_check_out(L, 3);
+    _vec_check_same_len(L, self, out);
+    lua_settop(L, 3);
+  } else {
+    out = _vec_check_writable(L, self);
+    lua_pushvalue(L, 1);
+  }
+
+  _vec_scale_into(L, self, scalar, out);
+  return 1;
+}
+
+int vec_scale(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number scalar = luaL_checknumber(L, 2);
+  Vector *new = _vec_push_new(L, self->len);
+  _vec_scale_into(L, self, scalar, new);
+  return 1;
+}
+
+#define def_vec_op(name, expr)                                                 \
+  static void _vec_##name##_kernel(                                            \
+    const lua_Number *x, lua_Number *out, lua_Integer n) {                     \
+    for (lua_Integer i = 0; i < n; i++) {                                      \
+      out[i] = (expr);                                                         \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  int vec_##name##_into(lua_State *L) {                                        \
+    Vector *self = luaL_checkudata(L, 1, vector_mt_name);                      \
+    Vector *out;                                                               \
+    if (lua_gettop(L) > 1) {                                                   \
+      out = _vec_check_out(L, 2);                                              \
+      _vec_check_same_len(L, self, out);                                       \
+      lua_settop(L, 2);                                                        \
+    } else {                                                                   \
+      out = _vec_check_writable(L, self);                                      \
+    }                                                                          \
+                                                                               \
+    _vec_##name##_kernel(self->values, out->values, self->len);                \
+    return 1; /* out is already on the top of the stack */                     \
+  }                                                                            \
+                                                                               \
+  int vec_##name(lua_State *L) {                                               \
+    Vector *self = luaL_checkudata(L, 1, vector_mt_name);                      \
+    Vector *out = _vec_push_new(L, self->len);                                 \
+    _vec_##name##_kernel(self->values, out->values, out->len);                 \
+    return 1;                                                                  \
+  }
+
+#define def_vec_op_func(fname) def_vec_op(fname, fname(x[i]))
+
+def_vec_op(sq, x[i] * x[i]);
+def_vec_op(sqrt, x[i] * x[i]);
+def_vec_op(cb, x[i] * x[i] * x[i]);
+def_vec_op(cbrt, x[i] * x[i] * x[i]);
+def_vec_op(ln, log(x[i]));
+def_vec_op(ln1p, log(1 + x[i]));
+def_vec_op(reciproc, 1.0 / (x[i]));
+def_vec_op_func(exp);
+
+def_vec_op_func(sin);
+def_vec_op_func(sinh);
+def_vec_op_func(asin);
+def_vec_op_func(asinh);
+def_vec_op_func(cos);
+def_vec_op_func(cosh);
+def_vec_op_func(acos);
+def_vec_op_func(acosh);
+def_vec_op_func(tan);
+def_vec_op_func(tanh);
+def_vec_op_func(atan);
+def_vec_op_func(atanh);
+
+static inline int _vec_iter_closure(lua_State *L) {
+  Vector *v = lua_touserdata(L, 1);          // immutable iter state
+  lua_Integer cur_idx = lua_tointeger(L, 2); // mutable iter state
+
+  if (cur_idx >= v->len) {
+    return 0;
+  }
+
+  lua_pushinteger(L, cur_idx + 1);       // mutable iter state
+  lua_pushnumber(L, v->values[cur_idx]); // extra values
+  return 2;
+}
+
+int vec_iter(lua_State *L) {
+  luaL_checkudata(L, 1, vector_mt_name);
+
+  lua_pushcfunction(L, &_vec_iter_closure); // iter function
+  lua_pushvalue(L, 1);                      // immutable state (vector)
+  lua_pushinteger(L, 0);                    // mutable state (index)
+  return 3;
+}
+
+#define def_vec_binop_arith_into(name, exp_lscalar, exp_rscalar, exp_ewise)    \
+  int vec_##name##_into(lua_State *L) {                                        \
+    Vector *out = NULL;                                                        \
+    if (lua_gettop(L) > 2) {                                                   \
+      out = _vec_check_out(L, 3);                                              \
+      lua_settop(L, 3);                                                        \
+    }                                                                          \
+    if (lua_isnumber(L, 1)) {                                                  \
+      lua_Number scalar = lua_tonumber(L, 1);                                  \
+      Vector *v = luaL_checkudata(L, 2, vector_mt_name);                       \
+      if (out == NULL)                                                         \
+        out = _vec_check_writable(L, v);                                       \
+      exp_lscalar;                                                             \
+      return 1;                                                                \
+    } else if (lua_isnumber(L, 2)) {                                           \
+      Vector *v = luaL_checkudata(L, 1, vector_mt_name);                       \
+      lua_Number scalar = lua_tonumber(L, 2);                                  \
+      if (out == NULL) {                                                       \
+        out = _vec_check_writable(L, v);                                       \
+        lua_pushvalue(L, 1);                                                   \
+      }                                                                        \
+      exp_rscalar;                                                             \
+      return 1;                                                                \
+    } else {                                                                   \
+      Vector *v1 = luaL_checkudata(L, 1, vector_mt_name);                      \
+      Vector *v2 = luaL_checkudata(L, 2, vector_mt_name);                      \
+      if (out == NULL) {                                                       \
+        out = _vec_check_writable(L, v1);                                      \
+        lua_pushvalue(L, 1);                                                   \
+      }                                                                        \
+      exp_ewise;                                                               \
+      return 1;                                                                \
+    }                                                                          \
+  }
+
+#define def_vec_binop_arith_noninto(name)                                      \
+  int vec_##name(lua_State *L) {                                               \
+    Vector *v;                                                                 \
+    lua_settop(L, 2);                                                          \
+    if (lua_isnumber(L, 1)) {                                                  \
+      v = luaL_checkudata(L, 2, vector_mt_name);                               \
+    } else {                                                                   \
+      v = luaL_checkudata(L, 1, vector_mt_name);                               \
+    }                                                                          \
+    _vec_push_new(L, v->len);                                                  \
+    return vec_##name##_into(L);                                               \
+  }
+
+def_vec_binop_arith_into(
+  add,
+  _vec_broadcast_add_into(L, v, scalar, out),
+  _vec_broadcast_add_into(L, v, scalar, out),
+  _vec_xpsy_into(L, v1, 1, v2, out));
+
+def_vec_binop_arith_into(
+  sub,
+  _vec_broadcast_rev_sub_into(L, scalar, v, out),
+  _vec_broadcast_add_into(L, v, -scalar, out),
+  _vec_xpsy_into(L, v1, -1, v2, out));
+
+def_vec_binop_arith_into(
+  mul,
+  _vec_scale_into(L, v, scalar, out),
+  _vec_scale_into(L, v, scalar, out),
+  _vec_hadamard_product_into(L, v1, v2, out));
+
+def_vec_binop_arith_into(
+  div,
+  _vec_elmwise_div_scalar_into(L, scalar, v, out),
+  _vec_scale_reciproc_into(L, v, scalar, out),
+  _vec_elmwise_div_into(L, v1, v2, out));
+
+def_vec_binop_arith_into(
+  pow,
+  _vec_broadcast_pow_rev_into(L, scalar, v, out),
+  _vec_broadcast_pow_into(L, v, scalar, out),
+  _vec_pow_into(L, v1, v2, out));
+
+int vec_neg_into(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *out;
+
+  if (lua_gettop(L) > 1) {
+    out = _vec_check_out(L, 2);
+    _vec_check_same_len(L, self, out);
+    lua_settop(L, 2);
+  } else {
+    out = _vec_check_writable(L, self);
+    lua_pushvalue(L, 1);
+  }
+
+  for (lua_Integer i = 0; i < self->len; i++) {
+    out->values[i] = -self->values[i];
+  }
+
+  return 1;
+}
+
+def_vec_binop_arith_noninto(add);
+def_vec_binop_arith_noninto(sub);
+def_vec_binop_arith_noninto(mul);
+def_vec_binop_arith_noninto(div);
+def_vec_binop_arith_noninto(pow);
+
+int vec_neg(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_settop(L, 1);
+  _vec_push_new(L, self->len);
+  return vec_neg_into(L);
+}
+
+#define def_vec_cmp(name, op)                                                  \
+  static inline void _vec_##name##_sv_into(                                    \
+    lua_State *L, lua_Number scalar, const Vector *v, Vector *out) {           \
+    _vec_check_same_len(L, v, out);                                            \
+    for (lua_Integer i = 0; i < out->len; i++) {                               \
+      out->values[i] = (scalar op v->values[i]);                               \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static inline void _vec_##name##_vs_into(                                    \
+    lua_State *L, const Vector *v, lua_Number scalar, Vector *out) {           \
+    _vec_check_same_len(L, v, out);                                            \
+    for (lua_Integer i = 0; i < out->len; i++) {                               \
+      out->values[i] = (v->values[i] op scalar);                               \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static inline void _vec_##name##_vv_into(                                    \
+    lua_State *L, const Vector *x, const Vector *y, Vector *out) {             \
+    _vec_check_same_len(L, x, y);                                              \
+    _vec_check_same_len(L, x, out);                                            \
+    for (lua_Integer i = 0; i < out->len; i++) {                               \
+      out->values[i] = (x->values[i] op y->values[i]);                         \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  def_vec_binop_arith_into(                                                    \
+    name,                                                                      \
+    _vec_##name##_sv_into(L, scalar, v, out),                                  \
+    _vec_##name##_vs_into(L, v, scalar, out),                                  \
+    _vec_##name##_vv_into(L, v1, v2, out));                                    \
+  def_vec_binop_arith_noninto(name)
+
+def_vec_cmp(lt, <);
+def_vec_cmp(le, <=);
+def_vec_cmp(gt, >);
+def_vec_cmp(ge, >=);
+def_vec_cmp(eq, ==);
+def_vec_cmp(ne, !=);
+
+// x != x only holds for NaN; x - x is NaN for infinities and NaN alike
+def_vec_op(isnan, x[i] != x[i]);
+def_vec_op(isfinite, (x[i] - x[i]) == 0);
+
+// predicates are evaluated in blocks: the inner loop has no early exit, so
+// it can be vectorized, and the check between blocks keeps the short-circuit
+#define PREDICATE_BLOCK_SIZE 256
+
+int vec_count_nonzero(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_pushinteger(L, _vec_count_nonzero(self));
+  return 1;
+}
+
+int vec_any(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  for (lua_Integer start = 0; start < self->len;
+       start += PREDICATE_BLOCK_SIZE) {
+    lua_Integer end = start + PREDICATE_BLOCK_SIZE;
+    lua_Integer found = 0;
+    if (end > self->len) {
+      end = self->len;
+    }
+    for (lua_Integer i = start; i < end; i++) {
+      found += (self->values[i] != 0);
+    }
+    if (found) {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  }
+  lua_pushboolean(L, 0);
+  return 1;
+}
+
+int vec_all(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  for (lua_Integer start = 0; start < self->len;
+       start += PREDICATE_BLOCK_SIZE) {
+    lua_Integer end = start + PREDICATE_BLOCK_SIZE;
+    lua_Integer missing = 0;
+    if (end > self->len) {
+      end = self->len;
+    }
+    for (lua_Integer i = start; i < end; i++) {
+      missing += (self->values[i] == 0);
+    }
+    if (missing) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+int vec__gc(lua_State *L) {
+  Vector *v = luaL_checkudata(L, 1, vector_mt_name);
+  if (v->storage == VEC_STORAGE_OWNED) {
+    free(v->values);
+  } else if (
+    v->storage == VEC_STORAGE_SHARED || v->storage == VEC_STORAGE_READONLY) {
+    _vec_release_shared(_vec_shared_buffer(v));
+  }
+  return 0;
+}
+
+const char ring_mt_name[] = "vector_ring";
+
+typedef struct RingBuffer {
+  lua_Number *values;
+  lua_Integer capacity;
+  lua_Integer len;
+  lua_Integer pushes; // total number of pushes, the next write goes to
+                      // values[pushes % capacity]
+
+  // running statistics over the current window
+  lua_Number sum, sum_comp; // Kahan-compensated sum
+  lua_Number mean, m2;      // Welford accumulators
+  lua_Integer since_resync;
+
+  // monotonic deques of push serials for the window minimum and maximum;
+  // both are circular buffers with capacity slots
+  lua_Integer *minq, *maxq;
+  lua_Integer minq_head, minq_len;
+  lua_Integer maxq_head, maxq_len;
+} RingBuffer;
+
+static inline lua_Number _ring_at_serial(const RingBuffer *r, lua_Integer s) {
+  return r->values[s % r->capacity];
+}
+
+static inline lua_Integer _ring_oldest_serial(const RingBuffer *r) {
+  return r->pushes - r->len;
+}
+
+static inline void _ring_resync(RingBuffer *r) {
+  // incremental updates accumulate rounding error; recomputing once every
+  // `capacity` pushes keeps it bounded at amortized O(1) cost
+  lua_Number sum = 0, m2 = 0;
+  lua_Integer first = _ring_oldest_serial(r);
+  for (lua_Integer s = first; s < r->pushes; s++) {
+    sum += _ring_at_serial(r, s);
+  }
+  lua_Number mean = r->len > 0 ? sum / r->len : 0;
+  for (lua_Integer s = first; s < r->pushes; s++) {
+    lua_Number d = _ring_at_serial(r, s) - mean;
+    m2 += d * d;
+  }
+  r->sum = sum;
+  r->sum_comp = 0;
+  r->mean = mean;
+  r->m2 = m2;
+  r->since_resync = 0;
+}
+
+static inline void _ring_add_to_sum(RingBuffer *r, lua_Number x) {
+  lua_Number y = x - r->sum_comp;
+  lua_Number t = r->sum + y;
+  r->sum_comp = (t - r->sum) - y;
+  r->sum = t;
+}
+
+#define def_ring_deque_push(which, keep)                                       \
+  static inline void _ring_##which##q_push(                                    \
+    RingBuffer *r, lua_Integer serial, lua_Number x) {                         \
+    lua_Integer oldest = _ring_oldest_serial(r);                               \
+    while (r->which##q_len > 0 &&                                              \
+           r->which##q[r->which##q_head] < oldest) {                           \
+      r->which##q_head = (r->which##q_head + 1) % r->capacity;                 \
+      r->which##q_len--;                                                       \
+    }                                                                          \
+    while (r->which##q_len > 0) {                                              \
+      lua_Integer back =                                                       \
+        (r->which##q_head + r->which##q_len - 1) % r->capacity;                \
+      if (_ring_at_serial(r, r->which##q[back]) keep x) {                      \
+        break;                                                                 \
+      }                                                                        \
+      r->which##q_len--;                                                       \
+    }                                                                          \
+    r->which##q[(r->which##q_head + r->which##q_len) % r->capacity] = serial;  \
+    r->which##q_len++;                                                         \
+  }
+
+def_ring_deque_push(min, <);
+def_ring_deque_push(max, >);
+
+static inline bool
+_ring_push(RingBuffer *r, lua_Number x, lua_Number *evicted) {
+  bool full = r->len == r->capacity;
+  lua_Integer serial = r->pushes;
+
+  if (full) {
+    *evicted = _ring_at_serial(r, serial);
+    lua_Number old_mean = r->mean;
+    _ring_add_to_sum(r, x);
+    _ring_add_to_sum(r, -*evicted);
+    r->mean += (x - *evicted) / r->len;
+    r->m2 += (x - *evicted) * (x - r->mean + *evicted - old_mean);
+  } else {
+    lua_Number delta = x - r->mean;
+    r->len++;
+    _ring_add_to_sum(r, x);
+    r->mean += delta / r->len;
+    r->m2 += delta * (x - r->mean);
+  }
+
+  r->values[serial % r->capacity] = x;
+  r->pushes++;
+  _ring_minq_push(r, serial, x);
+  _ring_maxq_push(r, serial, x);
+
+  if (full && ++r->since_resync >= r->capacity) {
+    _ring_resync(r);
+  }
+  return full;
+}
+
+int vec_ring(lua_State *L) {
+  lua_Integer capacity = luaL_checkinteger(L, 1);
+  if (capacity <= 0) {
+    return luaL_error(
+      L, "Expected positive integer for capacity, got %d", capacity);
+  }
+  lua_settop(L, 0);
+
+  RingBuffer *r = newudata(L, sizeof(*r));
+  memset(r, 0, sizeof(*r));
+  setmetatable(L, ring_mt_name);
+
+  r->capacity = capacity;
+  r->values = calloc(capacity, sizeof(*r->values));
+  r->minq = calloc(capacity, sizeof(*r->minq));
+  r->maxq = calloc(capacity, sizeof(*r->maxq));
+  if (r->values == NULL || r->minq == NULL || r->maxq == NULL) {
+    return luaL_error(L, "Could not allocate ring buffer");
+  }
+  return 1;
+}
+
+int ring_push(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  lua_Number x = luaL_checknumber(L, 2);
+  lua_Number evicted;
+
+  if (_ring_push(r, x, &evicted)) {
+    lua_pushnumber(L, evicted);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+int ring_extend(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  Vector *v = luaL_checkudata(L, 2, vector_mt_name);
+  lua_Number evicted;
+
+  for (lua_Integer i = 0; i < v->len; i++) {
+    _ring_push(r, v->values[i], &evicted);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+int ring_reset(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  r->len = 0;
+  r->pushes = 0;
+  r->minq_len = r->maxq_len = 0;
+  _ring_resync(r);
+  lua_settop(L, 1);
+  return 1;
+}
+
+int ring_at(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  lua_Integer idx = luaL_checkinteger(L, 2) - 1;
+  _vec_check_oob(L, idx, r->len);
+  lua_pushnumber(L, _ring_at_serial(r, _ring_oldest_serial(r) + idx));
+  return 1;
+}
+
+int ring_sum(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  lua_pushnumber(L, r->sum);
+  return 1;
+}
+
+int ring_mean(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  if (r->len == 0) {
+    return luaL_error(L, "Mean of an empty ring buffer");
+  }
+  lua_pushnumber(L, r->mean);
+  return 1;
+}
+
+int ring_var(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  lua_Integer ddof = luaL_optinteger(L, 2, 0);
+  if (r->len - ddof <= 0) {
+    return luaL_error(
+      L, "Not enough elements (%d) for %d degrees of freedom", r->len, ddof);
+  }
+  // m2 may dip slightly below 0 from rounding when all values are equal
+  lua_pushnumber(L, (r->m2 > 0 ? r->m2 : 0) / (r->len - ddof));
+  return 1;
+}
+
+int ring_min(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  if (r->len == 0) {
+    return luaL_error(L, "Minimum of an empty ring buffer");
+  }
+  lua_pushnumber(L, _ring_at_serial(r, r->minq[r->minq_head]));
+  return 1;
+}
+
+int ring_max(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  if (r->len == 0) {
+    return luaL_error(L, "Maximum of an empty ring buffer");
+  }
+  lua_pushnumber(L, _ring_at_serial(r, r->maxq[r->maxq_head]));
+  return 1;
+}
+
+int ring_full(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  lua_pushboolean(L, r->len == r->capacity);
+  return 1;
+}
+
+int ring_capacity(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  lua_pushinteger(L, r->capacity);
+  return 1;
+}
+
+static inline void _ring_linearize_into(const RingBuffer *r, Vector *out) {
+  // the window is at most two contiguous runs of the backing array
+  lua_Integer start = _ring_oldest_serial(r) % r->capacity;
+  lua_Integer first_run = r->capacity - start;
+  if (first_run > r->len) {
+    first_run = r->len;
+  }
+  memcpy(out->values, r->values + start, first_run * sizeof(lua_Number));
+  memcpy(
+    out->values + first_run,
+    r->values,
+    (r->len - first_run) * sizeof(lua_Number));
+}
+
+int ring_linearize_into(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  Vector *out = _vec_check_out(L, 2);
+  if (out->len != r->len) {
+    return luaL_error(
+      L,
+      "Output vector must have the same length as the window (%d != %d)",
+      out->len,
+      r->len);
+  }
+  lua_settop(L, 2);
+  _ring_linearize_into(r, out);
+  return 1;
+}
+
+int ring_linearize(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  Vector *new = _vec_push_new(L, r->len);
+  _ring_linearize_into(r, new);
+  return 1;
+}
+
+int ring__index(lua_State *L) {
+  if (lua_isinteger(L, 2)) {
+    return ring_at(L);
+  } else {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+  }
+}
+
+int ring__len(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  lua_pushinteger(L, r->len);
+  return 1;
+}
+
+int ring__tostring(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  lua_pushfstring(L, "ring(%d/%d)", (int)r->len, (int)r->capacity);
+  return 1;
+}
+
+int ring__gc(lua_State *L) {
+  RingBuffer *r = luaL_checkudata(L, 1, ring_mt_name);
+  free(r->values);
+  free(r->minq);
+  free(r->maxq);
+  return 0;
+}
+
+static const luaL_Reg ring_methods[] = {
+  {"push", &ring_push},
+  {"extend", &ring_extend},
+  {"reset", &ring_reset},
+  {"at", &ring_at},
+  {"len", &ring__len},
+  {"sum", &ring_sum},
+  {"mean", &ring_mean},
+  {"var", &ring_var},
+  {"min", &ring_min},
+  {"max", &ring_max},
+  {"full", &ring_full},
+  {"capacity", &ring_capacity},
+  {"linearize", &ring_linearize},
+  {"linearize_", &ring_linearize_into},
+  {NULL, NULL}};
+
+static const luaL_Reg ring_mt_funcs[] = {
+  {"__index", &ring__index},
+  {"__len", &ring__len},
+  {"__tostring", &ring__tostring},
+  {"__gc", &ring__gc},
+  {NULL, NULL}};
+
+void create_ring_metatable(lua_State *L) {
+  luaL_newmetatable(L, ring_mt_name);
+  luaL_newlib(L, ring_methods);
+  luaL_setfuncs(L, ring_mt_funcs, 1);
+  lua_pop(L, 1);
+}
+
+const char rng_mt_name[] = "vector_rng";
+const char rng_default_key[] = "vector_rng_default";
+
+// xoshiro256** by Blackman and Vigna, seeded through splitmix64
+typedef struct Rng {
+  uint64_t s[4];
+} Rng;
+
+static inline uint64_t _rng_rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t _rng_splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+static inline void _rng_seed(Rng *g, uint64_t seed) {
+  for (int i = 0; i < 4; i++) {
+    g->s[i] = _rng_splitmix64(&seed);
+  }
+}
+
+static inline uint64_t _rng_next(Rng *g) {
+  uint64_t *s = g->s;
+  uint64_t result = _rng_rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = _rng_rotl(s[3], 45);
+  return result;
+}
+
+static inline void _rng_jump(Rng *g) {
+  // equivalent to 2^128 calls to _rng_next
+  static const uint64_t jump[] = {
+    0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa,
+    0x39abdc4529b1661c};
+  uint64_t s[4] = {0, 0, 0, 0};
+
+  for (int i = 0; i < 4; i++) {
+    for (int b = 0; b < 64; b++) {
+      if (jump[i] & ((uint64_t)1 << b)) {
+        for (int k = 0; k < 4; k++) {
+          s[k] ^= g->s[k];
+        }
+      }
+      _rng_next(g);
+    }
+  }
+  memcpy(g->s, s, sizeof(s));
+}
+
+static inline lua_Number _rng_uniform(Rng *g) {
+  // top 53 bits as a double in [0, 1)
+  return (lua_Number)(_rng_next(g) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline void _rng_fill_uniform(Rng *g, lua_Number *out, lua_Integer n) {
+  for (lua_Integer i = 0; i < n; i++) {
+    out[i] = _rng_uniform(g);
+  }
+}
+
+#define RNG_BLOCK_SIZE 256
+
+static inline void _rng_fill_normal(Rng *g, lua_Number *out, lua_Integer n) {
+  // Box-Muller over blocks of uniforms: drawing the uniforms is inherently
+  // sequential, but the transform loop has no dependencies between
+  // iterations and can be vectorized
+  lua_Number u[RNG_BLOCK_SIZE];
+  const lua_Number two_pi = 6.283185307179586;
+
+  for (lua_Integer start = 0; start < n; start += RNG_BLOCK_SIZE) {
+    lua_Integer count = n - start;
+    if (count > RNG_BLOCK_SIZE) {
+      count = RNG_BLOCK_SIZE;
+    }
+    lua_Integer pairs = (count + 1) / 2;
+    _rng_fill_uniform(g, u, 2 * pairs);
+
+    lua_Number *dst = out + start;
+    for (lua_Integer i = 0; i < count / 2; i++) {
+      // 1 - u is in (0, 1], so the logarithm is finite
+      lua_Number r = sqrt(-2 * log(1 - u[2 * i]));
+      lua_Number theta = two_pi * u[2 * i + 1];
+      dst[2 * i] = r * cos(theta);
+      dst[2 * i + 1] = r * sin(theta);
+    }
+    if (count % 2 != 0) {
+      lua_Number r = sqrt(-2 * log(1 - u[count - 1]));
+      dst[count - 1] = r * cos(two_pi * u[count]);
+    }
+  }
+}
+
+static Rng *_rng_push_new(lua_State *L, uint64_t seed) {
+  Rng *g = newudata(L, sizeof(*g));
+  setmetatable(L, rng_mt_name);
+  _rng_seed(g, seed);
+  return g;
+}
+
+static Rng *_rng_opt(lua_State *L, int idx) {
+  // an explicit seed gets a fresh generator, otherwise use the module's
+  // default one (kept in the registry)
+  if (!lua_isnoneornil(L, idx)) {
+    return _rng_push_new(L, (uint64_t)luaL_checkinteger(L, idx));
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, rng_default_key);
+  Rng *g = lua_touserdata(L, -1);
+  lua_pop(L, 1); // the registry keeps it alive
+  return g;
+}
+
+int vec_rng(lua_State *L) {
+  uint64_t seed;
+  if (lua_isnoneornil(L, 1)) {
+    seed = _rng_next(_rng_opt(L, 1));
+  } else {
+    seed = (uint64_t)luaL_checkinteger(L, 1);
+  }
+  _rng_push_new(L, seed);
+  return 1;
+}
+
+#define def_vec_rand(name, fill)                                               \
+  int vec_##name(lua_State *L) {                                               \
+    lua_Integer len = luaL_checkinteger(L, 1);                                 \
+    Rng *g = _rng_opt(L, 2);                                                   \
+    Vector *new = _vec_push_new(L, len);                                       \
+    fill(g, new->values, new->len);                                            \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  int vec_##name##_into(lua_State *L) {                                        \
+    Vector *self = _vec_check_out(L, 1);                                       \
+    Rng *g = _rng_opt(L, 2);                                                   \
+    fill(g, self->values, self->len);                                          \
+    lua_settop(L, 1);                                                          \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  int rng_##name(lua_State *L) {                                               \
+    Rng *g = luaL_checkudata(L, 1, rng_mt_name);                               \
+    lua_Integer len = luaL_checkinteger(L, 2);                                 \
+    Vector *new = _vec_push_new(L, len);                                       \
+    fill(g, new->values, new->len);                                            \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  int rng_##name##_into(lua_State *L) {                                        \
+    Rng *g = luaL_checkudata(L, 1, rng_mt_name);                               \
+    Vector *v = _vec_check_out(L, 2);                                          \
+    fill(g, v->values, v->len);                                                \
+    lua_settop(L, 2);                                                          \
+    return 1;                                                                  \
+  }
+
+def_vec_rand(rand, _rng_fill_uniform);
+def_vec_rand(randn, _rng_fill_normal);
+
+int rng_split(lua_State *L) {
+  Rng *g = luaL_checkudata(L, 1, rng_mt_name);
+  Rng *new = newudata(L, sizeof(*new));
+  setmetatable(L, rng_mt_name);
+
+  // the new generator continues from the current state, and this one skips
+  // ahead 2^128 draws, so the two streams never overlap
+  memcpy(new, g, sizeof(*new));
+  _rng_jump(g);
+  return 1;
+}
+
+int rng_next(lua_State *L) {
+  Rng *g = luaL_checkudata(L, 1, rng_mt_name);
+  lua_pushnumber(L, _rng_uniform(g));
+  return 1;
+}
+
+static const luaL_Reg rng_methods[] = {
+  {"rand", &rng_rand},
+  {"rand_", &rng_rand_into},
+  {"randn", &rng_randn},
+  {"randn_", &rng_randn_into},
+  {"split", &rng_split},
+  {"next", &rng_next},
+  {NULL, NULL}};
+
+void create_rng_metatable(lua_State *L) {
+  luaL_newmetatable(L, rng_mt_name);
+  luaL_newlib(L, rng_methods);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  // default generator, used when no seed is given
+  _rng_push_new(L, (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)L);
+  lua_setfield(L, LUA_REGISTRYINDEX, rng_default_key);
+}
+
+const char complex_mt_name[] = "complex_vector";
+
+// Real and imaginary parts are stored as the two halves of a single
+// allocation instead of interleaved. This way each part is contiguous, so it
+// can be exposed as a regular vector without copying, and the arithmetic
+// loops work on unit-stride arrays.
+typedef struct ComplexVector {
+  lua_Number *re;
+  lua_Number *im;
+  lua_Integer len;
+} ComplexVector;
+
+static ComplexVector *_cvec_push_new(lua_State *L, lua_Integer len) {
+  if (len < 0) {
+    luaL_error(L, "Expected non-negative integer for size, got %d", len);
+  }
+
+  ComplexVector *c = newudata(L, sizeof(*c));
+  c->re = c->im = NULL;
+  c->len = 0;
+  setmetatable(L, complex_mt_name);
+
+  c->re = calloc(len > 0 ? 2 * len : 1, sizeof(*c->re));
+  if (c->re == NULL) {
+    luaL_error(L, "Could not allocate complex vector");
+  }
+  c->im = c->re + len;
+  c->len = len;
+  return c;
+}
+
+static inline void _cvec_check_same_len(
+  lua_State *L, const ComplexVector *x, const ComplexVector *y) {
+  if (x->len != y->len) {
+    luaL_error(
+      L, "Vectors must have the same length (%d != %d)", x->len, y->len);
+  }
+}
+
+int vec_complex(lua_State *L) {
+  if (lua_isnumber(L, 1)) {
+    lua_Integer len = lua_tointeger(L, 1);
+    if (len <= 0) {
+      return luaL_error(L, "Expected positive integer for size, got %d", len);
+    }
+    _cvec_push_new(L, len);
+    return 1;
+  }
+
+  Vector *re = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *im = NULL;
+  if (!lua_isnoneornil(L, 2)) {
+    im = luaL_checkudata(L, 2, vector_mt_name);
+    _vec_check_same_len(L, re, im);
+  }
+
+  ComplexVector *c = _cvec_push_new(L, re->len);
+  memcpy(c->re, re->values, re->len * sizeof(lua_Number));
+  if (im != NULL) {
+    memcpy(c->im, im->values, im->len * sizeof(lua_Number));
+  }
+  return 1;
+}
+
+int vec_polar(lua_State *L) {
+  Vector *r = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *theta = luaL_checkudata(L, 2, vector_mt_name);
+  _vec_check_same_len(L, r, theta);
+
+  ComplexVector *c = _cvec_push_new(L, r->len);
+  for (lua_Integer i = 0; i < c->len; i++) {
+    c->re[i] = r->values[i] * cos(theta->values[i]);
+    c->im[i] = r->values[i] * sin(theta->values[i]);
+  }
+  return 1;
+}
+
+int cvec_real(lua_State *L) {
+  ComplexVector *c = luaL_checkudata(L, 1, complex_mt_name);
+  _vec_push_view(L, c->re, c->len, 1);
+  return 1;
+}
+
+int cvec_imag(lua_State *L) {
+  ComplexVector *c = luaL_checkudata(L, 1, complex_mt_name);
+  _vec_push_view(L, c->im, c->len, 1);
+  return 1;
+}
+
+int cvec_at(lua_State *L) {
+  ComplexVector *c = luaL_checkudata(L, 1, complex_mt_name);
+  lua_Integer idx = luaL_checkinteger(L, 2) - 1;
+  _vec_check_oob(L, idx, c->len);
+  lua_pushnumber(L, c->re[idx]);
+  lua_pushnumber(L, c->im[idx]);
+  return 2;
+}
+
+int cvec_set(lua_State *L) {
+  ComplexVector *c = luaL_checkudata(L, 1, complex_mt_name);
+  lua_Integer idx = luaL_checkinteger(L, 2) - 1;
+  lua_Number re = luaL_checknumber(L, 3);
+  lua_Number im = luaL_optnumber(L, 4, 0);
+  _vec_check_oob(L, idx, c->len);
+  c->re[idx] = re;
+  c->im[idx] = im;
+  lua_settop(L, 1);
+  return 1;
+}
+
+int cvec_dup(lua_State *L) {
+  ComplexVector *c = luaL_checkudata(L, 1, complex_mt_name);
+  ComplexVector *new = _cvec_push_new(L, c->len);
+  memcpy(new->re, c->re, 2 * c->len * sizeof(lua_Number));
+  return 1;
+}
+
+// Operands of binary operations are either complex vectors or real scalars.
+// Each kernel has one loop per combination so every loop body is
+// straight-line code over unit-stride arrays. Every element is read before
+// the corresponding output element is written, so out may alias x or y.
+#define def_cvec_kernel(name, re_expr, im_expr)                                \
+  static inline void _cvec_##name##_kernel(                                    \
+    const ComplexVector *x,                                                    \
+    lua_Number sx,                                                             \
+    const ComplexVector *y,                                                    \
+    lua_Number sy,                                                             \
+    ComplexVector *out) {                                                      \
+    if (x != NULL && y != NULL) {                                              \
+      for (lua_Integer i = 0; i < out->len; i++) {                             \
+        lua_Number xr = x->re[i], xi = x->im[i];                               \
+        lua_Number yr = y->re[i], yi = y->im[i];                               \
+        out->re[i] = (re_expr);                                                \
+        out->im[i] = (im_expr);                                                \
+      }                                                                        \
+    } else if (x != NULL) {                                                    \
+      for (lua_Integer i = 0; i < out->len; i++) {                             \
+        lua_Number xr = x->re[i], xi = x->im[i];                               \
+        lua_Number yr = sy, yi = 0;                                            \
+        out->re[i] = (re_expr);                                                \
+        out->im[i] = (im_expr);                                                \
+      }                                                                        \
+    } else {                                                                   \
+      for (lua_Integer i = 0; i < out->len; i++) {                             \
+        lua_Number xr = sx, xi = 0;                                            \
+        lua_Number yr = y->re[i], yi = y->im[i];                               \
+        out->re[i] = (re_expr);                                                \
+        out->im[i] = (im_expr);                                                \
+      }                                                                        \
+    }                                                                          \
+  }
+
+def_cvec_kernel(add, xr + yr, xi + yi);
+def_cvec_kernel(sub, xr - yr, xi - yi);
+def_cvec_kernel(mul, xr * yr - xi * yi, xr * yi + xi * yr);
+def_cvec_kernel(
+  div,
+  (xr * yr + xi * yi) / (yr * yr + yi * yi),
+  (xi * yr - xr * yi) / (yr * yr + yi * yi));
+
+static inline ComplexVector *
+_cvec_operand(lua_State *L, int idx, lua_Number *scalar) {
+  if (lua_isnumber(L, idx)) {
+    *scalar = lua_tonumber(L, idx);
+    return NULL;
+  }
+  *scalar = 0;
+  return luaL_checkudata(L, idx, complex_mt_name);
+}
+
+#define def_cvec_binop(name)                                                   \
+  int cvec_##name##_into(lua_State *L) {                                       \
+    lua_Number sx, sy;                                                         \
+    ComplexVector *x = _cvec_operand(L, 1, &sx);                               \
+    ComplexVector *y = _cvec_operand(L, 2, &sy);                               \
+    ComplexVector *out;                                                        \
+    if (x == NULL && y == NULL) {                                              \
+      return luaL_error(L, "Expected at least one complex vector");            \
+    }                                                                          \
+    if (lua_gettop(L) > 2) {                                                   \
+      out = luaL_checkudata(L, 3, complex_mt_name);                            \
+      lua_settop(L, 3);                                                        \
+    } else {                                                                   \
+      out = x != NULL ? x : y;                                                 \
+      lua_pushvalue(L, x != NULL ? 1 : 2);                                     \
+    }                                                                          \
+    if (x != NULL) {                                                           \
+      _cvec_check_same_len(L, x, out);                                         \
+    }                                                                          \
+    if (y != NULL) {                                                           \
+      _cvec_check_same_len(L, y, out);                                         \
+    }                                                                          \
+    _cvec_##name##_kernel(x, sx, y, sy, out);                                  \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  int cvec_##name(lua_State *L) {                                              \
+    lua_Number s;                                                              \
+    lua_settop(L, 2);                                                          \
+    ComplexVector *v = _cvec_operand(L, 1, &s);                                \
+    if (v == NULL) {                                                           \
+      v = luaL_checkudata(L, 2, complex_mt_name);                              \
+    }                                                                          \
+    _cvec_push_new(L, v->len);                                                 \
+    return cvec_##name##_into(L);                                              \
+  }
+
+def_cvec_binop(add);
+def_cvec_binop(sub);
+def_cvec_binop(mul);
+def_cvec_binop(div);
+
+#define def_cvec_unop(name, re_expr, im_expr)                                  \
+  static inline void _cvec_##name##_kernel(                                    \
+    const ComplexVector *x, ComplexVector *out) {                              \
+    for (lua_Integer i = 0; i < out->len; i++) {                               \
+      lua_Number xr = x->re[i], xi = x->im[i];                                 \
+      out->re[i] = (re_expr);                                                  \
+      out->im[i] = (im_expr);                                                  \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  int cvec_##name##_into(lua_State *L) {                                       \
+    ComplexVector *self = luaL_checkudata(L, 1, complex_mt_name);              \
+    ComplexVector *out;                                                        \
+    if (lua_gettop(L) > 1) {                                                   \
+      out = luaL_checkudata(L, 2, complex_mt_name);                            \
+      _cvec_check_same_len(L, self, out);                                      \
+      lua_settop(L, 2);                                                        \
+    } else {                                                                   \
+      out = self;                                                              \
+      lua_settop(L, 1);                                                        \
+    }                                                                          \
+    _cvec_##name##_kernel(self, out);                                          \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  int cvec_##name(lua_State *L) {                                              \
+    ComplexVector *self = luaL_checkudata(L, 1, complex_mt_name);              \
+    ComplexVector *out = _cvec_push_new(L, self->len);                         \
+    _cvec_##name##_kernel(self, out);                                          \
+    return 1;                                                                  \
+  }
+
+def_cvec_unop(neg, -xr, -xi);
+def_cvec_unop(conj, xr, -xi);
+def_cvec_unop(exp, exp(xr) * cos(xi), exp(xr) * sin(xi));
+
+// functions from complex to real vectors
+#define def_cvec_realop(name, expr)                                            \
+  int cvec_##name##_into(lua_State *L) {                                       \
+    ComplexVector *self = luaL_checkudata(L, 1, complex_mt_name);              \
+    Vector *out = _vec_check_out(L, 2);                                        \
+    if (out->len != self->len) {                                               \
+      return luaL_error(                                                       \
+        L,                                                                     \
+        "Vectors must have the same length (%d != %d)",                        \
+        self->len,                                                             \
+        out->len);                                                             \
+    }                                                                          \
+    lua_settop(L, 2);                                                          \
+    for (lua_Integer i = 0; i < self->len; i++) {                              \
+      lua_Number xr = self->re[i], xi = self->im[i];                           \
+      out->values[i] = (expr);                                                 \
+    }                                                                          \
+    return 1;                                                                  \
+  }                                                                            \
+                                                                               \
+  int cvec_##name(lua_State *L) {                                              \
+    ComplexVector *self = luaL_checkudata(L, 1, complex_mt_name);              \
+    Vector *out = _vec_push_new(L, self->len);                                 \
+    for (lua_Integer i = 0; i < self->len; i++) {                              \
+      lua_Number xr = self->re[i], xi = self->im[i];                           \
+      out->values[i] = (expr);                                                 \
+    }                                                                          \
+    return 1;                                                                  \
+  }
+
+def_cvec_realop(abs, sqrt(xr * xr + xi * xi));
+def_cvec_realop(abs2, xr * xr + xi * xi);
+def_cvec_realop(arg, atan2(xi, xr));
+
+int cvec__index(lua_State *L) {
+  if (lua_isinteger(L, 2)) {
+    return cvec_at(L);
+  } else {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+  }
+}
+
+int cvec__len(lua_State *L) {
+  ComplexVector *c = luaL_checkudata(L, 1, complex_mt_name);
+  lua_pushinteger(L, c->len);
+  return 1;
+}
+
+int cvec__tostring(lua_State *L) {
+  ComplexVector *c = luaL_checkudata(L, 1, complex_mt_name);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+
+  luaL_addstring(&b, "[");
+  for (lua_Integer i = 0; i < c->len; i++) {
+    _vec_addnumber(&b, c->re[i]);
+    luaL_addstring(&b, c->im[i] < 0 ? "-" : "+");
+    _vec_addnumber(&b, fabs(c->im[i]));
+    luaL_addstring(&b, i < c->len - 1 ? "i, " : "i");
+  }
+  luaL_addstring(&b, "]");
+  luaL_pushresult(&b);
+  return 1;
+}
+
+int cvec__gc(lua_State *L) {
+  ComplexVector *c = luaL_checkudata(L, 1, complex_mt_name);
+  free(c->re);
+  return 0;
+}
+
+static const luaL_Reg cvec_methods[] = {
+  {"real", &cvec_real},
+  {"imag", &cvec_imag},
+  {"at", &cvec_at},
+  {"set", &cvec_set},
+  {"len", &cvec__len},
+  {"dup", &cvec_dup},
+  {"add", &cvec_add},
+  {"add_", &cvec_add_into},
+  {"sub", &cvec_sub},
+  {"sub_", &cvec_sub_into},
+  {"mul", &cvec_mul},
+  {"mul_", &cvec_mul_into},
+  {"div", &cvec_div},
+  {"div_", &cvec_div_into},
+  {"neg", &cvec_neg},
+  {"neg_", &cvec_neg_into},
+  {"conj", &cvec_conj},
+  {"conj_", &cvec_conj_into},
+  {"exp", &cvec_exp},
+  {"exp_", &cvec_exp_into},
+  {"abs", &cvec_abs},
+  {"abs_", &cvec_abs_into},
+  {"abs2", &cvec_abs2},
+  {"abs2_", &cvec_abs2_into},
+  {"arg", &cvec_arg},
+  {"arg_", &cvec_arg_into},
+  {NULL, NULL}};
+
+static const luaL_Reg cvec_mt_funcs[] = {
+  {"__index", &cvec__index},
+  {"__len", &cvec__len},
+  {"__tostring", &cvec__tostring},
+  {"__gc", &cvec__gc},
+  {"__add", &cvec_add},
+  {"__sub", &cvec_sub},
+  {"__mul", &cvec_mul},
+  {"__div", &cvec_div},
+  {"__unm", &cvec_neg},
+  {NULL, NULL}};
+
+void create_complex_metatable(lua_State *L) {
+  luaL_newmetatable(L, complex_mt_name);
+  luaL_newlib(L, cvec_methods);
+  luaL_setfuncs(L, cvec_mt_funcs, 1);
+  lua_pop(L, 1);
+}
+
+const char sparse_mt_name[] = "sparse_vector";
+
+typedef struct SparseVector {
+  lua_Integer len;      // logical (dense) length
+  lua_Integer nnz;      // number of stored elements
+  lua_Integer capacity; // allocated slots in idx and values
+  lua_Integer *idx;     // 0-based positions, strictly increasing
+  lua_Number *values;
+} SparseVector;
+
+static SparseVector *
+_svec_push_new(lua_State *L, lua_Integer len, lua_Integer capacity) {
+  if (len < 0) {
+    luaL_error(L, "Expected non-negative integer for size, got %d", len);
+  }
+
+  SparseVector *s = newudata(L, sizeof(*s));
+  memset(s, 0, sizeof(*s));
+  setmetatable(L, sparse_mt_name);
+
+  if (capacity < 1) {
+    capacity = 1;
+  }
+  s->idx = malloc(capacity * sizeof(*s->idx));
+  s->values = malloc(capacity * sizeof(*s->values));
+  if (s->idx == NULL || s->values == NULL) {
+    luaL_error(L, "Could not allocate sparse vector");
+  }
+  s->len = len;
+  s->capacity = capacity;
+  return s;
+}
+
+static void _svec_reserve(lua_State *L, SparseVector *s, lua_Integer needed) {
+  if (needed <= s->capacity) {
+    return;
+  }
+  lua_Integer capacity = s->capacity;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+
+  lua_Integer *idx = realloc(s->idx, capacity * sizeof(*idx));
+  if (idx == NULL) {
+    luaL_error(L, "Could not grow sparse vector");
+  }
+  s->idx = idx;
+  lua_Number *values = realloc(s->values, capacity * sizeof(*values));
+  if (values == NULL) {
+    luaL_error(L, "Could not grow sparse vector");
+  }
+  s->values = values;
+  s->capacity = capacity;
+}
+
+static inline lua_Integer _svec_find(const SparseVector *s, lua_Integer i) {
+  // position of the first stored index >= i
+  lua_Integer lo = 0, hi = s->nnz;
+  while (lo < hi) {
+    lua_Integer mid = lo + (hi - lo) / 2;
+    if (s->idx[mid] < i) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+int vec_sparse(lua_State *L) {
+  lua_Integer len = luaL_checkinteger(L, 1);
+  lua_Integer capacity = luaL_optinteger(L, 2, 8);
+  _svec_push_new(L, len, capacity);
+  return 1;
+}
+
+int vec_fromdense(lua_State *L) {
+  Vector *v = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number tol = luaL_optnumber(L, 2, 0);
+
+  // written so that NaNs are kept
+  lua_Integer nnz = 0;
+  for (lua_Integer i = 0; i < v->len; i++) {
+    nnz += !(fabs(v->values[i]) <= tol);
+  }
+
+  SparseVector *s = _svec_push_new(L, v->len, nnz);
+  for (lua_Integer i = 0; i < v->len; i++) {
+    if (!(fabs(v->values[i]) <= tol)) {
+      s->idx[s->nnz] = i;
+      s->values[s->nnz] = v->values[i];
+      s->nnz++;
+    }
+  }
+  return 1;
+}
+
+int svec_at(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_Integer i = luaL_checkinteger(L, 2) - 1;
+  _vec_check_oob(L, i, s->len);
+
+  lua_Integer k = _svec_find(s, i);
+  lua_pushnumber(L, (k < s->nnz && s->idx[k] == i) ? s->values[k] : 0);
+  return 1;
+}
+
+int svec_set(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_Integer i = luaL_checkinteger(L, 2) - 1;
+  lua_Number x = luaL_checknumber(L, 3);
+  _vec_check_oob(L, i, s->len);
+
+  // appending in index order is the common case and costs O(1)
+  lua_Integer k =
+    (s->nnz == 0 || s->idx[s->nnz - 1] < i) ? s->nnz : _svec_find(s, i);
+  bool present = k < s->nnz && s->idx[k] == i;
+
+  if (x == 0) {
+    // explicit zeros are not stored
+    if (present) {
+      memmove(
+        s->idx + k, s->idx + k + 1, (s->nnz - k - 1) * sizeof(*s->idx));
+      memmove(
+        s->values + k,
+        s->values + k + 1,
+        (s->nnz - k - 1) * sizeof(*s->values));
+      s->nnz--;
+    }
+  } else if (present) {
+    s->values[k] = x;
+  } else {
+    _svec_reserve(L, s, s->nnz + 1);
+    memmove(s->idx + k + 1, s->idx + k, (s->nnz - k) * sizeof(*s->idx));
+    memmove(
+      s->values + k + 1, s->values + k, (s->nnz - k) * sizeof(*s->values));
+    s->idx[k] = i;
+    s->values[k] = x;
+    s->nnz++;
+  }
+
+  lua_settop(L, 1);
+  return 1;
+}
+
+int svec_nnz(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_pushinteger(L, s->nnz);
+  return 1;
+}
+
+static inline void
+_svec_todense_into(lua_State *L, const SparseVector *s, Vector *out) {
+  if (out->len != s->len) {
+    luaL_error(
+      L, "Vectors must have the same length (%d != %d)", s->len, out->len);
+  }
+  memset(out->values, 0, out->len * sizeof(lua_Number));
+  for (lua_Integer k = 0; k < s->nnz; k++) {
+    out->values[s->idx[k]] = s->values[k];
+  }
+}
+
+int svec_todense_into(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  Vector *out = _vec_check_out(L, 2);
+  lua_settop(L, 2);
+  _svec_todense_into(L, s, out);
+  return 1;
+}
+
+int svec_todense(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  Vector *new = _vec_push_new(L, s->len);
+  _svec_todense_into(L, s, new);
+  return 1;
+}
+
+int svec_dot(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_Number total = 0;
+  Vector *v = testudata(L, 2, vector_mt_name);
+
+  if (v != NULL) {
+    if (v->len != s->len) {
+      return luaL_error(
+        L, "Vectors must have the same length (%d != %d)", s->len, v->len);
+    }
+    for (lua_Integer k = 0; k < s->nnz; k++) {
+      total += s->values[k] * v->values[s->idx[k]];
+    }
+  } else {
+    SparseVector *t = luaL_checkudata(L, 2, sparse_mt_name);
+    if (t->len != s->len) {
+      return luaL_error(
+        L, "Vectors must have the same length (%d != %d)", s->len, t->len);
+    }
+    // merge walk over both sorted index lists
+    lua_Integer a = 0, b = 0;
+    while (a < s->nnz && b < t->nnz) {
+      lua_Integer ia = s->idx[a], ib = t->idx[b];
+      if (ia == ib) {
+        total += s->values[a] * t->values[b];
+      }
+      a += ia <= ib;
+      b += ib <= ia;
+    }
+  }
+
+  lua_pushnumber(L, total);
+  return 1;
+}
+
+int svec_axpy_into(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_Number a = luaL_checknumber(L, 2);
+  Vector *y = _vec_check_out(L, 3);
+  if (y->len != s->len) {
+    return luaL_error(
+      L, "Vectors must have the same length (%d != %d)", s->len, y->len);
+  }
+  lua_settop(L, 3);
+
+  for (lua_Integer k = 0; k < s->nnz; k++) {
+    y->values[s->idx[k]] += a * s->values[k];
+  }
+  return 1;
+}
+
+int svec_scale_into(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_Number a = luaL_checknumber(L, 2);
+  for (lua_Integer k = 0; k < s->nnz; k++) {
+    s->values[k] *= a;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+int svec_norm2(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_Number total = 0;
+  for (lua_Integer k = 0; k < s->nnz; k++) {
+    total += s->values[k] * s->values[k];
+  }
+  lua_pushnumber(L, total);
+  return 1;
+}
+
+int svec_norm(lua_State *L) {
+  svec_norm2(L);
+  lua_pushnumber(L, sqrt(lua_tonumber(L, -1)));
+  return 1;
+}
+
+int svec_sum(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_Number total = 0;
+  for (lua_Integer k = 0; k < s->nnz; k++) {
+    total += s->values[k];
+  }
+  lua_pushnumber(L, total);
+  return 1;
+}
+
+static inline int _svec_iter_closure(lua_State *L) {
+  SparseVector *s = lua_touserdata(L, 1);
+  lua_Integer k = lua_tointeger(L, lua_upvalueindex(1));
+  if (k >= s->nnz) {
+    return 0;
+  }
+  lua_pushinteger(L, k + 1);
+  lua_replace(L, lua_upvalueindex(1));
+  lua_pushinteger(L, s->idx[k] + 1);
+  lua_pushnumber(L, s->values[k]);
+  return 2;
+}
+
+int svec_iter(lua_State *L) {
+  luaL_checkudata(L, 1, sparse_mt_name);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, &_svec_iter_closure, 1);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+int svec__index(lua_State *L) {
+  if (lua_isinteger(L, 2)) {
+    return svec_at(L);
+  } else {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+  }
+}
+
+int svec__newindex(lua_State *L) {
+  svec_set(L);
+  return 0;
+}
+
+int svec__len(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  lua_pushinteger(L, s->len);
+  return 1;
+}
+
+int svec__tostring(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+
+  char ibuf[VEC_INTEGER_BUFSIZE];
+  lua_pushfstring(L, "sparse(%s){", _vec_integer_str(ibuf, s->len));
+  luaL_addvalue(&b);
+  for (lua_Integer k = 0; k < s->nnz; k++) {
+    lua_pushfstring(
+      L,
+      k > 0 ? ", [%s]=" : "[%s]=",
+      _vec_integer_str(ibuf, s->idx[k] + 1));
+    luaL_addvalue(&b);
+    _vec_addnumber(&b, s->values[k]);
+  }
+  luaL_addstring(&b, "}");
+  luaL_pushresult(&b);
+  return 1;
+}
+
+int svec__gc(lua_State *L) {
+  SparseVector *s = luaL_checkudata(L, 1, sparse_mt_name);
+  free(s->idx);
+  free(s->values);
+  return 0;
+}
+
+static const luaL_Reg svec_methods[] = {
+  {"at", &svec_at},
+  {"set", &svec_set},
+  {"len", &svec__len},
+  {"nnz", &svec_nnz},
+  {"iter", &svec_iter},
+  {"todense", &svec_todense},
+  {"todense_", &svec_todense_into},
+  {"dot", &svec_dot},
+  {"inner", &svec_dot},
+  {"axpy_", &svec_axpy_into},
+  {"scale_", &svec_scale_into},
+  {"sum", &svec_sum},
+  {"norm", &svec_norm},
+  {"norm2", &svec_norm2},
+  {NULL, NULL}};
+
+static const luaL_Reg svec_mt_funcs[] = {
+  {"__index", &svec__index},
+  {"__newindex", &svec__newindex},
+  {"__len", &svec__len},
+  {"__tostring", &svec__tostring},
+  {"__gc", &svec__gc},
+  {NULL, NULL}};
+
+void create_sparse_metatable(lua_State *L) {
+  luaL_newmetatable(L, sparse_mt_name);
+  luaL_newlib(L, svec_methods);
+  luaL_setfuncs(L, svec_mt_funcs, 1);
+  lua_pop(L, 1);
+}
+
+const char shm_mt_name[] = "vector_shm";
+
+#define SHM_MAGIC 0x6d68732d63657600ULL // "\0vec-shm"
+#define SHM_HEADER_SIZE 64
+#define SHM_NAME_MAX 256
+
+// at the start of every shared memory vector, before the values
+typedef struct ShmHeader {
+  uint64_t magic;
+  uint64_t numbersize;
+  lua_Integer len;
+  int64_t seq; // bumped by publishers, atomically
+} ShmHeader;
+
+// owner of the mapping behind shared memory vectors
+typedef struct SharedSegment {
+  void *base;
+  size_t size;
+  bool unlink; // the creator removes the name once collected
+  char name[SHM_NAME_MAX];
+} SharedSegment;
+
+static SharedSegment *_shm_push_segment(lua_State *L, const char *name) {
+  size_t len = strlen(name);
+  bool slash = name[0] == '/';
+  if (len == 0 || len + !slash >= SHM_NAME_MAX) {
+    luaL_error(L, "Invalid shared memory name \"%s\"", name);
+  }
+
+  SharedSegment *seg = newudata(L, sizeof(*seg));
+  seg->base = NULL;
+  seg->size = 0;
+  seg->unlink = false;
+  seg->name[0] = '/';
+  memcpy(seg->name + !slash, name, len + 1);
+  setmetatable(L, shm_mt_name);
+  return seg;
+}
+
+static inline lua_Number *_shm_values(const SharedSegment *seg) {
+  return (lua_Number *)((char *)seg->base + SHM_HEADER_SIZE);
+}
+
+static SharedSegment *_shm_check_vector(lua_State *L, int idx) {
+  luaL_checkudata(L, idx, vector_mt_name);
+  lua_getfield(L, LUA_REGISTRYINDEX, vector_views_key);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  SharedSegment *seg = testudata(L, -1, shm_mt_name);
+  lua_pop(L, 2);
+  if (seg == NULL) {
+    luaL_error(L, "Vector is not in shared memory");
+  }
+  return seg;
+}
+
+int vec_shm_create(lua_State *L) {
+#ifdef VECTORIZE_HAVE_SHM
+  const char *name = luaL_checkstring(L, 1);
+  lua_Integer len = luaL_checkinteger(L, 2);
+  if (len < 0 ||
+      (uint64_t)len > (SIZE_MAX - SHM_HEADER_SIZE) / sizeof(lua_Number)) {
+    return luaL_error(L, "Invalid shared memory vector length %d", len);
+  }
+  SharedSegment *seg = _shm_push_segment(L, name);
+  size_t size = SHM_HEADER_SIZE + len * sizeof(lua_Number);
+
+  int fd = shm_open(seg->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    return luaL_error(
+      L,
+      "Could not create shared memory %s.\n"
+      "errno: %d\n"
+      "%s",
+      seg->name,
+      errno,
+      strerror(errno));
+  }
+  seg->unlink = true;
+
+  void *base = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  int err = errno;
+  close(fd);
+  if (base == MAP_FAILED) {
+    return luaL_error(
+      L,
+      "Could not map shared memory %s.\n"
+      "errno: %d\n"
+      "%s",
+      seg->name,
+      err,
+      strerror(err));
+  }
+  seg->base = base;
+  seg->size = size;
+
+  // the new memory is already zero-filled
+  ShmHeader *header = seg->base;
+  header->magic = SHM_MAGIC;
+  header->numbersize = sizeof(lua_Number);
+  header->len = len;
+
+  _vec_push_view(L, _shm_values(seg), len, -1);
+  return 1;
+
+#else
+  return luaL_error(L, "Shared memory vectors are not supported here");
+
+#endif
+}
+
+int vec_shm_open(lua_State *L) {
+#ifdef VECTORIZE_HAVE_SHM
+  const char *name = luaL_checkstring(L, 1);
+  SharedSegment *seg = _shm_push_segment(L, name);
+
+  int fd = shm_open(seg->name, O_RDWR, 0);
+  if (fd < 0) {
+    return luaL_error(
+      L,
+      "Could not open shared memory %s.\n"
+      "errno: %d\n"
+      "%s",
+      seg->name,
+      errno,
+      strerror(errno));
+  }
+
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= SHM_HEADER_SIZE) {
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  int err = errno;
+  close(fd);
+  if (base == MAP_FAILED) {
+    return luaL_error(
+      L,
+      "Could not map shared memory %s.\n"
+      "errno: %d\n"
+      "%s",
+      seg->name,
+      err,
+      strerror(err));
+  }
+  seg->base = base;
+  seg->size = st.st_size;
+
+  const ShmHeader *header = seg->base;
+  if (header->magic != SHM_MAGIC) {
+    return luaL_error(L, "%s is not a shared memory vector", seg->name);
+  } else if (header->numbersize != sizeof(lua_Number)) {
+    return luaL_error(
+      L,
+      "Incompatible shared memory vector: lua_Number size is %d, expected %d",
+      (int)header->numbersize,
+      (int)sizeof(lua_Number));
+  } else if (
+    header->len < 0 ||
+    (uint64_t)header->len >
+      (seg->size - SHM_HEADER_SIZE) / sizeof(lua_Number)) {
+    return luaL_error(L, "Corrupted shared memory vector %s", seg->name);
+  }
+
+  _vec_push_view(L, _shm_values(seg), header->len, -1);
+  return 1;
+
+#else
+  return luaL_error(L, "Shared memory vectors are not supported here");
+
+#endif
+}
+
+int vec_shm_publish(lua_State *L) {
+  SharedSegment *seg = _shm_check_vector(L, 1);
+  ShmHeader *header = seg->base;
+  lua_pushinteger(L, (lua_Integer)atomic_add64(&header->seq, 1));
+  return 1;
+}
+
+int vec_shm_seq(lua_State *L) {
+  SharedSegment *seg = _shm_check_vector(L, 1);
+  ShmHeader *header = seg->base;
+  lua_pushinteger(L, (lua_Integer)atomic_load64(&header->seq));
+  return 1;
+}
+
+int shm__gc(lua_State *L) {
+#ifdef VECTORIZE_HAVE_SHM
+  SharedSegment *seg = luaL_checkudata(L, 1, shm_mt_name);
+  if (seg->base != NULL) {
+    munmap(seg->base, seg->size);
+    seg->base = NULL;
+  }
+  if (seg->unlink) {
+    shm_unlink(seg->name);
+    seg->unlink = false;
+  }
+
+#endif
+  return 0;
+}
+
+void create_shm_metatable(lua_State *L) {
+  luaL_newmetatable(L, shm_mt_name);
+  lua_pushcfunction(L, &shm__gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
+
+const char vector_lib_key[] = "vector_lib";
+
+// upvalue of every function registered through the extension interface
+typedef struct ExtKernel {
+  vec_map_kernel map;
+  vec_zip_kernel zip;
+  vec_reduce_kernel reduce;
+  lua_Number init;
+  void *ud;
+} ExtKernel;
+
+static inline lua_Integer _ext_chunk_len(lua_Integer start, lua_Integer len) {
+  lua_Integer count = len - start;
+  return count > VEC_EXT_CHUNK_SIZE ? VEC_EXT_CHUNK_SIZE : count;
+}
+
+static int _ext_collect_args(lua_State *L, int first, lua_Number *args) {
+  int nargs = 0;
+  while (lua_type(L, first + nargs) == LUA_TNUMBER) {
+    if (nargs == VEC_EXT_MAX_ARGS) {
+      luaL_error(L, "Too many arguments (at most %d)", VEC_EXT_MAX_ARGS);
+    }
+    args[nargs] = lua_tonumber(L, first + nargs);
+    nargs++;
+  }
+  return nargs;
+}
+
+static void _ext_run_map(
+  const ExtKernel *k,
+  const Vector *x,
+  Vector *out,
+  const lua_Number *args,
+  int nargs) {
+  for (lua_Integer start = 0; start < x->len; start += VEC_EXT_CHUNK_SIZE) {
+    k->map(
+      x->values + start,
+      out->values + start,
+      _ext_chunk_len(start, x->len),
+      args,
+      nargs,
+      k->ud);
+  }
+}
+
+static void _ext_run_zip(
+  const ExtKernel *k,
+  const Vector *x,
+  const Vector *y,
+  Vector *out,
+  const lua_Number *args,
+  int nargs) {
+  for (lua_Integer start = 0; start < x->len; start += VEC_EXT_CHUNK_SIZE) {
+    k->zip(
+      x->values + start,
+      y->values + start,
+      out->values + start,
+      _ext_chunk_len(start, x->len),
+      args,
+      nargs,
+      k->ud);
+  }
+}
+
+static int ext_map(lua_State *L) {
+  const ExtKernel *k = lua_touserdata(L, lua_upvalueindex(1));
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number args[VEC_EXT_MAX_ARGS];
+  int nargs = _ext_collect_args(L, 2, args);
+
+  Vector *new = _vec_push_new(L, self->len);
+  _ext_run_map(k, self, new, args, nargs);
+  return 1;
+}
+
+static int ext_map_into(lua_State *L) {
+  const ExtKernel *k = lua_touserdata(L, lua_upvalueindex(1));
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number args[VEC_EXT_MAX_ARGS];
+  int nargs = _ext_collect_args(L, 2, args);
+  int outidx = 2 + nargs;
+  Vector *out;
+
+  if (lua_gettop(L) >= outidx) {
+    out = _vec_check_out(L, outidx);
+    _vec_check_same_len(L, self, out);
+    lua_settop(L, outidx);
+  } else {
+    out = _vec_check_writable(L, self);
+    lua_pushvalue(L, 1);
+  }
+  _ext_run_map(k, self, out, args, nargs);
+  return 1;
+}
+
+static int ext_zip(lua_State *L) {
+  const ExtKernel *k = lua_touserdata(L, lua_upvalueindex(1));
+  Vector *x = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *y = luaL_checkudata(L, 2, vector_mt_name);
+  lua_Number args[VEC_EXT_MAX_ARGS];
+  int nargs = _ext_collect_args(L, 3, args);
+  _vec_check_same_len(L, x, y);
+
+  Vector *new = _vec_push_new(L, x->len);
+  _ext_run_zip(k, x, y, new, args, nargs);
+  return 1;
+}
+
+static int ext_zip_into(lua_State *L) {
+  const ExtKernel *k = lua_touserdata(L, lua_upvalueindex(1));
+  Vector *x = luaL_checkudata(L, 1, vector_mt_name);
+  Vector *y = luaL_checkudata(L, 2, vector_mt_name);
+  lua_Number args[VEC_EXT_MAX_ARGS];
+  int nargs = _ext_collect_args(L, 3, args);
+  int outidx = 3 + nargs;
+  Vector *out;
+  _vec_check_same_len(L, x, y);
+
+  if (lua_gettop(L) >= outidx) {
+    out = _vec_check_out(L, outidx);
+    _vec_check_same_len(L, x, out);
+    lua_settop(L, outidx);
+  } else {
+    out = _vec_check_writable(L, x);
+    lua_pushvalue(L, 1);
+  }
+  _ext_run_zip(k, x, y, out, args, nargs);
+  return 1;
+}
+
+static int ext_reduce(lua_State *L) {
+  const ExtKernel *k = lua_touserdata(L, lua_upvalueindex(1));
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number args[VEC_EXT_MAX_ARGS];
+  int nargs = _ext_collect_args(L, 2, args);
+
+  lua_Number acc = k->init;
+  for (lua_Integer start = 0; start < self->len;
+       start += VEC_EXT_CHUNK_SIZE) {
+    acc = k->reduce(
+      self->values + start,
+      _ext_chunk_len(start, self->len),
+      acc,
+      args,
+      nargs,
+      k->ud);
+  }
+  lua_pushnumber(L, acc);
+  return 1;
+}
+
+static ExtKernel *_ext_push_kernel(lua_State *L) {
+  ExtKernel *k = newudata(L, sizeof(*k));
+  memset(k, 0, sizeof(*k));
+  return k;
+}
+
+static void _ext_register(
+  lua_State *L, const char *name, lua_CFunction f, lua_CFunction f_into) {
+  // expects the kernel userdata on top of the stack, and pops it
+  lua_getfield(L, LUA_REGISTRYINDEX, vector_lib_key);
+
+  lua_pushvalue(L, -2);
+  lua_pushcclosure(L, f, 1);
+  lua_setfield(L, -2, name);
+
+  if (f_into != NULL) {
+    lua_pushfstring(L, "%s_", name);
+    lua_pushvalue(L, -3);
+    lua_pushcclosure(L, f_into, 1);
+    lua_rawset(L, -3);
+  }
+  lua_pop(L, 2);
+}
+
+static void _ext_register_map(
+  lua_State *L, const char *name, vec_map_kernel kernel, void *ud) {
+  ExtKernel *k = _ext_push_kernel(L);
+  k->map = kernel;
+  k->ud = ud;
+  _ext_register(L, name, &ext_map, &ext_map_into);
+}
+
+static void _ext_register_zip(
+  lua_State *L, const char *name, vec_zip_kernel kernel, void *ud) {
+  ExtKernel *k = _ext_push_kernel(L);
+  k->zip = kernel;
+  k->ud = ud;
+  _ext_register(L, name, &ext_zip, &ext_zip_into);
+}
+
+static void _ext_register_reduce(
+  lua_State *L,
+  const char *name,
+  vec_reduce_kernel kernel,
+  lua_Number init,
+  void *ud) {
+  ExtKernel *k = _ext_push_kernel(L);
+  k->reduce = kernel;
+  k->init = init;
+  k->ud = ud;
+  _ext_register(L, name, &ext_reduce, NULL);
+}
+
+static Vector *_ext_check_vector(lua_State *L, int idx) {
+  return luaL_checkudata(L, idx, vector_mt_name);
+}
+
+static Vector *_ext_push_vector(lua_State *L, lua_Integer len) {
+  return _vec_push_new(L, len);
+}
+
+static const VecExtAPI ext_api = {
+  VEC_EXT_ABI_VERSION,
+  &_ext_register_map,
+  &_ext_register_zip,
+  &_ext_register_reduce,
+  &_ext_check_vector,
+  &_ext_push_vector,
+};
+
+static void register_ext_api(lua_State *L) {
+  // expects the library table on top of the stack
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, vector_lib_key);
+  lua_pushlightuserdata(L, (void *)&ext_api);
+  lua_setfield(L, LUA_REGISTRYINDEX, VEC_EXT_API_KEY);
+}
+
+const char graph_mt_name[] = "vector_graph";
+const char vector_graph_refs_key[] = "vector_graph_refs";
+const char vector_recording_key[] = "vector_recording";
+
+// elements per pass when consecutive ops are fused; small enough that every
+// vector touched by the group stays in L1 between ops
+#define GRAPH_TILE 512
+
+typedef struct GraphOp GraphOp;
+
+typedef void (*graph_kernel)(
+  const GraphOp *op, lua_Integer start, lua_Integer n);
+
+typedef void (*graph_map_kernel)(
+  const lua_Number *x, lua_Number *out, lua_Integer n);
+
+struct GraphOp {
+  graph_kernel kernel;
+  graph_map_kernel map;
+  Vector *x;
+  Vector *y;
+  Vector *out;
+  lua_Number s;
+  lua_Integer len; // length of every operand at recording time
+};
+
+typedef struct Graph {
+  GraphOp *ops;
+  size_t nops;
+  size_t capacity;
+  bool fuse;
+  bool recording;
+} Graph;
+
+static void _graph_map(const GraphOp *op, lua_Integer start, lua_Integer n) {
+  op->map(op->x->values + start, op->out->values + start, n);
+}
+
+#define def_graph_kernel(name, expr)                                           \
+  static void _graph_##name(                                                   \
+    const GraphOp *op, lua_Integer start, lua_Integer n) {                     \
+    const lua_Number *x = op->x->values + start;                               \
+    const lua_Number *y = op->y != NULL ? op->y->values + start : NULL;        \
+    lua_Number *out = op->out->values + start;                                 \
+    lua_Number s = op->s;                                                      \
+    (void)x;                                                                   \
+    (void)y;                                                                   \
+    (void)s;                                                                   \
+    for (lua_Integer i = 0; i < n; i++) {                                      \
+      out[i] = (expr);                                                         \
+    }                                                                          \
+  }
+
+#define def_graph_binop(name, op)                                              \
+  def_graph_kernel(name##_vv, x[i] op y[i]);                                   \
+  def_graph_kernel(name##_vs, x[i] op s);                                      \
+  def_graph_kernel(name##_sv, s op x[i])
+
+def_graph_binop(add, +);
+def_graph_binop(sub, -);
+def_graph_binop(mul, *);
+def_graph_binop(div, /);
+def_graph_kernel(pow_vv, pow(x[i], y[i]));
+def_graph_kernel(pow_vs, pow(x[i], s));
+def_graph_kernel(pow_sv, pow(s, x[i]));
+def_graph_kernel(psy, x[i] + s * y[i]);
+def_graph_kernel(neg, -x[i]);
+def_graph_kernel(copy, x[i]);
+def_graph_kernel(zero, 0);
+
+static const struct {
+  const char *name;
+  graph_map_kernel kernel;
+} graph_maps[] = {
+  {"sq_", &_vec_sq_kernel},
+  {"square_", &_vec_sq_kernel},
+  {"cb_", &_vec_cb_kernel},
+  {"cube_", &_vec_cb_kernel},
+  {"sqrt_", &_vec_sqrt_kernel},
+  {"cbrt_", &_vec_cbrt_kernel},
+  {"reciproc_", &_vec_reciproc_kernel},
+  {"exp_", &_vec_exp_kernel},
+  {"ln_", &_vec_ln_kernel},
+  {"ln1p_", &_vec_ln1p_kernel},
+  {"sin_", &_vec_sin_kernel},
+  {"sinh_", &_vec_sinh_kernel},
+  {"asin_", &_vec_asin_kernel},
+  {"asinh_", &_vec_asinh_kernel},
+  {"cos_", &_vec_cos_kernel},
+  {"cosh_", &_vec_cosh_kernel},
+  {"acos_", &_vec_acos_kernel},
+  {"acosh_", &_vec_acosh_kernel},
+  {"tan_", &_vec_tan_kernel},
+  {"tanh_", &_vec_tanh_kernel},
+  {"atan_", &_vec_atan_kernel},
+  {"atanh_", &_vec_atanh_kernel},
+  {"isnan_", &_vec_isnan_kernel},
+  {"isfinite_", &_vec_isfinite_kernel},
+  {NULL, NULL}};
+
+static const struct {
+  const char *name;
+  graph_kernel vv, vs, sv;
+} graph_ariths[] = {
+  {"add_", &_graph_add_vv, &_graph_add_vs, &_graph_add_sv},
+  {"sub_", &_graph_sub_vv, &_graph_sub_vs, &_graph_sub_sv},
+  {"mul_", &_graph_mul_vv, &_graph_mul_vs, &_graph_mul_sv},
+  {"div_", &_graph_div_vv, &_graph_div_vs, &_graph_div_sv},
+  {"pow_", &_graph_pow_vv, &_graph_pow_vs, &_graph_pow_sv},
+  {NULL, NULL, NULL, NULL}};
+
+/*
+ * Append an op reading the vectors at stack indices x and y (0 if unused) and
+ * writing the one at out, which is left on top of the stack as the result of
+ * the recorded call. Every operand is referenced by the graph, so their
+ * memory stays valid for as long as it can be run.
+ */
+static GraphOp *_graph_push_op(
+  lua_State *L, graph_kernel kernel, lua_Number s, int x, int y, int out) {
+  Graph *g = lua_touserdata(L, lua_upvalueindex(1));
+  if (!g->recording) {
+    luaL_error(L, "Graph has already been recorded");
+  }
+
+  if (g->nops == g->capacity) {
+    size_t capacity = g->capacity > 0 ? 2 * g->capacity : 16;
+    GraphOp *ops = realloc(g->ops, capacity * sizeof(*ops));
+    if (ops == NULL) {
+      luaL_error(L, "Could not grow graph to %d ops", (int)capacity);
+    }
+    g->ops = ops;
+    g->capacity = capacity;
+  }
+
+  GraphOp *op = &g->ops[g->nops++];
+  op->kernel = kernel;
+  op->map = NULL;
+  op->x = x > 0 ? lua_touserdata(L, x) : NULL;
+  op->y = y > 0 ? lua_touserdata(L, y) : NULL;
+  op->out = lua_touserdata(L, out);
+  op->s = s;
+  op->len = op->out->len;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, vector_graph_refs_key);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_rawget(L, -2);
+  int operands[] = {x, y, out};
+  for (int i = 0; i < 3; i++) {
+    if (operands[i] > 0) {
+      lua_pushvalue(L, operands[i]);
+      lua_pushboolean(L, 1);
+      lua_rawset(L, -3);
+    }
+  }
+  lua_pop(L, 2);
+
+  lua_pushvalue(L, out);
+  return op;
+}
+
+static int graph_record_map(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  int out = 1;
+  if (lua_gettop(L) > 1) {
+    _vec_check_same_len(L, self, _vec_check_out(L, 2));
+    out = 2;
+  } else {
+    _vec_check_writable(L, self);
+  }
+
+  GraphOp *op = _graph_push_op(L, &_graph_map, 0, 1, 0, out);
+  op->map = graph_maps[lua_tointeger(L, lua_upvalueindex(2))].kernel;
+  return 1;
+}
+
+static int graph_record_arith(lua_State *L) {
+  int i = (int)lua_tointeger(L, lua_upvalueindex(2));
+  int out = 0;
+  if (lua_gettop(L) > 2) {
+    _vec_check_out(L, 3);
+    lua_settop(L, 3);
+    out = 3;
+  }
+
+  if (lua_isnumber(L, 1)) {
+    Vector *v = luaL_checkudata(L, 2, vector_mt_name);
+    if (out == 0) {
+      _vec_check_writable(L, v);
+      out = 2;
+    }
+    _vec_check_same_len(L, v, lua_touserdata(L, out));
+    _graph_push_op(L, graph_ariths[i].sv, lua_tonumber(L, 1), 2, 0, out);
+  } else if (lua_isnumber(L, 2)) {
+    Vector *v = luaL_checkudata(L, 1, vector_mt_name);
+    if (out == 0) {
+      _vec_check_writable(L, v);
+      out = 1;
+    }
+    _vec_check_same_len(L, v, lua_touserdata(L, out));
+    _graph_push_op(L, graph_ariths[i].vs, lua_tonumber(L, 2), 1, 0, out);
+  } else {
+    Vector *v1 = luaL_checkudata(L, 1, vector_mt_name);
+    Vector *v2 = luaL_checkudata(L, 2, vector_mt_name);
+    if (out == 0) {
+      _vec_check_writable(L, v1);
+      out = 1;
+    }
+    _vec_check_same_len(L, v1, v2);
+    _vec_check_same_len(L, v1, lua_touserdata(L, out));
+    _graph_push_op(L, graph_ariths[i].vv, 0, 1, 2, out);
+  }
+  return 1;
+}
+
+static int graph_record_psy(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number scalar = luaL_checknumber(L, 2);
+  Vector *other = luaL_checkudata(L, 3, vector_mt_name);
+  int out = 1;
+  if (lua_gettop(L) > 3) {
+    _vec_check_same_len(L, self, _vec_check_out(L, 4));
+    out = 4;
+  } else {
+    _vec_check_writable(L, self);
+  }
+  _vec_check_same_len(L, self, other);
+
+  _graph_push_op(L, &_graph_psy, scalar, 1, 3, out);
+  return 1;
+}
+
+static int graph_record_scale(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  lua_Number scalar = luaL_checknumber(L, 2);
+  int out = 1;
+  if (lua_gettop(L) > 2) {
+    _vec_check_same_len(L, self, _vec_check_out(L, 3));
+    out = 3;
+  } else {
+    _vec_check_writable(L, self);
+  }
+
+  _graph_push_op(L, &_graph_mul_vs, scalar, 1, 0, out);
+  return 1;
+}
+
+static int graph_record_neg(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  int out = 1;
+  if (lua_gettop(L) > 1) {
+    _vec_check_same_len(L, self, _vec_check_out(L, 2));
+    out = 2;
+  } else {
+    _vec_check_writable(L, self);
+  }
+
+  _graph_push_op(L, &_graph_neg, 0, 1, 0, out);
+  return 1;
+}
+
+static int graph_record_dup(lua_State *L) {
+  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
+  _vec_check_same_len(L, self, _vec_check_out(L, 2));
+
+  _graph_push_op(L, &_graph_copy, 0, 1, 0, 2);
+  return 1;
+}
+
+static int graph_record_reset(lua_State *L) {
+  _vec_check_out(L, 1);
+
+  _graph_push_op(L, &_graph_zero, 0, 1, 0, 1);
+  return 1;
+}
+
+static const luaL_Reg graph_recorders[] = {
+  {"psy_", &graph_record_psy},
+  {"scale_", &graph_record_scale},
+  {"neg_", &graph_record_neg},
+  {"dup_", &graph_record_dup},
+  {"reset", &graph_record_reset},
+  {NULL, NULL}};
+
+static int graph_record_unsupported(lua_State *L) {
+  return luaL_error(
+    L,
+    "%s cannot be recorded in a graph",
+    lua_tostring(L, lua_upvalueindex(1)));
+}
+
+static int graph_record_newindex(lua_State *L) {
+  return luaL_error(L, "Vector elements cannot be assigned in a graph");
+}
+
+static void
+_graph_install(lua_State *L, const char *name, lua_CFunction f, int i) {
+  // expects the graph, the library table and the table of replaced functions
+  // at stack indices 2, 3 and 4
+  lua_getfield(L, 3, name);
+  lua_setfield(L, 4, name);
+
+  lua_pushvalue(L, 2);
+  lua_pushinteger(L, i);
+  lua_pushcclosure(L, f, 2);
+  lua_setfield(L, 3, name);
+}
+
+int vec_record(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  bool fuse = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+  lua_settop(L, 1);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, vector_recording_key);
+  if (lua_toboolean(L, -1)) {
+    return luaL_error(L, "Already recording a graph");
+  }
+  lua_pop(L, 1);
+
+  Graph *g = newudata(L, sizeof(*g));
+  g->ops = NULL;
+  g->nops = 0;
+  g->capacity = 0;
+  g->fuse = fuse;
+  g->recording = true;
+  setmetatable(L, graph_mt_name);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, vector_graph_refs_key);
+  lua_pushvalue(L, 2);
+  lua_newtable(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  // swap the recordable functions in the library table for recorders, which
+  // also catches method calls since vectors index the same table
+  lua_getfield(L, LUA_REGISTRYINDEX, vector_lib_key);
+  lua_newtable(L);
+  for (int i = 0; graph_maps[i].name != NULL; i++) {
+    _graph_install(L, graph_maps[i].name, &graph_record_map, i);
+  }
+  for (int i = 0; graph_ariths[i].name != NULL; i++) {
+    _graph_install(L, graph_ariths[i].name, &graph_record_arith, i);
+  }
+  for (int i = 0; graph_recorders[i].name != NULL; i++) {
+    _graph_install(L, graph_recorders[i].name, graph_recorders[i].func, i);
+  }
+
+  // any other in-place call would run once now and be missing from every
+  // replay, so make those errors instead
+  lua_pushnil(L);
+  while (lua_next(L, 3) != 0) {
+    size_t len;
+    const char *name = lua_type(L, -2) == LUA_TSTRING
+                         ? lua_tolstring(L, -2, &len)
+                         : NULL;
+    lua_pop(L, 1);
+    if (name == NULL || len == 0 || name[len - 1] != '_') {
+      continue;
+    }
+    lua_pushvalue(L, -1);
+    lua_rawget(L, 4);
+    bool recordable = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (!recordable) {
+      // only existing fields are assigned, which lua_next allows
+      lua_pushvalue(L, -1);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, 3);
+      lua_rawset(L, 4);
+      lua_pushvalue(L, -1);
+      lua_pushvalue(L, -1);
+      lua_pushcclosure(L, &graph_record_unsupported, 1);
+      lua_rawset(L, 3);
+    }
+  }
+
+  // same for element assignment, through the metatable of vectors
+  luaL_getmetatable(L, vector_mt_name);
+  lua_getfield(L, 5, "__newindex");
+  lua_pushcfunction(L, &graph_record_newindex);
+  lua_setfield(L, 5, "__newindex");
+
+  lua_pushboolean(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, vector_recording_key);
+  lua_pushvalue(L, 1);
+  int status = lua_pcall(L, 0, 0, 0);
+  lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, vector_recording_key);
+  g->recording = false;
+
+  // put the original functions back, even if the recording failed
+  lua_pushvalue(L, 6);
+  lua_setfield(L, 5, "__newindex");
+  lua_pushnil(L);
+  while (lua_next(L, 4) != 0) {
+    lua_pushvalue(L, -2);
+    lua_insert(L, -2);
+    lua_rawset(L, 3);
+  }
+  if (status != 0) {
+    return lua_error(L);
+  }
+
+  lua_settop(L, 2);
+  return 1;
+}
+
+static void _graph_check_len(lua_State *L, const Vector *v, lua_Integer len) {
+  if (v != NULL && v->len != len) {
+    luaL_error(
+      L,
+      "Vector length changed from %d to %d since the graph was recorded",
+      len,
+      v->len);
+  }
+}
+
+static void _graph_exec(const Graph *g) {
+  size_t first = 0;
+  while (first < g->nops) {
+    // ops over vectors of the same length are fused into a single pass, each
+    // one running over a tile before moving on to the next tile
+    lua_Integer len = g->ops[first].len;
+    size_t last = first + 1;
+    if (g->fuse) {
+      while (last < g->nops && g->ops[last].len == len) {
+        last++;
+      }
+    }
+
+    lua_Integer tile = g->fuse ? GRAPH_TILE : len;
+    for (lua_Integer start = 0; start < len; start += tile) {
+      lua_Integer n = len - start < tile ? len - start : tile;
+      for (size_t i = first; i < last; i++) {
+        g->ops[i].kernel(&g->ops[i], start, n);
+      }
+    }
+    first = last;
+  }
+}
+
+int graph_run(lua_State *L) {
+  Graph *g = luaL_checkudata(L, 1, graph_mt_name);
+  lua_Integer n = luaL_optinteger(L, 2, 1);
+  if (g->recording) {
+    return luaL_error(L, "Cannot run a graph while it is being recorded");
+  } else if (n < 0) {
+    return luaL_error(L, "Expected non-negative repetition count, got %d", n);
+  }
+
+  // vectors may have been resized since recording, but nothing else can run
+  // while the graph does, so checking once is enough
+  for (size_t i = 0; i < g->nops; i++) {
+    const GraphOp *op = &g->ops[i];
+    _graph_check_len(L, op->x, op->len);
+    _graph_check_len(L, op->y, op->len);
+    _graph_check_len(L, op->out, op->len);
+  }
+
+  for (lua_Integer k = 0; k < n; k++) {
+    _graph_exec(g);
+  }
+  return 0;
+}
+
+int graph__len(lua_State *L) {
+  Graph *g = luaL_checkudata(L, 1, graph_mt_name);
+  lua_pushinteger(L, (lua_Integer)g->nops);
+  return 1;
+}
+
+int graph__tostring(lua_State *L) {
+  Graph *g = luaL_checkudata(L, 1, graph_mt_name);
+  lua_pushfstring(L, "graph(%d ops)", (int)g->nops);
+  return 1;
+}
+
+int graph__gc(lua_State *L) {
+  Graph *g = luaL_checkudata(L, 1, graph_mt_name);
+  free(g->ops);
+  g->ops = NULL;
+  return 0;
+}
+
+static const luaL_Reg graph_methods[] = {{"run", &graph_run}, {NULL, NULL}};
+
+static const luaL_Reg graph_mt_funcs[] = {
+  {"__len", &graph__len},
+  {"__tostring", &graph__tostring},
+  {"__gc", &graph__gc},
+  {NULL, NULL}};
+
+void create_graph_metatable(lua_State *L) {
+  luaL_newmetatable(L, graph_mt_name);
+  luaL_newlib(L, graph_methods);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, graph_mt_funcs, 0);
+  lua_pop(L, 1);
+
+  // graph -> set of the vectors its ops refer to
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushstring(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, vector_graph_refs_key);
+}
+
+const char index_mt_name[] = "vector_index";
+
+// rows are scanned in blocks of about this many bytes, so that a batched
+// search reuses each block for every query while it is still in cache
+#define INDEX_BLOCK_BYTES (1 << 18)
+
+typedef struct VectorIndex {
+  lua_Number *values; // count rows of dim numbers each, back to back
+  lua_Number *norm2;  // squared norm of each row
+  lua_Integer dim;
+  lua_Integer count;
+  lua_Integer capacity;
+} VectorIndex;
+
+typedef enum IndexMetric {
+  INDEX_COSINE = 0,
+  INDEX_DOT,
+  INDEX_L2,
+} IndexMetric;
+
+static const char *const index_metrics[] = {"cosine", "dot", "l2", NULL};
+
+typedef struct IndexHit {
+  lua_Number key; // larger is better for every metric
+  lua_Integer id;
+} IndexHit;
+
+typedef struct IndexQuery {
+  const lua_Number *values;
+  lua_Number norm2;
+  IndexHit *heap; // the best hits so far, with the worst one at the root
+  lua_Integer size;
+} IndexQuery;
+
+static lua_Number
+_vec_dot_span(const lua_Number *a, const lua_Number *b, lua_Integer n) {
+  // independent partial sums let the compiler keep several multiplies in
+  // flight, or pack them into vector registers
+  lua_Number s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  lua_Integer i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += a[i] * b[i];
+    s1 += a[i + 1] * b[i + 1];
+    s2 += a[i + 2] * b[i + 2];
+    s3 += a[i + 3] * b[i + 3];
+  }
+  for (; i < n; i++) {
+    s0 += a[i] * b[i];
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+static inline lua_Number _index_key(
+  IndexMetric metric, lua_Number dot, lua_Number norm2, lua_Number qnorm2) {
+  switch (metric) {
+  case INDEX_COSINE:
+    // product inside sqrt to avoid loss of precision; a NaN product must
+    // reach the key rather than score 0
+    return norm2 * qnorm2 == 0 ? 0 : dot / sqrt(norm2 * qnorm2);
+  case INDEX_DOT:
+    return dot;
+  default:
+    // |q|^2 is the same for every row, so it is only added back at the end
+    return 2 * dot - norm2;
+  }
+}
+
+static inline lua_Number
+_index_score(IndexMetric metric, lua_Number key, lua_Number qnorm2) {
+  if (metric == INDEX_L2) {
+    lua_Number dist2 = qnorm2 - key;
+    return dist2 < 0 ? 0 : sqrt(dist2);
+  }
+  return key;
+}
+
+// NaN keys rank below every number, so that hits stay totally ordered for
+// the heap and qsort
+static inline bool _index_better(IndexHit a, IndexHit b) {
+  return a.key > b.key || (a.key == b.key && a.id < b.id)
+         || (isnan(b.key) && (!isnan(a.key) || a.id < b.id));
+}
+
+static void _index_offer(IndexQuery *q, lua_Integer k, IndexHit hit) {
+  IndexHit *h = q->heap;
+  lua_Integer i;
+  if (q->size < k) {
+    i = q->size++;
+    while (i > 0 && _index_better(h[(i - 1) / 2], hit)) {
+      h[i] = h[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    h[i] = hit;
+  } else if (_index_better(hit, h[0])) {
+    i = 0;
+    for (;;) {
+      lua_Integer child = 2 * i + 1;
+      if (child >= k) {
+        break;
+      } else if (child + 1 < k && _index_better(h[child], h[child + 1])) {
+        child++;
+      }
+      if (!_index_better(hit, h[child])) {
+        break;
+      }
+      h[i] = h[child];
+      i = child;
+    }
+    h[i] = hit;
+  }
+}
+
+static int _index_hit_cmp(const void *a, const void *b) {
+  const IndexHit *x = a, *y = b;
+  return _index_better(*x, *y) ? -1 : _index_better(*y, *x);
+}
+
+static void _index_scan(
+  const VectorIndex *idx,
+  IndexQuery *queries,
+  lua_Integer nqueries,
+  lua_Integer k,
+  IndexMetric metric) {
+  lua_Integer block = INDEX_BLOCK_BYTES / (idx->dim * sizeof(lua_Number));
+  if (block < 1) {
+    block = 1;
+  }
+  if (k == 0) {
+    return;
+  }
+
+  for (lua_Integer start = 0; start < idx->count; start += block) {
+    lua_Integer end = start + block < idx->count ? start + block : idx->count;
+    for (lua_Integer j = 0; j < nqueries; j++) {
+      IndexQuery *q = &queries[j];
+      for (lua_Integer r = start; r < end; r++) {
+        lua_Number dot =
+          _vec_dot_span(idx->values + r * idx->dim, q->values, idx->dim);
+        IndexHit hit = {_index_key(metric, dot, idx->norm2[r], q->norm2), r};
+        _index_offer(q, k, hit);
+      }
+    }
+  }
+
+  for (lua_Integer j = 0; j < nqueries; j++) {
+    qsort(queries[j].heap, queries[j].size, sizeof(IndexHit), &_index_hit_cmp);
+  }
+}
+
+static void _index_reserve(lua_State *L, VectorIndex *idx, lua_Integer needed) {
+  if (needed <= idx->capacity) {
+    return;
+  }
+  lua_Integer capacity = idx->capacity > 0 ? idx->capacity : 16;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+
+  lua_Number *values =
+    realloc(idx->values, capacity * idx->dim * sizeof(*values));
+  if (values == NULL) {
+    luaL_error(L, "Could not grow index to %d rows", capacity);
+  }
+  idx->values = values;
+
+  lua_Number *norm2 = realloc(idx->norm2, capacity * sizeof(*norm2));
+  if (norm2 == NULL) {
+    luaL_error(L, "Could not grow index to %d rows", capacity);
+  }
+  idx->norm2 = norm2;
+  idx->capacity = capacity;
+}
+
+static void _index_append(
+  lua_State *L, VectorIndex *idx, const lua_Number *rows, lua_Integer n) {
+  _index_reserve(L, idx, idx->count + n);
+  lua_Number *dst = idx->values + idx->count * idx->dim;
+  memcpy(dst, rows, n * idx->dim * sizeof(*dst));
+  for (lua_Integer r = 0; r < n; r++) {
+    lua_Number *row = dst + r * idx->dim;
+    idx->norm2[idx->count + r] = _vec_dot_span(row, row, idx->dim);
+  }
+  idx->count += n;
+}
+
+int vec_index(lua_State *L) {
+  lua_Integer dim = luaL_checkinteger(L, 1);
+  if (dim <= 0) {
+    return luaL_error(
+      L, "Expected positive integer for dimension, got %d", dim);
+  }
+  Vector *data = NULL;
+  if (!lua_isnoneornil(L, 2)) {
+    data = luaL_checkudata(L, 2, vector_mt_name);
+    if (data->len % dim != 0) {
+      return luaL_error(
+        L,
+        "Vector of length %d cannot be split into rows of %d",
+        data->len,
+        dim);
+    }
+  }
+
+  VectorIndex *idx = newudata(L, sizeof(*idx));
+  idx->values = NULL;
+  idx->norm2 = NULL;
+  idx->dim = dim;
+  idx->count = 0;
+  idx->capacity = 0;
+  setmetatable(L, index_mt_name);
+
+  if (data != NULL) {
+    _index_append(L, idx, data->values, data->len / dim);
+  }
+  return 1;
+}
+
+static Vector *
+_index_check_row(lua_State *L, const VectorIndex *idx, int arg) {
+  Vector *v = luaL_checkudata(L, arg, vector_mt_name);
+  if (v->len != idx->dim) {
+    luaL_error(
+      L, "Expected vector of length %d, got length %d", idx->dim, v->len);
+  }
+  return v;
+}
+
+int index_add(lua_State *L) {
+  VectorIndex *idx = luaL_checkudata(L, 1, index_mt_name);
+  Vector *v = _index_check_row(L, idx, 2);
+  _index_append(L, idx, v->values, 1);
+  lua_pushinteger(L, idx->count);
+  return 1;
+}
+
+int index_get(lua_State *L) {
+  VectorIndex *idx = luaL_checkudata(L, 1, index_mt_name);
+  lua_Integer id = luaL_checkinteger(L, 2) - 1;
+  _vec_check_oob(L, id, idx->count);
+  Vector *new = _vec_push_new(L, idx->dim);
+  memcpy(
+    new->values, idx->values + id * idx->dim, idx->dim * sizeof(lua_Number));
+  return 1;
+}
+
+static void _index_push_result(
+  lua_State *L, const IndexQuery *q, IndexMetric metric, int ids, int scores) {
+  // appends the ids and scores vectors of q to the tables at ids and scores,
+  // or leaves them on the stack if those are 0
+  Vector *vids = _vec_push_new(L, q->size);
+  Vector *vscores = _vec_push_new(L, q->size);
+  for (lua_Integer i = 0; i < q->size; i++) {
+    vids->values[i] = (lua_Number)(q->heap[i].id + 1);
+    vscores->values[i] = _index_score(metric, q->heap[i].key, q->norm2);
+  }
+  if (ids != 0) {
+    lua_rawseti(L, scores, luaL_len(L, scores) + 1);
+    lua_rawseti(L, ids, luaL_len(L, ids) + 1);
+  }
+}
+
+int index_search(lua_State *L) {
+  VectorIndex *idx = luaL_checkudata(L, 1, index_mt_name);
+  lua_Integer k = luaL_checkinteger(L, 3);
+  IndexMetric metric = luaL_checkoption(L, 4, "cosine", index_metrics);
+  bool batch = lua_istable(L, 2);
+  lua_Integer nqueries = batch ? luaL_len(L, 2) : 1;
+  if (k < 0) {
+    return luaL_error(L, "Expected non-negative number of results, got %d", k);
+  } else if (k > idx->count) {
+    k = idx->count;
+  }
+  lua_settop(L, 4);
+
+  // scratch memory is a userdata, so it is collected even if an error is
+  // raised halfway through
+  lua_Integer slots = nqueries > 0 ? nqueries : 1;
+  IndexQuery *queries =
+    newudata(L, slots * (sizeof(IndexQuery) + k * sizeof(IndexHit)));
+  IndexHit *hits = (IndexHit *)(queries + nqueries);
+  for (lua_Integer j = 0; j < nqueries; j++) {
+    Vector *q;
+    if (batch) {
+      lua_rawgeti(L, 2, j + 1);
+      q = _index_check_row(L, idx, -1);
+      lua_pop(L, 1); // still referenced by the table
+    } else {
+      q = _index_check_row(L, idx, 2);
+    }
+    queries[j].values = q->values;
+    queries[j].norm2 = _vec_dot_span(q->values, q->values, idx->dim);
+    queries[j].heap = hits + j * k;
+    queries[j].size = 0;
+  }
+
+  _index_scan(idx, queries, nqueries, k, metric);
+
+  if (!batch) {
+    _index_push_result(L, &queries[0], metric, 0, 0);
+    return 2;
+  }
+  lua_createtable(L, (int)nqueries, 0);
+  lua_createtable(L, (int)nqueries, 0);
+  for (lua_Integer j = 0; j < nqueries; j++) {
+    _index_push_result(L, &queries[j], metric, 6, 7);
+  }
+  return 2;
+}
+
+int index_save(lua_State *L) {
+  VectorIndex *idx = luaL_checkudata(L, 1, index_mt_name);
+  const char *filename = luaL_checkstring(L, 2);
+  lua_Integer len = idx->count * idx->dim;
+  Vector rows = {idx->values, len, len, VEC_STORAGE_VIEW};
+  return _vec_save(L, &rows, filename, luaL_optinteger(L, 3, 0));
+}
+
+int index_dim(lua_State *L) {
+  VectorIndex *idx = luaL_checkudata(L, 1, index_mt_name);
+  lua_pushinteger(L, idx->dim);
+  return 1;
+}
+
+int index__len(lua_State *L) {
+  VectorIndex *idx = luaL_checkudata(L, 1, index_mt_name);
+  lua_pushinteger(L, idx->count);
+  return 1;
+}
+
+int index__tostring(lua_State *L) {
+  VectorIndex *idx = luaL_checkudata(L, 1, index_mt_name);
+  lua_pushfstring(L, "index(%d x %d)", (int)idx->count, (int)idx->dim);
+  return 1;
+}
+
+int index__gc(lua_State *L) {
+  VectorIndex *idx = luaL_checkudata(L, 1, index_mt_name);
+  free(idx->values);
+  free(idx->norm2);
+  idx->values = NULL;
+  idx->norm2 = NULL;
+  return 0;
+}
+
+static const luaL_Reg index_methods[] = {
+  {"add", &index_add},
+  {"get", &index_get},
+  {"search", &index_search},
+  {"save", &index_save},
+  {"dim", &index_dim},
+  {NULL, NULL}};
+
+static const luaL_Reg index_mt_funcs[] = {
+  {"__len", &index__len},
+  {"__tostring", &index__tostring},
+  {"__gc", &index__gc},
+  {NULL, NULL}};
+
+void create_index_metatable(lua_State *L) {
+  luaL_newmetatable(L, index_mt_name);
+  luaL_newlib(L, index_methods);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, index_mt_funcs, 0);
+  lua_pop(L, 1);
+}
+
+// 2, 3 and 4 component vectors for geometry. Their components are stored
+// inline in the userdata, which has no finalizer, so creating one is a single
+// small allocation that the collector frees like any other object. Every
+// function below takes the dimension as a compile-time constant through
+// def_small_wrap, so its loops are fully unrolled in each specialization.
+// They all get the metatable and the methods of their type as upvalues, to
+// check and create small vectors without looking either up by name.
+#define SMALL_MAX 4
+#define SMALL_MT lua_upvalueindex(1)
+#define SMALL_METHODS lua_upvalueindex(2)
+
+static const char *const small_mt_names[SMALL_MAX + 1] = {
+  NULL, NULL, "vector2", "vector3", "vector4"};
+static const char small_components[] = "xyzw";
+
+static inline lua_Number *_small_push_new(lua_State *L, int n) {
+  lua_Number *v = newudata(L, n * sizeof(*v));
+  lua_pushvalue(L, SMALL_MT);
+  lua_setmetatable(L, -2);
+  return v;
+}
+
+static inline lua_Number *_small_test(lua_State *L, int idx) {
+  lua_Number *v = lua_touserdata(L, idx);
+  if (v == NULL || !lua_getmetatable(L, idx)) {
+    return NULL;
+  }
+  bool same = lua_rawequal(L, -1, SMALL_MT);
+  lua_pop(L, 1);
+  return same ? v : NULL;
+}
+
+static inline lua_Number *_small_check(lua_State *L, int idx, int n) {
+  lua_Number *v = _small_test(L, idx);
+  // the slow path only raises the usual error
+  return v != NULL ? v : luaL_checkudata(L, idx, small_mt_names[n]);
+}
+
+static inline lua_Number *_small_push_out(lua_State *L, int idx, int n) {
+  // output of the in-place variants: the argument at idx, or self
+  int src = lua_isnoneornil(L, idx) ? 1 : idx;
+  lua_Number *out = _small_check(L, src, n);
+  lua_pushvalue(L, src);
+  return out;
+}
+
+static inline const lua_Number *
+_small_operand(lua_State *L, int idx, int n, lua_Number *scalar) {
+  // a small vector, or a number broadcast into scalar
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    lua_Number x = lua_tonumber(L, idx);
+    for (int i = 0; i < n; i++) {
+      scalar[i] = x;
+    }
+    return scalar;
+  }
+  return _small_check(L, idx, n);
+}
+
+static inline int _small_new(lua_State *L, int n) {
+  const lua_Number *src = NULL;
+  lua_settop(L, n);
+  if (lua_type(L, 1) == LUA_TUSERDATA) {
+    Vector *v = testudata(L, 1, vector_mt_name);
+    if (v != NULL && v->len != n) {
+      return luaL_error(L, "Expected vector of length %d, got %d", n, v->len);
+    }
+    src = v != NULL ? v->values : _small_check(L, 1, n);
+  }
+
+  lua_Number *new = _small_push_new(L, n);
+  for (int i = 0; i < n; i++) {
+    new[i] = src != NULL ? src[i] : luaL_optnumber(L, i + 1, 0);
+  }
+  return 1;
+}
+
+#define def_small_arith(name, op)                                              \
+  static inline void _small_##name##_kernel(                                   \
+    lua_State *L, int n, lua_Number *out) {                                    \
+    lua_Number sx[SMALL_MAX], sy[SMALL_MAX];                                   \
+    const lua_Number *x = _small_operand(L, 1, n, sx);                         \
+    const lua_Number *y = _small_operand(L, 2, n, sy);                         \
+    for (int i = 0; i < n; i++) {                                              \
+      out[i] = x[i] op y[i];                                                   \
+    }                                                                          \
+  }                                                                            \
+  static inline int _small_##name##_into(lua_State *L, int n) {                \
+    _small_##name##_kernel(L, n, _small_push_out(L, 3, n));                    \
+    return 1;                                                                  \
+  }                                                                            \
+  static inline int _small_##name(lua_State *L, int n) {                       \
+    lua_settop(L, 2);                                                          \
+    _small_##name##_kernel(L, n, _small_push_new(L, n));                       \
+    return 1;                                                                  \
+  }
+
+def_small_arith(add, +);
+def_small_arith(sub, -);
+def_small_arith(mul, *);
+def_small_arith(div, /);
+
+static inline int _small_neg_into(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  lua_Number *out = _small_push_out(L, 2, n);
+  for (int i = 0; i < n; i++) {
+    out[i] = -x[i];
+  }
+  return 1;
+}
+
+static inline int _small_neg(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  lua_Number *out = _small_push_new(L, n);
+  for (int i = 0; i < n; i++) {
+    out[i] = -x[i];
+  }
+  return 1;
+}
+
+static inline lua_Number
+_small_dot_kernel(const lua_Number *x, const lua_Number *y, int n) {
+  lua_Number total = 0;
+  for (int i = 0; i < n; i++) {
+    total += x[i] * y[i];
+  }
+  return total;
+}
+
+static inline int _small_dot(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  const lua_Number *y = _small_check(L, 2, n);
+  lua_pushnumber(L, _small_dot_kernel(x, y, n));
+  return 1;
+}
+
+static inline int _small_norm2(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  lua_pushnumber(L, _small_dot_kernel(x, x, n));
+  return 1;
+}
+
+static inline int _small_norm(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  lua_pushnumber(L, sqrt(_small_dot_kernel(x, x, n)));
+  return 1;
+}
+
+static inline void
+_small_normalize_kernel(const lua_Number *x, lua_Number *out, int n) {
+  lua_Number norm = sqrt(_small_dot_kernel(x, x, n));
+  for (int i = 0; i < n; i++) {
+    out[i] = x[i] / norm;
+  }
+}
+
+static inline int _small_normalize_into(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  _small_normalize_kernel(x, _small_push_out(L, 2, n), n);
+  return 1;
+}
+
+static inline int _small_normalize(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  _small_normalize_kernel(x, _small_push_new(L, n), n);
+  return 1;
+}
+
+static inline void _small_lerp_kernel(lua_State *L, int n, lua_Number *out) {
+  const lua_Number *x = _small_check(L, 1, n);
+  const lua_Number *y = _small_check(L, 2, n);
+  lua_Number t = luaL_checknumber(L, 3);
+  for (int i = 0; i < n; i++) {
+    out[i] = x[i] + (y[i] - x[i]) * t;
+  }
+}
+
+static inline int _small_lerp_into(lua_State *L, int n) {
+  _small_lerp_kernel(L, n, _small_push_out(L, 4, n));
+  return 1;
+}
+
+static inline int _small_lerp(lua_State *L, int n) {
+  lua_settop(L, 3);
+  _small_lerp_kernel(L, n, _small_push_new(L, n));
+  return 1;
+}
+
+static inline int _small_dup(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  memcpy(_small_push_new(L, n), x, n * sizeof(*x));
+  return 1;
+}
+
+static inline int _small_set(lua_State *L, int n) {
+  lua_Number *x = _small_check(L, 1, n);
+  for (int i = 0; i < n; i++) {
+    x[i] = luaL_checknumber(L, i + 2);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+static inline int _small_unpack(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  for (int i = 0; i < n; i++) {
+    lua_pushnumber(L, x[i]);
+  }
+  return n;
+}
+
+static inline int _small_tovec(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  Vector *v = _vec_push_new(L, n);
+  memcpy(v->values, x, n * sizeof(*x));
+  return 1;
+}
+
+static inline int _small_component(lua_State *L, int idx, int n) {
+  // 0-based component for an integer or a letter in xyzw, -1 for anything
+  // else
+  if (lua_isinteger(L, idx)) {
+    lua_Integer i = lua_tointeger(L, idx) - 1;
+    _vec_check_oob(L, i, n);
+    return i;
+  } else if (lua_type(L, idx) == LUA_TSTRING) {
+    size_t len;
+    const char *key = lua_tolstring(L, idx, &len);
+    const char *c = len == 1 ? memchr(small_components, key[0], n) : NULL;
+    return c != NULL ? c - small_components : -1;
+  }
+  return -1;
+}
+
+static inline int _small__index(lua_State *L, int n) {
+  int i = _small_component(L, 2, n);
+  if (i >= 0) {
+    lua_pushnumber(L, _small_check(L, 1, n)[i]);
+  } else {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, SMALL_METHODS);
+  }
+  return 1;
+}
+
+static inline int _small__newindex(lua_State *L, int n) {
+  lua_Number *x = _small_check(L, 1, n);
+  int i = _small_component(L, 2, n);
+  if (i < 0) {
+    return luaL_error(
+      L,
+      "Invalid component %s for %s",
+      lua_isstring(L, 2) ? lua_tostring(L, 2) : luaL_typename(L, 2),
+      small_mt_names[n]);
+  }
+  x[i] = luaL_checknumber(L, 3);
+  return 0;
+}
 
-  for (lua_Integer i = 0; i < new->len; i++) {
-    new->values[i] = (b->values[i] * ainnerb) / norm2b;
+static inline int _small__eq(lua_State *L, int n) {
+  const lua_Number *x = _small_test(L, 1);
+  const lua_Number *y = _small_test(L, 2);
+  bool eq = x != NULL && y != NULL;
+  for (int i = 0; eq && i < n; i++) {
+    eq = x[i] == y[i];
   }
+  lua_pushboolean(L, eq);
+  return 1;
+}
 
+static inline int _small__len(lua_State *L, int n) {
+  lua_pushinteger(L, n);
   return 1;
 }
 
-int vec_cosine_similarity(lua_State *L) {
-  Vector *a = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
-  _vec_check_same_len(L, a, b);
-  lua_Number norm2a = 0, norm2b = 0;
-  lua_Number ainnerb = 0;
+static inline int _small__tostring(lua_State *L, int n) {
+  const lua_Number *x = _small_check(L, 1, n);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
 
-  for (lua_Integer i = 0; i < a->len; i++) {
-    norm2a += a->values[i] * a->values[i];
-    norm2b += b->values[i] * b->values[i];
-    ainnerb += a->values[i] * b->values[i];
+  luaL_addstring(&b, n == 2 ? "vec2(" : n == 3 ? "vec3(" : "vec4(");
+  for (int i = 0; i < n; i++) {
+    _vec_addnumber(&b, x[i]);
+    luaL_addstring(&b, i < n - 1 ? ", " : ")");
   }
-
-  // product inside sqrt to avoid loss of precision
-  lua_pushnumber(L, ainnerb / (sqrt(norm2a * norm2b)));
+  luaL_pushresult(&b);
   return 1;
 }
 
-int vec_scale_into(lua_State *L) {
-  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  lua_Number scalar = luaL_checknumber(L, 2);
-  Vector *out;
+static void _small_cross_kernel(
+  const lua_Number *x, const lua_Number *y, lua_Number *out) {
+  lua_Number cx = x[1] * y[2] - x[2] * y[1];
+  lua_Number cy = x[2] * y[0] - x[0] * y[2];
+  lua_Number cz = x[0] * y[1] - x[1] * y[0];
+  out[0] = cx;
+  out[1] = cy;
+  out[2] = cz;
+}
 
-  if (lua_gettop(L) > 2) {
-    out = luaL_checkudata(L, 3, vector_mt_name);
-    _vec_check_same_len(L, self, out);
-    lua_settop(L, 3);
-  } else {
-    out = self;
-    lua_pushvalue(L, 1);
-  }
+static int small3_cross(lua_State *L) {
+  const lua_Number *x = _small_check(L, 1, 3);
+  const lua_Number *y = _small_check(L, 2, 3);
+  _small_cross_kernel(x, y, _small_push_new(L, 3));
+  return 1;
+}
 
-  _vec_scale_into(L, self, scalar, out);
+static int small3_cross_into(lua_State *L) {
+  const lua_Number *x = _small_check(L, 1, 3);
+  const lua_Number *y = _small_check(L, 2, 3);
+  _small_cross_kernel(x, y, _small_push_out(L, 3, 3));
   return 1;
 }
 
-int vec_scale(lua_State *L) {
-  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  lua_Number scalar = luaL_checknumber(L, 2);
-  Vector *new = _vec_push_new(L, self->len);
-  _vec_scale_into(L, self, scalar, new);
+static int small2_cross(lua_State *L) {
+  // z component of the cross product of the vectors extended to 3D
+  const lua_Number *x = _small_check(L, 1, 2);
+  const lua_Number *y = _small_check(L, 2, 2);
+  lua_pushnumber(L, x[0] * y[1] - x[1] * y[0]);
   return 1;
 }
 
-#define def_vec_op(name, expr)                                                 \
-  int vec_##name##_into(lua_State *L) {                                        \
-    Vector *self = luaL_checkudata(L, 1, vector_mt_name);                      \
-    Vector *out;                                                               \
-    if (lua_gettop(L) > 1) {                                                   \
-      out = luaL_checkudata(L, 2, vector_mt_name);                             \
-      _vec_check_same_len(L, self, out);                                       \
-      lua_settop(L, 2);                                                        \
-    } else {                                                                   \
-      out = self;                                                              \
-    }                                                                          \
-                                                                               \
-    for (lua_Integer i = 0; i < self->len; i++) {                              \
-      out->values[i] = (expr);                                                 \
-    }                                                                          \
-    return 1; /* out is already on the top of the stack */                     \
-  }                                                                            \
-                                                                               \
-  int vec_##name(lua_State *L) {                                               \
-    Vector *self = luaL_checkudata(L, 1, vector_mt_name);                      \
-    Vector *out = _vec_push_new(L, self->len);                                 \
-    for (lua_Integer i = 0; i < out->len; i++) {                               \
-      out->values[i] = (expr);                                                 \
-    }                                                                          \
-    return 1;                                                                  \
-  }
+#define def_small_wrap(n, name)                                                \
+  static int small##n##_##name(lua_State *L) { return _small_##name(L, n); }
+
+#define def_small_dim(n)                                                       \
+  def_small_wrap(n, new);                                                      \
+  def_small_wrap(n, add);                                                      \
+  def_small_wrap(n, add_into);                                                 \
+  def_small_wrap(n, sub);                                                      \
+  def_small_wrap(n, sub_into);                                                 \
+  def_small_wrap(n, mul);                                                      \
+  def_small_wrap(n, mul_into);                                                 \
+  def_small_wrap(n, div);                                                      \
+  def_small_wrap(n, div_into);                                                 \
+  def_small_wrap(n, neg);                                                      \
+  def_small_wrap(n, neg_into);                                                 \
+  def_small_wrap(n, dot);                                                      \
+  def_small_wrap(n, norm);                                                     \
+  def_small_wrap(n, norm2);                                                    \
+  def_small_wrap(n, normalize);                                                \
+  def_small_wrap(n, normalize_into);                                           \
+  def_small_wrap(n, lerp);                                                     \
+  def_small_wrap(n, lerp_into);                                                \
+  def_small_wrap(n, dup);                                                      \
+  def_small_wrap(n, set);                                                      \
+  def_small_wrap(n, unpack);                                                   \
+  def_small_wrap(n, tovec);                                                    \
+  def_small_wrap(n, _index);                                                   \
+  def_small_wrap(n, _newindex);                                                \
+  def_small_wrap(n, _eq);                                                      \
+  def_small_wrap(n, _len);                                                     \
+  def_small_wrap(n, _tostring);                                                \
+  static const luaL_Reg small##n##_methods[] = {                               \
+    {"add", &small##n##_add},                                                  \
+    {"add_", &small##n##_add_into},                                            \
+    {"sub", &small##n##_sub},                                                  \
+    {"sub_", &small##n##_sub_into},                                            \
+    {"mul", &small##n##_mul},                                                  \
+    {"mul_", &small##n##_mul_into},                                            \
+    {"div", &small##n##_div},                                                  \
+    {"div_", &small##n##_div_into},                                            \
+    {"neg", &small##n##_neg},                                                  \
+    {"neg_", &small##n##_neg_into},                                            \
+    {"dot", &small##n##_dot},                                                  \
+    {"norm", &small##n##_norm},                                                \
+    {"norm2", &small##n##_norm2},                                              \
+    {"normalize", &small##n##_normalize},                                      \
+    {"normalize_", &small##n##_normalize_into},                                \
+    {"lerp", &small##n##_lerp},                                                \
+    {"lerp_", &small##n##_lerp_into},                                          \
+    {"dup", &small##n##_dup},                                                  \
+    {"set", &small##n##_set},                                                  \
+    {"unpack", &small##n##_unpack},                                            \
+    {"tovec", &small##n##_tovec},                                              \
+    {"len", &small##n##__len},                                                 \
+    {NULL, NULL}};                                                             \
+  static const luaL_Reg small##n##_mt_funcs[] = {                              \
+    {"__index", &small##n##__index},                                           \
+    {"__newindex", &small##n##__newindex},                                     \
+    {"__eq", &small##n##__eq},                                                 \
+    {"__len", &small##n##__len},                                               \
+    {"__tostring", &small##n##__tostring},                                     \
+    {"__add", &small##n##_add},                                                \
+    {"__sub", &small##n##_sub},                                                \
+    {"__mul", &small##n##_mul},                                                \
+    {"__div", &small##n##_div},                                                \
+    {"__unm", &small##n##_neg},                                                \
+    {NULL, NULL}}
+
+def_small_dim(2);
+def_small_dim(3);
+def_small_dim(4);
+
+static const luaL_Reg small2_extra_methods[] = {
+  {"cross", &small2_cross},
+  {NULL, NULL}};
 
-#define def_vec_op_func(fname) def_vec_op(fname, fname(self->values[i]))
+static const luaL_Reg small3_extra_methods[] = {
+  {"cross", &small3_cross},
+  {"cross_", &small3_cross_into},
+  {NULL, NULL}};
 
-def_vec_op(sq, self->values[i] * self->values[i]);
-def_vec_op(sqrt, self->values[i] * self->values[i]);
-def_vec_op(cb, self->values[i] * self->values[i] * self->values[i]);
-def_vec_op(cbrt, self->values[i] * self->values[i] * self->values[i]);
-def_vec_op(ln, log(self->values[i]));
-def_vec_op(ln1p, log(1 + self->values[i]));
-def_vec_op(reciproc, 1.0 / (self->values[i]));
-def_vec_op_func(exp);
+static void
+_small_setfuncs(lua_State *L, int target, int mt, const luaL_Reg *funcs) {
+  // the methods table sits right above the metatable
+  lua_pushvalue(L, target);
+  lua_pushvalue(L, mt);
+  lua_pushvalue(L, mt + 1);
+  luaL_setfuncs(L, funcs, 2);
+  lua_pop(L, 1);
+}
 
-def_vec_op_func(sin);
-def_vec_op_func(sinh);
-def_vec_op_func(asin);
-def_vec_op_func(asinh);
-def_vec_op_func(cos);
-def_vec_op_func(cosh);
-def_vec_op_func(acos);
-def_vec_op_func(acosh);
-def_vec_op_func(tan);
-def_vec_op_func(tanh);
-def_vec_op_func(atan);
-def_vec_op_func(atanh);
+static void _small_create_metatable(
+  lua_State *L,
+  int n,
+  lua_CFunction new,
+  const luaL_Reg *methods,
+  const luaL_Reg *extra,
+  const luaL_Reg *mt_funcs) {
+  int lib = lua_gettop(L);
+  luaL_newmetatable(L, small_mt_names[n]);
+  lua_newtable(L);
+  _small_setfuncs(L, lib + 2, lib + 1, methods);
+  if (extra != NULL) {
+    _small_setfuncs(L, lib + 2, lib + 1, extra);
+  }
+  _small_setfuncs(L, lib + 1, lib + 1, mt_funcs);
 
-static inline int _vec_iter_closure(lua_State *L) {
-  Vector *v = lua_touserdata(L, 1);          // immutable iter state
-  lua_Integer cur_idx = lua_tointeger(L, 2); // mutable iter state
+  // the constructor goes in the lib, as vec.vec2, vec.vec3 or vec.vec4
+  lua_pushcclosure(L, new, 2);
+  lua_setfield(L, lib, n == 2 ? "vec2" : n == 3 ? "vec3" : "vec4");
+}
 
-  if (cur_idx >= v->len) {
-    return 0;
-  }
+void create_small_metatables(lua_State *L) {
+  _small_create_metatable(
+    L, 2, &small2_new, small2_methods, small2_extra_methods, small2_mt_funcs);
+  _small_create_metatable(
+    L, 3, &small3_new, small3_methods, small3_extra_methods, small3_mt_funcs);
+  _small_create_metatable(
+    L, 4, &small4_new, small4_methods, NULL, small4_mt_funcs);
+}
 
-  lua_pushinteger(L, cur_idx + 1);       // mutable iter state
-  lua_pushnumber(L, v->values[cur_idx]); // extra values
-  return 2;
+#define SOLVE_DEFAULT_TOL 1e-8
+#define SOLVE_DEFAULT_RESTART 30
+// elements per block when GMRES orthogonalizes against the whole basis, so
+// the block of the new vector stays in cache across every basis vector
+#define SOLVE_TILE 512
+#define SOLVE_MAX_TRACKED 8
+
+typedef struct Solver {
+  lua_State *L;
+  int fn;               // stack index of the operator, if it is a function
+  const Vector *matrix; // otherwise a dense n x n matrix, row by row
+  lua_Integer n;
+  const lua_Number *minv; // inverse of the diagonal of A, or NULL
+  lua_Number bnorm;
+  lua_Number tol; // absolute, that is, the relative tolerance times |b|
+  lua_Integer maxiter;
+  lua_Integer restart;
+  // pointers to the values of vectors the operator could reallocate, with
+  // those vectors, refreshed after each of its calls
+  lua_Number **tracked[SOLVE_MAX_TRACKED];
+  const Vector *tracked_vecs[SOLVE_MAX_TRACKED];
+  int ntracked;
+} Solver;
+
+static lua_Number *_solve_scratch(lua_State *L, lua_Integer count) {
+  // left on the stack, so it lives until the solver returns
+  return newudata(L, (count > 0 ? count : 1) * sizeof(lua_Number));
 }
 
-int vec_iter(lua_State *L) {
-  luaL_checkudata(L, 1, vector_mt_name);
+static lua_Number
+_solve_getnumber(lua_State *L, const char *field, lua_Number def) {
+  // expects the options table on top of the stack
+  lua_getfield(L, -1, field);
+  lua_Number x = lua_isnil(L, -1) ? def : luaL_checknumber(L, -1);
+  lua_pop(L, 1);
+  return x;
+}
 
-  lua_pushcfunction(L, &_vec_iter_closure); // iter function
-  lua_pushvalue(L, 1);                      // immutable state (vector)
-  lua_pushinteger(L, 0);                    // mutable state (index)
-  return 3;
+static lua_Integer
+_solve_getcount(lua_State *L, const char *field, lua_Integer def) {
+  // a non-negative integer, which may be given as an integral float, checked
+  // before the cast since NaN or out of range values would be undefined
+  lua_Number x = _solve_getnumber(L, field, (lua_Number)def);
+  lua_Number limit = ldexp(1, 8 * sizeof(lua_Integer) - 1);
+  if (!(x >= 0 && x < limit) || x != floor(x)) {
+    luaL_error(L, "Expected non-negative integer for %s, got %f", field, x);
+  }
+  return (lua_Integer)x;
 }
 
-#define def_vec_binop_arith_into(name, exp_lscalar, exp_rscalar, exp_ewise)    \
-  int vec_##name##_into(lua_State *L) {                                        \
-    Vector *out = NULL;                                                        \
-    if (lua_gettop(L) > 2) {                                                   \
-      out = luaL_checkudata(L, 3, vector_mt_name);                             \
-      lua_settop(L, 3);                                                        \
-    }                                                                          \
-    if (lua_isnumber(L, 1)) {                                                  \
-      lua_Number scalar = lua_tonumber(L, 1);                                  \
-      Vector *v = luaL_checkudata(L, 2, vector_mt_name);                       \
-      if (out == NULL)                                                         \
-        out = v;                                                               \
-      exp_lscalar;                                                             \
-      return 1;                                                                \
-    } else if (lua_isnumber(L, 2)) {                                           \
-      Vector *v = luaL_checkudata(L, 1, vector_mt_name);                       \
-      lua_Number scalar = lua_tonumber(L, 2);                                  \
-      if (out == NULL) {                                                       \
-        out = v;                                                               \
-        lua_pushvalue(L, 1);                                                   \
-      }                                                                        \
-      exp_rscalar;                                                             \
-      return 1;                                                                \
-    } else {                                                                   \
-      Vector *v1 = luaL_checkudata(L, 1, vector_mt_name);                      \
-      Vector *v2 = luaL_checkudata(L, 2, vector_mt_name);                      \
-      if (out == NULL) {                                                       \
-        out = v1;                                                              \
-        lua_pushvalue(L, 1);                                                   \
-      }                                                                        \
-      exp_ewise;                                                               \
-      return 1;                                                                \
-    }                                                                          \
+/*
+ * Parse the arguments (A, b[, x0[, opts]]) shared by every solver. Leaves the
+ * stack as A, b, x, opts, followed by the preconditioner's scratch memory,
+ * where x is x0 or a new vector of zeros which holds the solution.
+ */
+static void _solve_setup(lua_State *L, Solver *s) {
+  Vector *b = luaL_checkudata(L, 2, vector_mt_name);
+  lua_Integer n = b->len;
+  lua_settop(L, 4);
+
+  s->L = L;
+  s->fn = 0;
+  s->matrix = NULL;
+  s->n = n;
+  s->minv = NULL;
+  s->ntracked = 0;
+  if (lua_isfunction(L, 1)) {
+    s->fn = 1;
+  } else {
+    s->matrix = luaL_checkudata(L, 1, vector_mt_name);
+    if (s->matrix->len != n * n) {
+      luaL_error(
+        L,
+        "Expected a %dx%d matrix as a vector of length %d, got length %d",
+        n,
+        n,
+        n * n,
+        s->matrix->len);
+    }
   }
 
-#define def_vec_binop_arith_noninto(name)                                      \
-  int vec_##name(lua_State *L) {                                               \
-    Vector *v;                                                                 \
-    lua_settop(L, 2);                                                          \
-    if (lua_isnumber(L, 1)) {                                                  \
-      v = luaL_checkudata(L, 2, vector_mt_name);                               \
-    } else {                                                                   \
-      v = luaL_checkudata(L, 1, vector_mt_name);                               \
-    }                                                                          \
-    _vec_push_new(L, v->len);                                                  \
-    return vec_##name##_into(L);                                               \
+  if (lua_isnil(L, 3)) {
+    _vec_push_new(L, n);
+    lua_replace(L, 3);
   }
+  _vec_check_same_len(L, b, _vec_check_out(L, 3));
 
-def_vec_binop_arith_into(
-  add,
-  _vec_broadcast_add_into(L, v, scalar, out),
-  _vec_broadcast_add_into(L, v, scalar, out),
-  _vec_xpsy_into(L, v1, 1, v2, out));
+  if (lua_isnil(L, 4)) {
+    lua_newtable(L);
+    lua_replace(L, 4);
+  }
+  luaL_checktype(L, 4, LUA_TTABLE);
+  lua_pushvalue(L, 4);
+  lua_Number tol = _solve_getnumber(L, "tol", SOLVE_DEFAULT_TOL);
+  s->maxiter = _solve_getcount(L, "maxiter", 10 * n);
+  s->restart = _solve_getcount(L, "restart", SOLVE_DEFAULT_RESTART);
+  lua_getfield(L, -1, "jacobi");
+  lua_remove(L, -2);
+  if (!(tol >= 0) || s->restart < 1) {
+    luaL_error(L, "Expected non-negative tol and positive restart");
+  }
+  if (s->restart > n) {
+    // 0 for an empty system, which the solvers return right away
+    s->restart = n;
+  }
 
-def_vec_binop_arith_into(
-  sub,
-  _vec_broadcast_rev_sub_into(L, scalar, v, out),
-  _vec_broadcast_add_into(L, v, -scalar, out),
-  _vec_xpsy_into(L, v1, -1, v2, out));
+  // Jacobi preconditioning, with the diagonal given as a vector or, for
+  // dense matrices, taken from A
+  if (lua_toboolean(L, -1)) {
+    lua_Number *minv = _solve_scratch(L, n);
+    const lua_Number *diag = NULL;
+    lua_Integer stride = 1;
+    if (lua_isboolean(L, -2)) {
+      if (s->matrix == NULL) {
+        luaL_error(
+          L, "Jacobi preconditioning of a function needs its diagonal");
+      }
+      diag = s->matrix->values;
+      stride = n + 1;
+    } else {
+      Vector *d = luaL_checkudata(L, -2, vector_mt_name);
+      _vec_check_same_len(L, b, d);
+      diag = d->values;
+    }
+    for (lua_Integer i = 0; i < n; i++) {
+      if (diag[i * stride] == 0) {
+        luaL_error(L, "Jacobi preconditioning needs a nonzero diagonal");
+      }
+      minv[i] = 1 / diag[i * stride];
+    }
+    s->minv = minv;
+  } else {
+    lua_pushnil(L);
+  }
+  lua_remove(L, -2);
 
-def_vec_binop_arith_into(
-  mul,
-  _vec_scale_into(L, v, scalar, out),
-  _vec_scale_into(L, v, scalar, out),
-  _vec_hadamard_product_into(L, v1, v2, out));
+  s->bnorm = sqrt(_vec_dot_span(b->values, b->values, n));
+  s->tol = tol * s->bnorm;
+}
 
-def_vec_binop_arith_into(
-  div,
-  _vec_elmwise_div_scalar_into(L, scalar, v, out),
-  _vec_scale_reciproc_into(L, v, scalar, out),
-  _vec_elmwise_div_into(L, v1, v2, out));
+// point *values at the elements of the vector at idx, for as long as the
+// solver runs
+static void _solve_track(Solver *s, lua_Number **values, int idx) {
+  const Vector *v = lua_touserdata(s->L, idx);
+  s->tracked[s->ntracked] = values;
+  s->tracked_vecs[s->ntracked] = v;
+  s->ntracked++;
+  *values = v->values;
+}
 
-def_vec_binop_arith_into(
-  pow,
-  _vec_broadcast_pow_rev_into(L, scalar, v, out),
-  _vec_broadcast_pow_into(L, v, scalar, out),
-  _vec_pow_into(L, v1, v2, out));
+static void _solve_apply(Solver *s, int xidx, int outidx) {
+  lua_State *L = s->L;
+  const Vector *x = lua_touserdata(L, xidx);
+  Vector *out = lua_touserdata(L, outidx);
 
-int vec_neg_into(lua_State *L) {
-  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  Vector *out;
+  if (s->matrix != NULL) {
+    for (lua_Integer i = 0; i < s->n; i++) {
+      out->values[i] =
+        _vec_dot_span(s->matrix->values + i * s->n, x->values, s->n);
+    }
+    return;
+  }
 
-  if (lua_gettop(L) > 1) {
-    out = luaL_checkudata(L, 2, vector_mt_name);
-    _vec_check_same_len(L, self, out);
-    lua_settop(L, 2);
-  } else {
-    out = self;
-    lua_pushvalue(L, 1);
+  lua_pushvalue(L, s->fn);
+  lua_pushvalue(L, xidx);
+  lua_pushvalue(L, outidx);
+  lua_call(L, 2, 0);
+
+  // the operator may have moved any vector it can reach, for instance with
+  // reserve or vec.share, so every cached pointer is read again
+  for (int k = 0; k < s->ntracked; k++) {
+    if (s->tracked_vecs[k]->len != s->n) {
+      luaL_error(
+        L, "Operator changed the length of a vector used by the solver");
+    }
+    *s->tracked[k] = s->tracked_vecs[k]->values;
   }
+}
 
-  for (lua_Integer i = 0; i < self->len; i++) {
-    out->values[i] = -self->values[i];
+static int _solve_finish(Solver *s, lua_Integer iters, lua_Number res) {
+  lua_State *L = s->L;
+  lua_pushvalue(L, 3);
+  lua_pushboolean(L, res <= s->tol);
+  lua_pushinteger(L, iters);
+  lua_pushnumber(L, s->bnorm > 0 ? res / s->bnorm : res);
+  return 4;
+}
+
+int vec_solve_cg(lua_State *L) {
+  Solver s;
+  _solve_setup(L, &s);
+  lua_Integer n = s.n;
+  if (n == 0) {
+    return _solve_finish(&s, 0, 0);
+  }
+  const lua_Number *minv = s.minv;
+  lua_Number *b, *x, *p, *ap;
+  _solve_track(&s, &b, 2);
+  _solve_track(&s, &x, 3);
+
+  _vec_push_new(L, n);
+  int pidx = lua_gettop(L);
+  _solve_track(&s, &p, pidx);
+  _vec_push_new(L, n);
+  int apidx = lua_gettop(L);
+  _solve_track(&s, &ap, apidx);
+  lua_Number *r = _solve_scratch(L, 2 * n);
+  lua_Number *z = minv != NULL ? r + n : r;
+
+  _solve_apply(&s, 3, apidx);
+  lua_Number rz = 0, rr = 0;
+  for (lua_Integer i = 0; i < n; i++) {
+    r[i] = b[i] - ap[i];
+    z[i] = minv != NULL ? minv[i] * r[i] : r[i];
+    p[i] = z[i];
+    rz += r[i] * z[i];
+    rr += r[i] * r[i];
   }
 
-  return 1;
+  lua_Integer iters = 0;
+  while (sqrt(rr) > s.tol && iters < s.maxiter) {
+    _solve_apply(&s, pidx, apidx);
+    lua_Number pap = _vec_dot_span(p, ap, n);
+    if (pap == 0) {
+      break;
+    }
+    lua_Number alpha = rz / pap;
+
+    // update the solution and the residual, precondition it and take both
+    // of its inner products in a single pass
+    lua_Number rz_next = 0;
+    rr = 0;
+    for (lua_Integer i = 0; i < n; i++) {
+      x[i] += alpha * p[i];
+      r[i] -= alpha * ap[i];
+      z[i] = minv != NULL ? minv[i] * r[i] : r[i];
+      rz_next += r[i] * z[i];
+      rr += r[i] * r[i];
+    }
+
+    lua_Number beta = rz_next / rz;
+    rz = rz_next;
+    for (lua_Integer i = 0; i < n; i++) {
+      p[i] = z[i] + beta * p[i];
+    }
+    iters++;
+  }
+  return _solve_finish(&s, iters, sqrt(rr));
 }
 
-def_vec_binop_arith_noninto(add);
-def_vec_binop_arith_noninto(sub);
-def_vec_binop_arith_noninto(mul);
-def_vec_binop_arith_noninto(div);
-def_vec_binop_arith_noninto(pow);
+int vec_solve_bicgstab(lua_State *L) {
+  Solver s;
+  _solve_setup(L, &s);
+  lua_Integer n = s.n;
+  if (n == 0) {
+    return _solve_finish(&s, 0, 0);
+  }
+  const lua_Number *minv = s.minv;
+  lua_Number *b, *x, *ph, *v, *sh, *t, *p, *sv;
+  _solve_track(&s, &b, 2);
+  _solve_track(&s, &x, 3);
+
+  // the operator is applied to ph and sh, the preconditioned p and s
+  _vec_push_new(L, n);
+  int phidx = lua_gettop(L);
+  _solve_track(&s, &ph, phidx);
+  _vec_push_new(L, n);
+  int vidx = lua_gettop(L);
+  _solve_track(&s, &v, vidx);
+  _vec_push_new(L, n);
+  int shidx = lua_gettop(L);
+  _solve_track(&s, &sh, shidx);
+  _vec_push_new(L, n);
+  int tidx = lua_gettop(L);
+  _solve_track(&s, &t, tidx);
+  lua_Number *r = _solve_scratch(L, 4 * n);
+  lua_Number *r0 = r + n;
+  if (minv != NULL) {
+    p = r + 2 * n;
+    sv = r + 3 * n;
+  } else {
+    // without preconditioning, p and s are ph and sh themselves
+    _solve_track(&s, &p, phidx);
+    _solve_track(&s, &sv, shidx);
+  }
+  memset(p, 0, n * sizeof(*p));
+
+  _solve_apply(&s, 3, vidx);
+  lua_Number rr = 0;
+  for (lua_Integer i = 0; i < n; i++) {
+    r[i] = b[i] - v[i];
+    r0[i] = r[i];
+    v[i] = 0;
+    rr += r[i] * r[i];
+  }
 
-int vec_neg(lua_State *L) {
-  Vector *self = luaL_checkudata(L, 1, vector_mt_name);
-  lua_settop(L, 1);
-  _vec_push_new(L, self->len);
-  return vec_neg_into(L);
+  lua_Number rho = 1, alpha = 1, omega = 1;
+  lua_Number rho_next = rr;
+  lua_Integer iters = 0;
+  while (sqrt(rr) > s.tol && iters < s.maxiter && rho_next != 0) {
+    lua_Number beta = (rho_next / rho) * (alpha / omega);
+    rho = rho_next;
+    for (lua_Integer i = 0; i < n; i++) {
+      p[i] = r[i] + beta * (p[i] - omega * v[i]);
+      ph[i] = minv != NULL ? minv[i] * p[i] : p[i];
+    }
+
+    _solve_apply(&s, phidx, vidx);
+    lua_Number r0v = _vec_dot_span(r0, v, n);
+    if (r0v == 0) {
+      break;
+    }
+    alpha = rho / r0v;
+
+    lua_Number ss = 0;
+    for (lua_Integer i = 0; i < n; i++) {
+      sv[i] = r[i] - alpha * v[i];
+      sh[i] = minv != NULL ? minv[i] * sv[i] : sv[i];
+      ss += sv[i] * sv[i];
+    }
+    iters++;
+    if (sqrt(ss) <= s.tol) {
+      for (lua_Integer i = 0; i < n; i++) {
+        x[i] += alpha * ph[i];
+      }
+      rr = ss;
+      break;
+    }
+
+    _solve_apply(&s, shidx, tidx);
+    lua_Number ts = 0, tt = 0;
+    for (lua_Integer i = 0; i < n; i++) {
+      ts += t[i] * sv[i];
+      tt += t[i] * t[i];
+    }
+    omega = tt > 0 ? ts / tt : 0;
+
+    // update the solution and the residual, and take the inner products
+    // needed by the next iteration in the same pass
+    rr = 0;
+    rho_next = 0;
+    for (lua_Integer i = 0; i < n; i++) {
+      x[i] += alpha * ph[i] + omega * sh[i];
+      r[i] = sv[i] - omega * t[i];
+      rr += r[i] * r[i];
+      rho_next += r0[i] * r[i];
+    }
+    if (omega == 0) {
+      break;
+    }
+  }
+  return _solve_finish(&s, iters, sqrt(rr));
 }
 
-int vec__gc(lua_State *L) {
-  Vector *v = luaL_checkudata(L, 1, vector_mt_name);
-  free(v->values);
-  return 0;
+static void _solve_orthogonalize(
+  const lua_Number *basis,
+  lua_Integer count,
+  lua_Integer n,
+  lua_Number *w,
+  lua_Number *h) {
+  // h = basis^T w, then w -= basis h, one block of w at a time
+  for (lua_Integer k = 0; k < count; k++) {
+    h[k] = 0;
+  }
+  for (lua_Integer start = 0; start < n; start += SOLVE_TILE) {
+    lua_Integer len = n - start < SOLVE_TILE ? n - start : SOLVE_TILE;
+    for (lua_Integer k = 0; k < count; k++) {
+      h[k] += _vec_dot_span(basis + k * n + start, w + start, len);
+    }
+  }
+  for (lua_Integer start = 0; start < n; start += SOLVE_TILE) {
+    lua_Integer len = n - start < SOLVE_TILE ? n - start : SOLVE_TILE;
+    for (lua_Integer k = 0; k < count; k++) {
+      const lua_Number *q = basis + k * n + start;
+      for (lua_Integer i = 0; i < len; i++) {
+        w[start + i] -= h[k] * q[i];
+      }
+    }
+  }
+}
+
+int vec_solve_gmres(lua_State *L) {
+  Solver s;
+  _solve_setup(L, &s);
+  lua_Integer n = s.n;
+  if (n == 0) {
+    return _solve_finish(&s, 0, 0);
+  }
+  lua_Integer m = s.restart;
+  const lua_Number *minv = s.minv;
+  lua_Number *b, *x, *z, *w;
+  _solve_track(&s, &b, 2);
+  _solve_track(&s, &x, 3);
+
+  _vec_push_new(L, n);
+  int zidx = lua_gettop(L);
+  _solve_track(&s, &z, zidx);
+  _vec_push_new(L, n);
+  int widx = lua_gettop(L);
+  _solve_track(&s, &w, widx);
+  lua_Number *basis = _solve_scratch(
+    L, (m + 1) * n + (m + 1) * m + 2 * m + 2 * (m + 1) + m);
+  lua_Number *hess = basis + (m + 1) * n; // (m + 1) x m, row by row
+  lua_Number *cs = hess + (m + 1) * m;
+  lua_Number *sn = cs + m;
+  lua_Number *g = sn + m;
+  lua_Number *h = g + (m + 1);
+  lua_Number *y = h + (m + 1);
+
+  lua_Integer iters = 0;
+  lua_Number res;
+  for (;;) {
+    _solve_apply(&s, 3, widx);
+    res = 0;
+    for (lua_Integer i = 0; i < n; i++) {
+      basis[i] = b[i] - w[i];
+      res += basis[i] * basis[i];
+    }
+    res = sqrt(res);
+    if (res <= s.tol || iters >= s.maxiter || res == 0) {
+      break;
+    }
+    for (lua_Integer i = 0; i < n; i++) {
+      basis[i] /= res;
+    }
+    g[0] = res;
+    for (lua_Integer k = 1; k <= m; k++) {
+      g[k] = 0;
+    }
+
+    lua_Integer j = 0;
+    lua_Number est = res;
+    while (j < m && iters < s.maxiter) {
+      const lua_Number *q = basis + j * n;
+      for (lua_Integer i = 0; i < n; i++) {
+        z[i] = minv != NULL ? minv[i] * q[i] : q[i];
+      }
+      _solve_apply(&s, zidx, widx);
+
+      // classical Gram-Schmidt, twice for the stability of modified
+      // Gram-Schmidt with one pass over w per round instead of per vector
+      for (lua_Integer k = 0; k <= j; k++) {
+        hess[k * m + j] = 0;
+      }
+      for (int round = 0; round < 2; round++) {
+        _solve_orthogonalize(basis, j + 1, n, w, h);
+        for (lua_Integer k = 0; k <= j; k++) {
+          hess[k * m + j] += h[k];
+        }
+      }
+      lua_Number wnorm = sqrt(_vec_dot_span(w, w, n));
+      hess[(j + 1) * m + j] = wnorm;
+      if (wnorm > 0) {
+        lua_Number *next = basis + (j + 1) * n;
+        for (lua_Integer i = 0; i < n; i++) {
+          next[i] = w[i] / wnorm;
+        }
+      }
+
+      // keep the Hessenberg matrix upper triangular with Givens rotations
+      for (lua_Integer k = 0; k < j; k++) {
+        lua_Number a = hess[k * m + j], c = hess[(k + 1) * m + j];
+        hess[k * m + j] = cs[k] * a + sn[k] * c;
+        hess[(k + 1) * m + j] = -sn[k] * a + cs[k] * c;
+      }
+      lua_Number a = hess[j * m + j], c = hess[(j + 1) * m + j];
+      lua_Number norm = hypot(a, c);
+      cs[j] = norm > 0 ? a / norm : 1;
+      sn[j] = norm > 0 ? c / norm : 0;
+      hess[j * m + j] = norm;
+      hess[(j + 1) * m + j] = 0;
+      g[j + 1] = -sn[j] * g[j];
+      g[j] = cs[j] * g[j];
+
+      j++;
+      iters++;
+      est = fabs(g[j]);
+      if (est <= s.tol || wnorm == 0) {
+        break;
+      }
+    }
+
+    // x += M^-1 (basis y), where y solves the triangular system
+    for (lua_Integer k = j - 1; k >= 0; k--) {
+      lua_Number acc = g[k];
+      for (lua_Integer l = k + 1; l < j; l++) {
+        acc -= hess[k * m + l] * y[l];
+      }
+      y[k] = hess[k * m + k] != 0 ? acc / hess[k * m + k] : 0;
+    }
+    memset(z, 0, n * sizeof(*z));
+    for (lua_Integer k = 0; k < j; k++) {
+      const lua_Number *q = basis + k * n;
+      for (lua_Integer i = 0; i < n; i++) {
+        z[i] += y[k] * q[i];
+      }
+    }
+    for (lua_Integer i = 0; i < n; i++) {
+      x[i] += minv != NULL ? minv[i] * z[i] : z[i];
+    }
+    if (est > s.tol && j < m && iters < s.maxiter) {
+      // the Krylov space stopped growing without reaching the tolerance
+      _solve_apply(&s, 3, widx);
+      res = 0;
+      for (lua_Integer i = 0; i < n; i++) {
+        res += (b[i] - w[i]) * (b[i] - w[i]);
+      }
+      res = sqrt(res);
+      break;
+    }
+  }
+  return _solve_finish(&s, iters, res);
 }
 
 static const luaL_Reg vec_mt_funcs[] = {
@@ -908,6 +7015,19 @@ void create_vector_metatable(lua_State *L) {
   lua_pushvalue(L, libstackidx);
   luaL_setfuncs(L, vec_mt_funcs, 1);
   lua_pop(L, 1);
+
+  // view -> owner of its memory
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushstring(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, vector_views_key);
+
+  PrintOptions *opts = newudata(L, sizeof(*opts));
+  opts->threshold = 1000;
+  opts->edgeitems = 3;
+  lua_setfield(L, LUA_REGISTRYINDEX, vector_printoptions_key);
 }
 
 const struct luaL_Reg vec_functions[] = {
@@ -919,8 +7039,41 @@ const struct luaL_Reg vec_functions[] = {
   {"dup", &vec_dup},
   {"dup_", &vec_dup_into},
   {"save", &vec_save},
+  {"savetxt", &vec_savetxt},
   {"load", &vec_load},
+  {"loadtxt", &vec_loadtxt},
+  {"shm_create", &vec_shm_create},
+  {"shm_open", &vec_shm_open},
+  {"shm_publish", &vec_shm_publish},
+  {"shm_seq", &vec_shm_seq},
   {"reset", &vec_reset},
+  {"printoptions", &vec_printoptions},
+
+  {"seq", &vec_seq},
+  {"push", &vec_push},
+  {"extend", &vec_extend},
+  {"reserve", &vec_reserve},
+  {"shrink_to_fit", &vec_shrink_to_fit},
+  {"capacity", &vec_capacity},
+  {"share", &vec_share},
+  {"adopt", &vec_adopt},
+  {"release", &vec_release},
+  {"readonly", &vec_readonly},
+  {"record", &vec_record},
+  {"index", &vec_index},
+  {"solve_cg", &vec_solve_cg},
+  {"solve_bicgstab", &vec_solve_bicgstab},
+  {"solve_gmres", &vec_solve_gmres},
+  {"ring", &vec_ring},
+  {"rng", &vec_rng},
+  {"rand", &vec_rand},
+  {"rand_", &vec_rand_into},
+  {"randn", &vec_randn},
+  {"randn_", &vec_randn_into},
+  {"complex", &vec_complex},
+  {"polar", &vec_polar},
+  {"sparse", &vec_sparse},
+  {"fromdense", &vec_fromdense},
 
   {"add", &vec_add},
   {"add_", &vec_add_into},
@@ -948,6 +7101,37 @@ const struct luaL_Reg vec_functions[] = {
   {"project_", &vec_project_into},
   {"cosine_similarity", &vec_cosine_similarity},
 
+  {"gather", &vec_gather},
+  {"gather_", &vec_gather_into},
+  {"scatter", &vec_scatter},
+  {"scatter_", &vec_scatter_into},
+  {"compress", &vec_compress},
+  {"compress_", &vec_compress_into},
+  {"where", &vec_compress},
+  {"where_", &vec_compress_into},
+  {"select", &vec_select},
+  {"select_", &vec_select_into},
+
+  {"lt", &vec_lt},
+  {"lt_", &vec_lt_into},
+  {"le", &vec_le},
+  {"le_", &vec_le_into},
+  {"gt", &vec_gt},
+  {"gt_", &vec_gt_into},
+  {"ge", &vec_ge},
+  {"ge_", &vec_ge_into},
+  {"eq", &vec_eq},
+  {"eq_", &vec_eq_into},
+  {"ne", &vec_ne},
+  {"ne_", &vec_ne_into},
+  {"isnan", &vec_isnan},
+  {"isnan_", &vec_isnan_into},
+  {"isfinite", &vec_isfinite},
+  {"isfinite_", &vec_isfinite_into},
+  {"any", &vec_any},
+  {"all", &vec_all},
+  {"count_nonzero", &vec_count_nonzero},
+
   {"at", &vec_at},
   {"len", &vec__len},
   {"iter", &vec_iter},
@@ -959,6 +7143,30 @@ const struct luaL_Reg vec_functions[] = {
   {"normalize_", &vec_normalize_into},
 
   {"trapz", &vec_trapz},
+  {"cumtrapz", &vec_cumtrapz},
+  {"cumtrapz_", &vec_cumtrapz_into},
+  {"simpson", &vec_simpson},
+  {"romb", &vec_romb},
+  {"quad", &vec_quad},
+
+  {"cumsum", &vec_cumsum},
+  {"cumsum_", &vec_cumsum_into},
+  {"cumprod", &vec_cumprod},
+  {"cumprod_", &vec_cumprod_into},
+  {"cummax", &vec_cummax},
+  {"cummax_", &vec_cummax_into},
+  {"cummin", &vec_cummin},
+  {"cummin_", &vec_cummin_into},
+  {"diff", &vec_diff},
+  {"diff_", &vec_diff_into},
+  {"moving_average", &vec_moving_average},
+  {"moving_average_", &vec_moving_average_into},
+  {"lfilter", &vec_lfilter},
+  {"lfilter_", &vec_lfilter_into},
+  {"sosfilt", &vec_sosfilt},
+  {"sosfilt_", &vec_sosfilt_into},
+  {"filtfilt", &vec_filtfilt},
+  {"sosfiltfilt", &vec_sosfiltfilt},
 
   {"sq", &vec_sq},
   {"sq_", &vec_sq_into},
@@ -1033,6 +7241,17 @@ extern int luaopen_vec(lua_State *L) {
   setmetatable(L, vector_lib_mt_name);
 
   create_vector_metatable(L);
+  create_file_metatable(L);
+  create_text_reader_metatable(L);
+  create_ring_metatable(L);
+  create_rng_metatable(L);
+  create_complex_metatable(L);
+  create_sparse_metatable(L);
+  create_shm_metatable(L);
+  create_graph_metatable(L);
+  create_index_metatable(L);
+  create_small_metatables(L);
+  register_ext_api(L);
 
   return 1;
 }
@@ -4,6 +4,32 @@
 #include "lauxlib.h"
 #include "lua.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define VECTORIZE_HAVE_SHM 1
+#endif
+
+// 64-bit atomics for counters shared between threads or processes
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define atomic_add64(p, v)                                                     \
+  (_InterlockedExchangeAdd64((volatile __int64 *)(p), (v)) + (v))
+#define atomic_load64(p)                                                       \
+  (_InterlockedCompareExchange64((volatile __int64 *)(p), 0, 0))
+#define atomic_xchg64(p, v)                                                    \
+  (_InterlockedExchange64((volatile __int64 *)(p), (v)))
+
+#else
+#define atomic_add64(p, v) (__atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL))
+#define atomic_load64(p) (__atomic_load_n((p), __ATOMIC_ACQUIRE))
+#define atomic_xchg64(p, v) (__atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL))
+
+#endif
+
+#ifndef LUA_INTEGER_FMT
+// Lua 5.1 and 5.2, where lua_Integer is a ptrdiff_t
+#define LUA_INTEGER_FMT "%td"
+#endif
+
 #if LUA_VERSION_NUM == 504
 #define newudata(L, size) (lua_newuserdatauv(L, size, 0))
 
@@ -35,6 +61,25 @@ static inline void setmetatable(lua_State *L, const char *mtname) {
 #endif
 }
 
+static inline void *testudata(lua_State *L, int idx, const char *mtname) {
+#if LUA_VERSION_NUM == 501
+  void *p = lua_touserdata(L, idx);
+  if (p == NULL || !lua_getmetatable(L, idx)) {
+    return NULL;
+  }
+  luaL_getmetatable(L, mtname);
+  if (!lua_rawequal(L, -1, -2)) {
+    p = NULL;
+  }
+  lua_pop(L, 2);
+  return p;
+
+#else
+  return luaL_testudata(L, idx, mtname);
+
+#endif
+}
+
 #if LUA_VERSION_NUM == 501
 #define luaL_len(L, idx) (lua_objlen(L, idx))
 
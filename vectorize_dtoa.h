@@ -0,0 +1,341 @@
+#ifndef VECTORIZE_DTOA_H
+#define VECTORIZE_DTOA_H 1
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Shortest round-trip formatting of doubles, using Grisu2 (Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", 2010).
+ *
+ * The digits produced always read back as the same double through strtod,
+ * and are the shortest such digits for all but a tiny fraction of inputs.
+ */
+
+// enough for any output of vec_dtoa, including the trailing NUL
+#define VEC_DTOA_BUFSIZE 32
+
+typedef struct DiyFp {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+#define DTOA_SIGNIFICAND_SIZE 52
+#define DTOA_EXPONENT_BIAS (0x3FF + DTOA_SIGNIFICAND_SIZE)
+#define DTOA_MIN_EXPONENT (-DTOA_EXPONENT_BIAS)
+#define DTOA_HIDDEN_BIT 0x0010000000000000ULL
+#define DTOA_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DTOA_EXPONENT_MASK 0x7FF0000000000000ULL
+
+// normalized 10^k for k = -348, -340, ..., 340
+static const DiyFp dtoa_cached_powers[] = {
+  {0xfa8fd5a0081c0288ULL, -1220}, {0xbaaee17fa23ebf76ULL, -1193},
+  {0x8b16fb203055ac76ULL, -1166}, {0xcf42894a5dce35eaULL, -1140},
+  {0x9a6bb0aa55653b2dULL, -1113}, {0xe61acf033d1a45dfULL, -1087},
+  {0xab70fe17c79ac6caULL, -1060}, {0xff77b1fcbebcdc4fULL, -1034},
+  {0xbe5691ef416bd60cULL, -1007}, {0x8dd01fad907ffc3cULL, -980},
+  {0xd3515c2831559a83ULL, -954},  {0x9d71ac8fada6c9b5ULL, -927},
+  {0xea9c227723ee8bcbULL, -901},  {0xaecc49914078536dULL, -874},
+  {0x823c12795db6ce57ULL, -847},  {0xc21094364dfb5637ULL, -821},
+  {0x9096ea6f3848984fULL, -794},  {0xd77485cb25823ac7ULL, -768},
+  {0xa086cfcd97bf97f4ULL, -741},  {0xef340a98172aace5ULL, -715},
+  {0xb23867fb2a35b28eULL, -688},  {0x84c8d4dfd2c63f3bULL, -661},
+  {0xc5dd44271ad3cdbaULL, -635},  {0x936b9fcebb25c996ULL, -608},
+  {0xdbac6c247d62a584ULL, -582},  {0xa3ab66580d5fdaf6ULL, -555},
+  {0xf3e2f893dec3f126ULL, -529},  {0xb5b5ada8aaff80b8ULL, -502},
+  {0x87625f056c7c4a8bULL, -475},  {0xc9bcff6034c13053ULL, -449},
+  {0x964e858c91ba2655ULL, -422},  {0xdff9772470297ebdULL, -396},
+  {0xa6dfbd9fb8e5b88fULL, -369},  {0xf8a95fcf88747d94ULL, -343},
+  {0xb94470938fa89bcfULL, -316},  {0x8a08f0f8bf0f156bULL, -289},
+  {0xcdb02555653131b6ULL, -263},  {0x993fe2c6d07b7facULL, -236},
+  {0xe45c10c42a2b3b06ULL, -210},  {0xaa242499697392d3ULL, -183},
+  {0xfd87b5f28300ca0eULL, -157},  {0xbce5086492111aebULL, -130},
+  {0x8cbccc096f5088ccULL, -103},  {0xd1b71758e219652cULL, -77},
+  {0x9c40000000000000ULL, -50},   {0xe8d4a51000000000ULL, -24},
+  {0xad78ebc5ac620000ULL, 3},     {0x813f3978f8940984ULL, 30},
+  {0xc097ce7bc90715b3ULL, 56},    {0x8f7e32ce7bea5c70ULL, 83},
+  {0xd5d238a4abe98068ULL, 109},   {0x9f4f2726179a2245ULL, 136},
+  {0xed63a231d4c4fb27ULL, 162},   {0xb0de65388cc8ada8ULL, 189},
+  {0x83c7088e1aab65dbULL, 216},   {0xc45d1df942711d9aULL, 242},
+  {0x924d692ca61be758ULL, 269},   {0xda01ee641a708deaULL, 295},
+  {0xa26da3999aef774aULL, 322},   {0xf209787bb47d6b85ULL, 348},
+  {0xb454e4a179dd1877ULL, 375},   {0x865b86925b9bc5c2ULL, 402},
+  {0xc83553c5c8965d3dULL, 428},   {0x952ab45cfa97a0b3ULL, 455},
+  {0xde469fbd99a05fe3ULL, 481},   {0xa59bc234db398c25ULL, 508},
+  {0xf6c69a72a3989f5cULL, 534},   {0xb7dcbf5354e9beceULL, 561},
+  {0x88fcf317f22241e2ULL, 588},   {0xcc20ce9bd35c78a5ULL, 614},
+  {0x98165af37b2153dfULL, 641},   {0xe2a0b5dc971f303aULL, 667},
+  {0xa8d9d1535ce3b396ULL, 694},   {0xfb9b7cd9a4a7443cULL, 720},
+  {0xbb764c4ca7a44410ULL, 747},   {0x8bab8eefb6409c1aULL, 774},
+  {0xd01fef10a657842cULL, 800},   {0x9b10a4e5e9913129ULL, 827},
+  {0xe7109bfba19c0c9dULL, 853},   {0xac2820d9623bf429ULL, 880},
+  {0x80444b5e7aa7cf85ULL, 907},   {0xbf21e44003acdd2dULL, 933},
+  {0x8e679c2f5e44ff8fULL, 960},   {0xd433179d9c8cb841ULL, 986},
+  {0x9e19db92b4e31ba9ULL, 1013},  {0xeb96bf6ebadf77d9ULL, 1039},
+  {0xaf87023b9bf0ee6bULL, 1066},
+};
+
+static const uint64_t dtoa_pow10[] = {
+  1ULL,
+  10ULL,
+  100ULL,
+  1000ULL,
+  10000ULL,
+  100000ULL,
+  1000000ULL,
+  10000000ULL,
+  100000000ULL,
+  1000000000ULL,
+  10000000000ULL,
+  100000000000ULL,
+  1000000000000ULL,
+  10000000000000ULL,
+  100000000000000ULL,
+  1000000000000000ULL,
+  10000000000000000ULL,
+  100000000000000000ULL,
+  1000000000000000000ULL,
+  10000000000000000000ULL,
+};
+
+static inline DiyFp _dtoa_diyfp(double d) {
+  uint64_t u;
+  memcpy(&u, &d, sizeof(u));
+  int biased_e = (int)((u & DTOA_EXPONENT_MASK) >> DTOA_SIGNIFICAND_SIZE);
+  uint64_t significand = u & DTOA_SIGNIFICAND_MASK;
+
+  DiyFp r;
+  if (biased_e != 0) {
+    r.f = significand + DTOA_HIDDEN_BIT;
+    r.e = biased_e - DTOA_EXPONENT_BIAS;
+  } else {
+    // subnormal
+    r.f = significand;
+    r.e = DTOA_MIN_EXPONENT + 1;
+  }
+  return r;
+}
+
+static inline DiyFp _dtoa_mul(DiyFp x, DiyFp y) {
+  // upper 64 bits of the 128-bit product, rounded
+  const uint64_t m32 = 0xFFFFFFFFULL;
+  uint64_t a = x.f >> 32, b = x.f & m32;
+  uint64_t c = y.f >> 32, d = y.f & m32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+  tmp += 1ULL << 31;
+
+  DiyFp r = {ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64};
+  return r;
+}
+
+static inline DiyFp _dtoa_normalize(DiyFp x) {
+  while (!(x.f & (1ULL << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+static inline void _dtoa_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus) {
+  DiyFp pl = {(v.f << 1) + 1, v.e - 1};
+  pl = _dtoa_normalize(pl);
+
+  DiyFp mi;
+  if (v.f == DTOA_HIDDEN_BIT) {
+    // the gap below a power of two is half as wide
+    mi.f = (v.f << 2) - 1;
+    mi.e = v.e - 2;
+  } else {
+    mi.f = (v.f << 1) - 1;
+    mi.e = v.e - 1;
+  }
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+
+  *minus = mi;
+  *plus = pl;
+}
+
+static inline DiyFp _dtoa_cached_power(int e, int *K) {
+  // find c = 10^-K such that the product with a DiyFp of exponent e has its
+  // exponent in [-60, -32]
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int k = (int)dk;
+  if (dk - k > 0.0) {
+    k++;
+  }
+  int index = (k >> 3) + 1;
+  *K = -(-348 + index * 8);
+  return dtoa_cached_powers[index];
+}
+
+static inline void _dtoa_round(
+  char *buf,
+  int len,
+  uint64_t delta,
+  uint64_t rest,
+  uint64_t ten_kappa,
+  uint64_t wp_w) {
+  // move the last digit towards the exact value while staying inside the
+  // rounding interval
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+static inline int _dtoa_count_digits(uint32_t n) {
+  int digits = 1;
+  while (digits < 10 && n >= dtoa_pow10[digits]) {
+    digits++;
+  }
+  return digits;
+}
+
+static inline int
+_dtoa_digit_gen(DiyFp W, DiyFp Mp, uint64_t delta, char *buf, int *K) {
+  DiyFp one = {1ULL << -Mp.e, Mp.e};
+  uint64_t wp_w = Mp.f - W.f;
+  uint32_t p1 = (uint32_t)(Mp.f >> -one.e);
+  uint64_t p2 = Mp.f & (one.f - 1);
+  int kappa = _dtoa_count_digits(p1);
+  int len = 0;
+
+  // integral part
+  while (kappa > 0) {
+    uint32_t div = (uint32_t)dtoa_pow10[kappa - 1];
+    uint32_t d = p1 / div;
+    p1 %= div;
+    if (d || len) {
+      buf[len++] = (char)('0' + d);
+    }
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if (rest <= delta) {
+      *K += kappa;
+      _dtoa_round(buf, len, delta, rest, dtoa_pow10[kappa] << -one.e, wp_w);
+      return len;
+    }
+  }
+
+  // fractional part
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || len) {
+      buf[len++] = (char)('0' + d);
+    }
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *K += kappa;
+      uint64_t scaled_wp_w = -kappa < 20 ? wp_w * dtoa_pow10[-kappa] : 0;
+      _dtoa_round(buf, len, delta, p2, one.f, scaled_wp_w);
+      return len;
+    }
+  }
+}
+
+static inline int _dtoa_grisu2(double value, char *buf, int *K) {
+  // buf receives the digits, value = digits * 10^K
+  DiyFp v = _dtoa_diyfp(value);
+  DiyFp w_m, w_p;
+  _dtoa_boundaries(v, &w_m, &w_p);
+
+  DiyFp c_mk = _dtoa_cached_power(w_p.e, K);
+  DiyFp W = _dtoa_mul(_dtoa_normalize(v), c_mk);
+  DiyFp Wp = _dtoa_mul(w_p, c_mk);
+  DiyFp Wm = _dtoa_mul(w_m, c_mk);
+  Wm.f++;
+  Wp.f--;
+  return _dtoa_digit_gen(W, Wp, Wp.f - Wm.f, buf, K);
+}
+
+static inline int _dtoa_exponent(int e, char *buf) {
+  int len = 0;
+  buf[len++] = 'e';
+  if (e < 0) {
+    buf[len++] = '-';
+    e = -e;
+  } else {
+    buf[len++] = '+';
+  }
+  if (e >= 100) {
+    buf[len++] = (char)('0' + e / 100);
+    e %= 100;
+  }
+  buf[len++] = (char)('0' + e / 10);
+  buf[len++] = (char)('0' + e % 10);
+  return len;
+}
+
+static inline int _dtoa_layout(char *buf, int len, int K) {
+  // decimal point position relative to the start of the digits
+  int kk = len + K;
+
+  if (len <= kk && kk <= 17) {
+    // 1234e7 -> 12340000000.0
+    memset(buf + len, '0', kk - len);
+    buf[kk] = '.';
+    buf[kk + 1] = '0';
+    return kk + 2;
+  } else if (0 < kk && kk <= 17) {
+    // 1234e-2 -> 12.34
+    memmove(buf + kk + 1, buf + kk, len - kk);
+    buf[kk] = '.';
+    return len + 1;
+  } else if (-4 < kk && kk <= 0) {
+    // 1234e-6 -> 0.001234
+    int offset = 2 - kk;
+    memmove(buf + offset, buf, len);
+    buf[0] = '0';
+    buf[1] = '.';
+    memset(buf + 2, '0', offset - 2);
+    return len + offset;
+  } else if (len == 1) {
+    // 1e30 -> 1e+30
+    return 1 + _dtoa_exponent(kk - 1, buf + 1);
+  } else {
+    // 1234e30 -> 1.234e+33
+    memmove(buf + 2, buf + 1, len - 1);
+    buf[1] = '.';
+    return len + 1 + _dtoa_exponent(kk - 1, buf + len + 1);
+  }
+}
+
+/*
+ * Write the shortest representation of x which reads back as x into buf,
+ * which must hold at least VEC_DTOA_BUFSIZE chars. Returns the length of the
+ * written string, which is also NUL-terminated.
+ */
+static inline int vec_dtoa(double x, char *buf) {
+  int len = 0;
+
+  if (isnan(x)) {
+    memcpy(buf, "nan", 4);
+    return 3;
+  }
+  if (signbit(x)) {
+    buf[len++] = '-';
+    x = -x;
+  }
+  if (isinf(x)) {
+    memcpy(buf + len, "inf", 4);
+    return len + 3;
+  } else if (x == 0) {
+    memcpy(buf + len, "0.0", 4);
+    return len + 3;
+  }
+
+  int K;
+  int ndigits = _dtoa_grisu2(x, buf + len, &K);
+  len += _dtoa_layout(buf + len, ndigits, K);
+  buf[len] = '\0';
+  return len;
+}
+
+#endif /* ifndef VECTORIZE_DTOA_H */